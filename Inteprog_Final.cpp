@@ -5,373 +5,7875 @@
 #include <stdexcept>
 #include <cctype>
 #include <algorithm>
+#include <unordered_map>
+#include <unordered_set>
+#include <chrono>
+#include <random>
+#include <memory>
+#include <memory_resource>
+#include <atomic>
+#include <new>
+#include <cstdlib>
+#include <cstdint>
+#include <string_view>
+#include <sstream>
+#include <fstream>
+#include <cstdio>
+#include <thread>
+#include <mutex>
+#include <shared_mutex>
+#include <condition_variable>
+#include <queue>
+#include <deque>
+#include <functional>
+#include <array>
+#include <charconv>
+#include <type_traits>
+#include <filesystem>
+#include <map>
+#include <numeric>
+#include <future>
+#include <cmath>
+#include <cerrno>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define SHOP_POSIX 1
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <signal.h>
+#include <pthread.h>
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#include <cstring>
 
 using namespace std;
 
+// ----------------------------- Money Class -----------------------------
+// An exact peso amount stored as a whole number of centavos. Integer sums
+// do not depend on the order they are added in, unlike doubles.
+class Money {
+private:
+    int64_t centavos;
+
+    explicit constexpr Money(int64_t cents) : centavos(cents) {}
+
+public:
+    constexpr Money() : centavos(0) {}
+    constexpr Money(int64_t pesos, int cents) : centavos(pesos * 100 + cents) {}
+
+    static constexpr Money fromCentavos(int64_t cents) { return Money(cents); }
+    constexpr int64_t getCentavos() const { return centavos; }
+
+    Money operator+(Money other) const { return Money(centavos + other.centavos); }
+    Money operator-(Money other) const { return Money(centavos - other.centavos); }
+    Money operator*(int64_t quantity) const { return Money(centavos * quantity); }
+    Money& operator+=(Money other) { centavos += other.centavos; return *this; }
+    Money& operator-=(Money other) { centavos -= other.centavos; return *this; }
+
+    bool operator==(Money other) const { return centavos == other.centavos; }
+    bool operator!=(Money other) const { return centavos != other.centavos; }
+    bool operator<(Money other) const { return centavos < other.centavos; }
+
+    // Always two decimals, e.g. "32456.75" or "500.00"
+    string toString() const {
+        int64_t whole = centavos < 0 ? -centavos : centavos;
+        string cents = to_string(whole % 100);
+        if (cents.size() < 2)
+            cents.insert(cents.begin(), '0');
+        return (centavos < 0 ? "-" : "") + to_string(whole / 100) + "." + cents;
+    }
+};
+
+ostream& operator<<(ostream& out, Money amount) {
+    return out << amount.toString();
+}
+
+// ----------------------------- Render Buffer -----------------------------
+// Text is formatted into a reusable buffer and written out with one call,
+// instead of flushing the stream after every line.
+class RenderBuffer {
+private:
+    string text;
+
+public:
+    RenderBuffer& operator<<(string_view s) { text.append(s.data(), s.size()); return *this; }
+    RenderBuffer& operator<<(const char* s) { return *this << string_view(s); }
+    RenderBuffer& operator<<(const string& s) { return *this << string_view(s); }
+    RenderBuffer& operator<<(char c) { text.push_back(c); return *this; }
+
+    template <typename T, typename = enable_if_t<is_integral<T>::value>>
+    RenderBuffer& operator<<(T value) {
+        char digits[24];
+        auto result = to_chars(digits, digits + sizeof(digits), value);
+        text.append(digits, result.ptr);
+        return *this;
+    }
+
+    RenderBuffer& operator<<(Money amount) {
+        int64_t cents = amount.getCentavos();
+        if (cents < 0) {
+            text.push_back('-');
+            cents = -cents;
+        }
+        *this << cents / 100;
+        text.push_back('.');
+        text.push_back(char('0' + cents % 100 / 10));
+        text.push_back(char('0' + cents % 10));
+        return *this;
+    }
+
+    void clear() { text.clear(); }
+    size_t size() const { return text.size(); }
+    const string& str() const { return text; }
+
+    void writeTo(ostream& out) const { out.write(text.data(), text.size()); }
+    void writeTo(FILE* file) const { fwrite(text.data(), 1, text.size(), file); }
+};
+
 // ----------------------------- Product Class -----------------------------
 class Product {
 private:
     int id;
     string name;
-    double price;
+    Money price;
+    vector<string> categories;
 
 public:
-    Product(int pid, const string& pname, double pprice)
-        : id(pid), name(pname), price(pprice) {}
+    Product(int pid, string_view pname, Money pprice, vector<string> pcategories = {})
+        : id(pid), name(pname), price(pprice), categories(move(pcategories)) {}
 
     int getId() const { return id; }
-    string getName() const { return name; }
-    double getPrice() const { return price; }
+    string_view getName() const { return name; }
+    Money getPrice() const { return price; }
+    const vector<string>& getCategories() const { return categories; }
 };
 
-// ----------------------------- User Class -----------------------------
-class User {
+// ----------------------------- Product Index -----------------------------
+// Maps a product id to its slot in the catalog vector. Ids that are packed
+// closely use a direct table; sparse ids fall back to a hash map.
+class ProductIndex {
 private:
-    string username;
-    string email;       
-    string address;
+    vector<int> denseSlots; // denseSlots[id] = slot, -1 if absent
+    unordered_map<int, int> sparseSlots;
+    bool dense = true;
+
+public:
+    void build(const vector<int>& ids) {
+        denseSlots.clear();
+        sparseSlots.clear();
+        int minId = 0, maxId = 0;
+        for (int id : ids) {
+            minId = min(minId, id);
+            maxId = max(maxId, id);
+        }
+        dense = minId >= 0 && (size_t)maxId <= ids.size() * 2 + 64;
+        if (dense) {
+            denseSlots.assign((size_t)maxId + 1, -1);
+            for (size_t slot = 0; slot < ids.size(); ++slot)
+                denseSlots[ids[slot]] = (int)slot;
+        } else {
+            sparseSlots.reserve(ids.size());
+            for (size_t slot = 0; slot < ids.size(); ++slot)
+                sparseSlots[ids[slot]] = (int)slot;
+        }
+    }
+
+    int find(int productId) const {
+        if (dense) {
+            if (productId < 0 || (size_t)productId >= denseSlots.size())
+                return -1;
+            return denseSlots[productId];
+        }
+        auto it = sparseSlots.find(productId);
+        return it == sparseSlots.end() ? -1 : it->second;
+    }
+};
+
+// ----------------------------- Catalog Snapshot -----------------------------
+// Sorted lists of catalog slots, e.g. the products in one category
+struct SlotList {
+    const uint32_t* first = nullptr;
+    const uint32_t* last = nullptr;
+
+    const uint32_t* begin() const { return first; }
+    const uint32_t* end() const { return last; }
+    size_t size() const { return last - first; }
+};
+
+// Intersects two ascending slot lists. Lists of similar length are merged;
+// a much shorter list gallops through the longer one, so the cost is about
+// O(short * log(long)) instead of O(long).
+void intersectSlots(SlotList a, SlotList b, vector<uint32_t>& out) {
+    out.clear();
+    if (a.size() > b.size())
+        swap(a, b);
+    if (a.size() * 8 < b.size()) {
+        size_t pos = 0;
+        for (uint32_t slot : a) {
+            size_t step = 1, probe = pos;
+            while (probe < b.size() && b.first[probe] < slot) {
+                pos = probe + 1;
+                probe = pos + step;
+                step *= 2;
+            }
+            pos = lower_bound(b.first + pos, b.first + min(probe, b.size()), slot) - b.first;
+            if (pos == b.size())
+                break;
+            if (b.first[pos] == slot)
+                out.push_back(slot);
+        }
+    } else {
+        set_intersection(a.begin(), a.end(), b.begin(), b.end(), back_inserter(out));
+    }
+}
+
+// Category names are matched case-insensitively
+string normalizeCategory(string_view name) {
+    size_t start = name.find_first_not_of(" \t"), stop = name.find_last_not_of(" \t");
+    string key = start == string_view::npos ? string() : string(name.substr(start, stop - start + 1));
+    for (char& c : key)
+        c = (char)tolower((unsigned char)c);
+    return key;
+}
+
+// Raw columns of a catalog, pointing either into a snapshot's own vectors
+// or into a mapped catalog file. Categories are sorted by name; posting
+// list c holds the slots of category c's products in ascending order.
+struct CatalogColumns {
+    uint64_t productCount = 0;
+    const int32_t* ids = nullptr;
+    const int64_t* prices = nullptr; // centavos
+    const uint32_t* nameOffsets = nullptr; // name of slot i is [nameOffsets[i], nameOffsets[i + 1])
+    const char* names = nullptr;
+
+    // Prebuilt id index (catalog files and the kiosk catalog): idTable[id]
+    // = slot when dense, otherwise an open-addressing table of slots probed
+    // from the top bits of id * idHashMultiplier
+    const int32_t* idTable = nullptr;
+    uint64_t idTableSize = 0;
+    bool idTableDense = true;
+    uint32_t idHashMultiplier = 2654435761u;
+
+    uint64_t categoryCount = 0;
+    const uint32_t* categoryNameOffsets = nullptr;
+    const char* categoryNames = nullptr;
+    const uint32_t* postingOffsets = nullptr; // list c is postings[postingOffsets[c] .. postingOffsets[c + 1])
+    const uint32_t* postings = nullptr;
+};
+
+// An immutable, versioned catalog shared read-only by every cart. Products
+// are stored column by column (ids, prices, name offsets) with all names
+// packed into one string blob, so totals only touch the price column.
+// Each category keeps an inverted list of its products' slots.
+class CatalogSnapshot {
+private:
+    uint64_t version;
+    CatalogColumns columns;
+    int idTableShift = 32;
+    shared_ptr<const void> backing; // keeps a mapped file alive
+
+    vector<int32_t> idColumn;
+    vector<int64_t> priceColumn;
+    vector<uint32_t> nameOffsetColumn;
+    string nameBlob;
+    ProductIndex index;
+    vector<uint32_t> categoryNameOffsetColumn;
+    string categoryNameBlob;
+    vector<uint32_t> postingOffsetColumn;
+    vector<uint32_t> postingColumn;
+
+public:
+    CatalogSnapshot(uint64_t ver, const vector<Product>& products) : version(ver) {
+        idColumn.reserve(products.size());
+        priceColumn.reserve(products.size());
+        nameOffsetColumn.reserve(products.size() + 1);
+        map<string, vector<uint32_t>> categorySlots;
+        for (const auto& prod : products) {
+            uint32_t slot = (uint32_t)idColumn.size();
+            idColumn.push_back(prod.getId());
+            priceColumn.push_back(prod.getPrice().getCentavos());
+            nameOffsetColumn.push_back((uint32_t)nameBlob.size());
+            nameBlob += prod.getName();
+            for (const string& category : prod.getCategories()) {
+                string key = normalizeCategory(category);
+                vector<uint32_t>& slots = categorySlots[key];
+                if (!key.empty() && (slots.empty() || slots.back() != slot))
+                    slots.push_back(slot);
+            }
+        }
+        nameOffsetColumn.push_back((uint32_t)nameBlob.size());
+        index.build(idColumn);
+
+        categoryNameOffsetColumn.push_back(0);
+        postingOffsetColumn.push_back(0);
+        for (const auto& entry : categorySlots) {
+            if (entry.second.empty())
+                continue;
+            categoryNameBlob += entry.first;
+            categoryNameOffsetColumn.push_back((uint32_t)categoryNameBlob.size());
+            postingColumn.insert(postingColumn.end(), entry.second.begin(), entry.second.end());
+            postingOffsetColumn.push_back((uint32_t)postingColumn.size());
+        }
+
+        columns.productCount = products.size();
+        columns.ids = idColumn.data();
+        columns.prices = priceColumn.data();
+        columns.nameOffsets = nameOffsetColumn.data();
+        columns.names = nameBlob.data();
+        columns.categoryCount = categoryNameOffsetColumn.size() - 1;
+        columns.categoryNameOffsets = categoryNameOffsetColumn.data();
+        columns.categoryNames = categoryNameBlob.data();
+        columns.postingOffsets = postingOffsetColumn.data();
+        columns.postings = postingColumn.data();
+    }
+
+    // Uses columns that already exist elsewhere in memory, kept alive by owner
+    CatalogSnapshot(uint64_t ver, const CatalogColumns& cols, shared_ptr<const void> owner)
+        : version(ver), columns(cols), backing(move(owner)) {
+        while (idTableShift > 0 && (1ull << (32 - idTableShift)) < columns.idTableSize)
+            --idTableShift;
+    }
+
+    CatalogSnapshot(const CatalogSnapshot&) = delete;
+    CatalogSnapshot& operator=(const CatalogSnapshot&) = delete;
+
+    static uint32_t hashId(int productId) { return (uint32_t)productId * 2654435761u; }
+
+    uint64_t getVersion() const { return version; }
+    size_t size() const { return columns.productCount; }
+    const CatalogColumns& getColumns() const { return columns; }
+
+    int findSlot(int productId) const {
+        if (!columns.idTable)
+            return index.find(productId);
+        if (columns.idTableDense)
+            return (uint64_t)(uint32_t)productId < columns.idTableSize ? columns.idTable[productId] : -1;
+        uint64_t mask = columns.idTableSize - 1;
+        for (uint64_t pos = ((uint32_t)productId * columns.idHashMultiplier) >> idTableShift;; pos = (pos + 1) & mask) {
+            int32_t slot = columns.idTable[pos];
+            if (slot < 0 || columns.ids[slot] == productId)
+                return slot;
+        }
+    }
+
+    int idAt(int slot) const { return columns.ids[slot]; }
+    Money priceAt(int slot) const { return Money::fromCentavos(columns.prices[slot]); }
+    string_view nameAt(int slot) const {
+        const uint32_t* offsets = columns.nameOffsets;
+        return string_view(columns.names + offsets[slot], offsets[slot + 1] - offsets[slot]);
+    }
+
+    Product productAt(int slot) const {
+        return Product(idAt(slot), string(nameAt(slot)), priceAt(slot));
+    }
+
+    size_t categoryCount() const { return columns.categoryCount; }
+    string_view categoryName(int category) const {
+        const uint32_t* offsets = columns.categoryNameOffsets;
+        return string_view(columns.categoryNames + offsets[category], offsets[category + 1] - offsets[category]);
+    }
+    SlotList categorySlots(int category) const {
+        const uint32_t* offsets = columns.postingOffsets;
+        return {columns.postings + offsets[category], columns.postings + offsets[category + 1]};
+    }
+
+    // Binary search over the sorted category names; -1 if there is none
+    int findCategory(string_view name) const {
+        string key = normalizeCategory(name);
+        int low = 0, high = (int)columns.categoryCount;
+        while (low < high) {
+            int mid = (low + high) / 2;
+            if (categoryName(mid) < key)
+                low = mid + 1;
+            else
+                high = mid;
+        }
+        return low < (int)columns.categoryCount && categoryName(low) == key ? low : -1;
+    }
+
+    // Slots of the products that are in every one of the given categories,
+    // in catalog order. Starts from the shortest list, so the cost follows
+    // the result size rather than the catalog size.
+    vector<uint32_t> slotsInCategories(const vector<string>& names) const {
+        vector<SlotList> lists;
+        for (const string& name : names) {
+            int category = findCategory(name);
+            if (category < 0)
+                throw runtime_error("No category named " + name + ".");
+            lists.push_back(categorySlots(category));
+        }
+        vector<uint32_t> result, next;
+        if (lists.empty())
+            return result;
+        sort(lists.begin(), lists.end(), [](SlotList a, SlotList b) { return a.size() < b.size(); });
+        result.assign(lists[0].begin(), lists[0].end());
+        for (size_t i = 1; i < lists.size() && !result.empty(); ++i) {
+            intersectSlots({result.data(), result.data() + result.size()}, lists[i], next);
+            result.swap(next);
+        }
+        return result;
+    }
+
+    // Gather-multiply-accumulate over (slot, quantity) lines. The sum is in
+    // integer centavos, so the compiler is free to vectorize and reorder it.
+    Money valueLines(const int* slots, const int* quantities, size_t count) const {
+        const int64_t* price = columns.prices;
+        int64_t total = 0;
+        for (size_t i = 0; i < count; ++i)
+            total += price[slots[i]] * quantities[i];
+        return Money::fromCentavos(total);
+    }
+};
+
+using CatalogRef = shared_ptr<const CatalogSnapshot>;
+
+uint64_t nextCatalogVersion() {
+    static atomic<uint64_t> nextVersion{1};
+    return nextVersion++;
+}
+
+CatalogRef makeCatalogSnapshot(vector<Product> products) {
+    return make_shared<const CatalogSnapshot>(nextCatalogVersion(), move(products));
+}
+
+// Which prices changed over a run of published catalogs that keep every
+// product in the same slot, so a cart moving forward reprices only its
+// stale lines. changedAt[slot] is how many versions after slotsSince the
+// slot's price last changed, and latestFirst lists the changed slots by
+// that, newest first; a catalog that adds, removes or moves a product
+// starts a new run.
+struct CatalogChanges {
+    uint64_t slotsSince = 0; // version of the first catalog in the run
+    uint64_t version = 0;    // the catalog these changes lead up to
+    vector<uint32_t> changedAt;
+    vector<uint32_t> latestFirst;
+
+    // Whether a cart priced against that version has its lines in the same slots
+    bool keepsSlotsOf(uint64_t pricedVersion) const {
+        return pricedVersion >= slotsSince && pricedVersion <= version;
+    }
+    bool changedAfter(int slot, uint64_t pricedVersion) const {
+        return slotsSince + changedAt[slot] > pricedVersion;
+    }
+    // How many slots of latestFirst changed after that version
+    size_t countChangedAfter(uint64_t pricedVersion) const {
+        return partition_point(latestFirst.begin(), latestFirst.end(),
+                               [&](uint32_t slot) { return changedAfter((int)slot, pricedVersion); })
+               - latestFirst.begin();
+    }
+
+    // The changes up to next, continuing before (those up to previous) if
+    // next has the same products in the same slots
+    static shared_ptr<const CatalogChanges> between(const CatalogSnapshot& previous, const CatalogChanges& before,
+                                                    const CatalogSnapshot& next) {
+        shared_ptr<CatalogChanges> changes(new CatalogChanges);
+        changes->version = next.getVersion();
+        size_t count = next.size();
+        bool sameSlots = count == previous.size() && before.version == previous.getVersion()
+                         && next.getVersion() - before.slotsSince <= UINT32_MAX;
+        for (size_t slot = 0; sameSlots && slot < count; ++slot)
+            sameSlots = next.idAt((int)slot) == previous.idAt((int)slot);
+        if (!sameSlots) {
+            changes->slotsSince = next.getVersion();
+            changes->changedAt.assign(count, 0);
+            return changes;
+        }
+        changes->slotsSince = before.slotsSince;
+        changes->changedAt = before.changedAt;
+        uint32_t now = (uint32_t)(next.getVersion() - before.slotsSince);
+        for (size_t slot = 0; slot < count; ++slot) {
+            if (next.priceAt((int)slot) != previous.priceAt((int)slot)) {
+                changes->changedAt[slot] = now;
+                changes->latestFirst.push_back((uint32_t)slot);
+            }
+        }
+        for (uint32_t slot : before.latestFirst)
+            if (changes->changedAt[slot] != now)
+                changes->latestFirst.push_back(slot);
+        return changes;
+    }
+
+    static shared_ptr<const CatalogChanges> first(const CatalogSnapshot& catalog) {
+        shared_ptr<CatalogChanges> changes(new CatalogChanges);
+        changes->slotsSince = changes->version = catalog.getVersion();
+        changes->changedAt.assign(catalog.size(), 0);
+        return changes;
+    }
+};
+
+// ----------------------------- Built-in Catalog -----------------------------
+// The products sold when no catalog file is given. Categories are
+// separated by semicolons, as in catalog CSV files.
+struct BuiltInProduct {
+    int32_t id;
+    string_view name;
+    int64_t centavos;
+    string_view categories;
+};
+
+constexpr BuiltInProduct builtInProducts[] = {
+    {1, "Laptop", 3245675, "Computers"},
+    {2, "Mouse", 87654, "Peripherals"},
+    {3, "Keyboard", 123456, "Peripherals"},
+    {4, "Headset", 543211, "Audio;Gaming"},
+    {5, "Earphones", 24555, "Audio"},
+    {6, "Controller", 99999, "Gaming;Peripherals"},
+    {7, "Mousepad", 35055, "Accessories"},
+    {8, "Laptop Cooler", 99999, "Accessories;Computers"},
+    {9, "USB Flash Drive", 50000, "Accessories;Storage"},
+    {10, "Gaming Chair: Monobloc Edition", 444444, "Furniture;Gaming"},
+    {11, "Gaming Monitor 24hz", 240024, "Displays;Gaming"},
+};
+
+template <typename Visit>
+constexpr void forEachCategory(string_view list, Visit&& visit) {
+    for (size_t start = 0; start < list.size();) {
+        size_t stop = list.find(';', start);
+        if (stop == string_view::npos)
+            stop = list.size();
+        if (stop > start)
+            visit(list.substr(start, stop - start));
+        start = stop + 1;
+    }
+}
+
+// The products sold in the shop
+CatalogRef makeDefaultCatalog() {
+    vector<Product> products;
+    for (const BuiltInProduct& product : builtInProducts) {
+        vector<string> categories;
+        forEachCategory(product.categories, [&](string_view name) { categories.emplace_back(name); });
+        products.emplace_back(product.id, product.name, Money::fromCentavos(product.centavos), move(categories));
+    }
+    return makeCatalogSnapshot(move(products));
+}
+
+#ifdef SHOP_KIOSK
+// ----------------------------- Kiosk Catalog -----------------------------
+// Kiosk firmware sells only the built-in products, so the compiler lays out
+// their columns, category lists and id index as read-only data. Only the
+// snapshot over them is made at runtime, once and off the heap; it finds a
+// product with one probe of a perfect hash.
+constexpr size_t kioskProductCount = sizeof(builtInProducts) / sizeof(builtInProducts[0]);
+
+constexpr char lowerAscii(char c) {
+    return c >= 'A' && c <= 'Z' ? char(c - 'A' + 'a') : c;
+}
+
+// Compares category names as normalizeCategory would leave them
+constexpr int compareCategories(string_view a, string_view b) {
+    for (size_t i = 0; i < a.size() && i < b.size(); ++i)
+        if (lowerAscii(a[i]) != lowerAscii(b[i]))
+            return lowerAscii(a[i]) < lowerAscii(b[i]) ? -1 : 1;
+    return a.size() < b.size() ? -1 : a.size() > b.size() ? 1 : 0;
+}
+
+constexpr size_t kioskCategoryMentions() {
+    size_t count = 0;
+    for (const BuiltInProduct& product : builtInProducts)
+        forEachCategory(product.categories, [&](string_view) { ++count; });
+    return count;
+}
+
+// The distinct categories, sorted
+struct KioskCategoryList {
+    array<string_view, kioskCategoryMentions()> names{};
+    size_t count = 0;
+};
+
+constexpr KioskCategoryList listKioskCategories() {
+    KioskCategoryList list;
+    for (const BuiltInProduct& product : builtInProducts)
+        forEachCategory(product.categories, [&](string_view name) {
+            size_t pos = 0;
+            while (pos < list.count && compareCategories(list.names[pos], name) < 0)
+                ++pos;
+            if (pos < list.count && compareCategories(list.names[pos], name) == 0)
+                return;
+            for (size_t i = list.count; i > pos; --i)
+                list.names[i] = list.names[i - 1];
+            list.names[pos] = name;
+            ++list.count;
+        });
+    return list;
+}
+
+constexpr KioskCategoryList kioskCategories = listKioskCategories();
+
+constexpr size_t kioskNameBytes() {
+    size_t bytes = 0;
+    for (const BuiltInProduct& product : builtInProducts)
+        bytes += product.name.size();
+    return bytes;
+}
+
+constexpr size_t kioskCategoryNameBytes() {
+    size_t bytes = 0;
+    for (size_t c = 0; c < kioskCategories.count; ++c)
+        bytes += kioskCategories.names[c].size();
+    return bytes;
+}
+
+// The same columns a CatalogSnapshot builds at runtime
+struct KioskColumns {
+    array<int32_t, kioskProductCount> ids{};
+    array<int64_t, kioskProductCount> prices{};
+    array<uint32_t, kioskProductCount + 1> nameOffsets{};
+    array<char, kioskNameBytes() + 1> names{};
+    array<uint32_t, kioskCategories.count + 1> categoryNameOffsets{};
+    array<char, kioskCategoryNameBytes() + 1> categoryNames{};
+    array<uint32_t, kioskCategories.count + 1> postingOffsets{};
+    array<uint32_t, kioskCategoryMentions() + 1> postings{};
+};
+
+constexpr KioskColumns buildKioskColumns() {
+    KioskColumns columns;
+    uint32_t nameBytes = 0;
+    for (size_t slot = 0; slot < kioskProductCount; ++slot) {
+        const BuiltInProduct& product = builtInProducts[slot];
+        columns.ids[slot] = product.id;
+        columns.prices[slot] = product.centavos;
+        columns.nameOffsets[slot] = nameBytes;
+        for (char c : product.name)
+            columns.names[nameBytes++] = c;
+    }
+    columns.nameOffsets[kioskProductCount] = nameBytes;
+
+    uint32_t categoryBytes = 0, postings = 0;
+    for (size_t c = 0; c < kioskCategories.count; ++c) {
+        for (char ch : kioskCategories.names[c])
+            columns.categoryNames[categoryBytes++] = lowerAscii(ch);
+        columns.categoryNameOffsets[c + 1] = categoryBytes;
+        for (size_t slot = 0; slot < kioskProductCount; ++slot) {
+            bool listed = false;
+            forEachCategory(builtInProducts[slot].categories, [&](string_view name) {
+                listed = listed || compareCategories(name, kioskCategories.names[c]) == 0;
+            });
+            if (listed)
+                columns.postings[postings++] = (uint32_t)slot;
+        }
+        columns.postingOffsets[c + 1] = postings;
+    }
+    return columns;
+}
+
+constexpr KioskColumns kioskColumns = buildKioskColumns();
+
+// Whether id * multiplier puts every id in its own slot of a 2^bits table
+template <size_t Count>
+constexpr bool idsHashApart(const array<int32_t, Count>& ids, uint32_t multiplier, int bits) {
+    array<uint32_t, Count> positions{};
+    for (size_t i = 0; i < Count; ++i) {
+        uint32_t pos = ((uint32_t)ids[i] * multiplier) >> (32 - bits);
+        size_t at = i;
+        for (; at > 0 && positions[at - 1] > pos; --at)
+            positions[at] = positions[at - 1];
+        if (at > 0 && positions[at - 1] == pos)
+            return false;
+        positions[at] = pos;
+    }
+    return true;
+}
+
+struct IdHashChoice {
+    int bits;
+    uint32_t multiplier;
+};
+
+// The smallest table, at least twice the number of ids, for which one of
+// the tried multipliers puts every id apart; {0, 0} if there is none
+// (e.g. an id is listed twice)
+template <size_t Count>
+constexpr IdHashChoice choosePerfectIdHash(const array<int32_t, Count>& ids) {
+    int bits = 1;
+    while ((size_t(1) << bits) < 2 * Count)
+        ++bits;
+    for (; bits <= 24; ++bits) {
+        uint32_t multiplier = 2654435761u;
+        for (int attempt = 0; attempt < 256; ++attempt, multiplier += 0x9E3779B8u) // stays odd
+            if (idsHashApart(ids, multiplier, bits))
+                return {bits, multiplier};
+    }
+    return {0, 0};
+}
+
+// Slot of each id at its hashed position, -1 elsewhere. Every id is at
+// its first probe, so findSlot never walks the table for a listed id.
+template <size_t Count, int Bits>
+struct PerfectIdTable {
+    array<int32_t, size_t(1) << Bits> slots{};
+
+    constexpr PerfectIdTable(const array<int32_t, Count>& ids, uint32_t multiplier) {
+        for (int32_t& slot : slots)
+            slot = -1;
+        for (size_t i = 0; i < Count; ++i)
+            slots[((uint32_t)ids[i] * multiplier) >> (32 - Bits)] = (int32_t)i;
+    }
+};
+
+constexpr IdHashChoice kioskIdHash = choosePerfectIdHash(kioskColumns.ids);
+static_assert(kioskIdHash.bits > 0, "Built-in product ids must be distinct.");
+constexpr PerfectIdTable<kioskProductCount, kioskIdHash.bits> kioskIdTable(kioskColumns.ids, kioskIdHash.multiplier);
+
+constexpr CatalogColumns kioskCatalogColumns() {
+    CatalogColumns cols;
+    cols.productCount = kioskProductCount;
+    cols.ids = kioskColumns.ids.data();
+    cols.prices = kioskColumns.prices.data();
+    cols.nameOffsets = kioskColumns.nameOffsets.data();
+    cols.names = kioskColumns.names.data();
+    cols.idTable = kioskIdTable.slots.data();
+    cols.idTableSize = kioskIdTable.slots.size();
+    cols.idTableDense = false;
+    cols.idHashMultiplier = kioskIdHash.multiplier;
+    cols.categoryCount = kioskCategories.count;
+    cols.categoryNameOffsets = kioskColumns.categoryNameOffsets.data();
+    cols.categoryNames = kioskColumns.categoryNames.data();
+    cols.postingOffsets = kioskColumns.postingOffsets.data();
+    cols.postings = kioskColumns.postings.data();
+    return cols;
+}
+
+// A snapshot over the constant columns, made on the first call: it takes
+// its version from nextCatalogVersion like any other catalog, so it cannot
+// be a constant itself. It is never freed, so the reference shares no
+// ownership and allocates no control block.
+CatalogRef makeKioskCatalog() {
+    static const CatalogSnapshot snapshot(nextCatalogVersion(), kioskCatalogColumns(), nullptr);
+    return CatalogRef(CatalogRef(), &snapshot);
+}
+#endif
+
+// ----------------------------- Catalog File -----------------------------
+// On-disk catalog laid out exactly like CatalogColumns, so a mapped file is
+// used in place with no parse or copy step:
+//   header | ids (int32) | prices (int64 centavos) | name offsets (uint32,
+//   one per product plus an end offset) | id index (int32 slots) |
+//   category name offsets | posting offsets | postings (uint32 slots) |
+//   names | category names
+// Sections start on 8-byte boundaries; integers are in native byte order.
+struct CatalogFileHeader {
+    char magic[8];
+    uint64_t productCount;
+    uint64_t indexSize;
+    uint32_t indexDense;
+    uint32_t reserved;
+    uint64_t categoryCount;
+    uint64_t idsOffset;
+    uint64_t pricesOffset;
+    uint64_t nameOffsetsOffset;
+    uint64_t indexOffset;
+    uint64_t categoryNameOffsetsOffset;
+    uint64_t postingOffsetsOffset;
+    uint64_t postingsOffset;
+    uint64_t namesOffset;
+    uint64_t categoryNamesOffset;
+    uint64_t fileSize;
+};
+
+const char catalogFileMagic[8] = {'S', 'H', 'O', 'P', 'C', 'A', 'T', '2'};
+
+void writeCatalogFile(const CatalogSnapshot& catalog, const string& path) {
+    const CatalogColumns& cols = catalog.getColumns();
+    size_t count = cols.productCount;
+    const int32_t* ids = cols.ids;
+
+    // Same rule as ProductIndex: packed ids get a direct table, sparse ids
+    // an open-addressing table at most half full
+    int64_t minId = 0, maxId = 0;
+    for (size_t slot = 0; slot < count; ++slot) {
+        minId = min<int64_t>(minId, ids[slot]);
+        maxId = max<int64_t>(maxId, ids[slot]);
+    }
+    bool dense = minId >= 0 && (uint64_t)maxId <= count * 2 + 64;
+    vector<int32_t> table;
+    if (dense) {
+        table.assign((size_t)maxId + 1, -1);
+        for (size_t slot = 0; slot < count; ++slot) {
+            if (table[ids[slot]] >= 0)
+                throw runtime_error("Duplicate product ID " + to_string(ids[slot]) + ".");
+            table[ids[slot]] = (int32_t)slot;
+        }
+    } else {
+        int bits = 4;
+        while ((1ull << bits) < count * 2)
+            ++bits;
+        table.assign(1ull << bits, -1);
+        uint64_t mask = table.size() - 1;
+        for (size_t slot = 0; slot < count; ++slot) {
+            uint64_t pos = CatalogSnapshot::hashId(ids[slot]) >> (32 - bits);
+            for (; table[pos] >= 0; pos = (pos + 1) & mask)
+                if (ids[table[pos]] == ids[slot])
+                    throw runtime_error("Duplicate product ID " + to_string(ids[slot]) + ".");
+            table[pos] = (int32_t)slot;
+        }
+    }
+
+    size_t categories = cols.categoryCount;
+    size_t postingCount = cols.postingOffsets[categories];
+    auto align = [](uint64_t offset) { return (offset + 7) & ~(uint64_t)7; };
+    CatalogFileHeader header = {};
+    memcpy(header.magic, catalogFileMagic, sizeof(header.magic));
+    header.productCount = count;
+    header.indexSize = table.size();
+    header.indexDense = dense;
+    header.categoryCount = categories;
+    header.idsOffset = align(sizeof(header));
+    header.pricesOffset = align(header.idsOffset + count * sizeof(int32_t));
+    header.nameOffsetsOffset = align(header.pricesOffset + count * sizeof(int64_t));
+    header.indexOffset = align(header.nameOffsetsOffset + (count + 1) * sizeof(uint32_t));
+    header.categoryNameOffsetsOffset = align(header.indexOffset + table.size() * sizeof(int32_t));
+    header.postingOffsetsOffset = align(header.categoryNameOffsetsOffset + (categories + 1) * sizeof(uint32_t));
+    header.postingsOffset = align(header.postingOffsetsOffset + (categories + 1) * sizeof(uint32_t));
+    header.namesOffset = align(header.postingsOffset + postingCount * sizeof(uint32_t));
+    header.categoryNamesOffset = header.namesOffset + cols.nameOffsets[count];
+    header.fileSize = header.categoryNamesOffset + cols.categoryNameOffsets[categories];
+
+    ofstream file(path, ios::binary | ios::trunc);
+    if (!file)
+        throw runtime_error("Cannot write catalog file " + path + ".");
+    auto section = [&](uint64_t offset, const void* data, size_t bytes) {
+        static const char padding[8] = {};
+        file.write(padding, offset - file.tellp());
+        file.write((const char*)data, bytes);
+    };
+    file.write((const char*)&header, sizeof(header));
+    section(header.idsOffset, ids, count * sizeof(int32_t));
+    section(header.pricesOffset, cols.prices, count * sizeof(int64_t));
+    section(header.nameOffsetsOffset, cols.nameOffsets, (count + 1) * sizeof(uint32_t));
+    section(header.indexOffset, table.data(), table.size() * sizeof(int32_t));
+    section(header.categoryNameOffsetsOffset, cols.categoryNameOffsets, (categories + 1) * sizeof(uint32_t));
+    section(header.postingOffsetsOffset, cols.postingOffsets, (categories + 1) * sizeof(uint32_t));
+    section(header.postingsOffset, cols.postings, postingCount * sizeof(uint32_t));
+    section(header.namesOffset, cols.names, cols.nameOffsets[count]);
+    section(header.categoryNamesOffset, cols.categoryNames, cols.categoryNameOffsets[categories]);
+    if (!file.flush())
+        throw runtime_error("Cannot write catalog file " + path + ".");
+}
+
+// Whether every offset and slot the catalog accessors follow stays inside
+// the image: offset columns never go backwards (their ends were checked
+// against the sections already), id table entries and postings name real
+// slots, and a hashed id table has an empty entry to end every probe.
+bool catalogImageConsistent(const CatalogColumns& cols) {
+    auto ascending = [](const uint32_t* offsets, uint64_t count) {
+        for (uint64_t i = 0; i < count; ++i)
+            if (offsets[i] > offsets[i + 1])
+                return false;
+        return true;
+    };
+    if (!ascending(cols.nameOffsets, cols.productCount) || !ascending(cols.categoryNameOffsets, cols.categoryCount)
+        || !ascending(cols.postingOffsets, cols.categoryCount))
+        return false;
+    bool hasEmpty = false;
+    for (uint64_t i = 0; i < cols.idTableSize; ++i) {
+        int32_t slot = cols.idTable[i];
+        if (slot < 0) {
+            hasEmpty = true;
+        } else if ((uint64_t)slot >= cols.productCount || (cols.idTableDense && (uint64_t)(uint32_t)cols.ids[slot] != i)) {
+            return false;
+        }
+    }
+    if (!cols.idTableDense && !hasEmpty)
+        return false;
+    for (uint64_t i = 0; i < cols.postingOffsets[cols.categoryCount]; ++i)
+        if (cols.postings[i] >= cols.productCount)
+            return false;
+    return true;
+}
+
+// Wraps a catalog file image. The header is checked first, then every
+// column the accessors follow, so a damaged or hostile file is rejected
+// instead of being read out of bounds; that check reads the whole image.
+CatalogRef catalogFromImage(const char* base, uint64_t size, shared_ptr<const void> owner, const string& path) {
+    CatalogFileHeader header;
+    if (size < sizeof(header))
+        throw runtime_error(path + " is not a catalog file.");
+    memcpy(&header, base, sizeof(header));
+    uint64_t count = header.productCount, categories = header.categoryCount;
+    bool valid = memcmp(header.magic, catalogFileMagic, sizeof(header.magic)) == 0 && header.fileSize == size
+        && count < (1ull << 31) && categories < (1ull << 31) && header.indexSize > 0 && header.indexSize <= size
+        && max({header.idsOffset, header.pricesOffset, header.nameOffsetsOffset, header.indexOffset,
+                header.categoryNameOffsetsOffset, header.postingOffsetsOffset, header.postingsOffset}) <= size
+        && (header.indexDense || (header.indexSize & (header.indexSize - 1)) == 0)
+        && header.idsOffset >= sizeof(header) && header.idsOffset + count * sizeof(int32_t) <= header.pricesOffset
+        && header.pricesOffset + count * sizeof(int64_t) <= header.nameOffsetsOffset
+        && header.nameOffsetsOffset + (count + 1) * sizeof(uint32_t) <= header.indexOffset
+        && header.indexOffset + header.indexSize * sizeof(int32_t) <= header.categoryNameOffsetsOffset
+        && header.categoryNameOffsetsOffset + (categories + 1) * sizeof(uint32_t) <= header.postingOffsetsOffset
+        && header.postingOffsetsOffset + (categories + 1) * sizeof(uint32_t) <= header.postingsOffset
+        && header.postingsOffset <= header.namesOffset && header.namesOffset <= header.categoryNamesOffset
+        && header.categoryNamesOffset <= size
+        && (header.idsOffset | header.pricesOffset | header.nameOffsetsOffset | header.indexOffset
+            | header.categoryNameOffsetsOffset | header.postingOffsetsOffset | header.postingsOffset) % 8 == 0;
+    if (!valid)
+        throw runtime_error(path + " is not a valid catalog file.");
+
+    CatalogColumns cols;
+    cols.productCount = count;
+    cols.ids = (const int32_t*)(base + header.idsOffset);
+    cols.prices = (const int64_t*)(base + header.pricesOffset);
+    cols.nameOffsets = (const uint32_t*)(base + header.nameOffsetsOffset);
+    cols.names = base + header.namesOffset;
+    cols.idTable = (const int32_t*)(base + header.indexOffset);
+    cols.idTableSize = header.indexSize;
+    cols.idTableDense = header.indexDense != 0;
+    cols.categoryCount = categories;
+    cols.categoryNameOffsets = (const uint32_t*)(base + header.categoryNameOffsetsOffset);
+    cols.categoryNames = base + header.categoryNamesOffset;
+    cols.postingOffsets = (const uint32_t*)(base + header.postingOffsetsOffset);
+    cols.postings = (const uint32_t*)(base + header.postingsOffset);
+    if (header.namesOffset + cols.nameOffsets[count] != header.categoryNamesOffset
+        || header.categoryNamesOffset + cols.categoryNameOffsets[categories] != size
+        || header.postingsOffset + cols.postingOffsets[categories] * sizeof(uint32_t) > header.namesOffset
+        || !catalogImageConsistent(cols))
+        throw runtime_error(path + " is not a valid catalog file.");
+    return make_shared<const CatalogSnapshot>(nextCatalogVersion(), cols, move(owner));
+}
+
+// Maps a catalog file read-only; pages are faulted in as products are used
+CatalogRef openCatalogFile(const string& path) {
+#ifdef SHOP_POSIX
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        throw runtime_error("Cannot open catalog file " + path + ".");
+    struct stat info;
+    void* base = MAP_FAILED;
+    if (fstat(fd, &info) == 0 && info.st_size > 0)
+        base = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED)
+        throw runtime_error("Cannot map catalog file " + path + ".");
+    size_t length = info.st_size;
+    shared_ptr<const void> mapping(base, [length](const void* addr) { munmap((void*)addr, length); });
+    return catalogFromImage((const char*)base, length, move(mapping), path);
+#else
+    ifstream file(path, ios::binary | ios::ate);
+    if (!file)
+        throw runtime_error("Cannot open catalog file " + path + ".");
+    uint64_t size = file.tellg();
+    auto image = make_shared<vector<uint64_t>>((size + 7) / 8);
+    file.seekg(0);
+    file.read((char*)image->data(), size);
+    return catalogFromImage((const char*)image->data(), size, image, path);
+#endif
+}
+
+// "32456.75" -> 3245675 centavos
+int64_t parseCentavos(string_view text) {
+    size_t dot = text.find('.');
+    string_view whole = text.substr(0, dot);
+    string_view fraction = dot == string_view::npos ? string_view() : text.substr(dot + 1);
+    int64_t pesos = 0, cents = 0;
+    auto wholeEnd = from_chars(whole.data(), whole.data() + whole.size(), pesos);
+    bool valid = !whole.empty() && wholeEnd.ec == errc() && wholeEnd.ptr == whole.data() + whole.size()
+        && pesos >= 0 && pesos <= (numeric_limits<int64_t>::max() - 99) / 100 && fraction.size() <= 2;
+    for (char c : fraction) {
+        valid = valid && isdigit((unsigned char)c);
+        cents = cents * 10 + (c - '0');
+    }
+    if (!valid)
+        throw runtime_error("Invalid price: " + string(text));
+    return pesos * 100 + (fraction.size() == 1 ? cents * 10 : cents);
+}
+
+// Reads "id,name,price[,categories]" lines, categories separated by ';'.
+// The name is everything between the id and the price, so it may contain
+// commas. A header line is skipped.
+vector<Product> readCatalogCsv(istream& in) {
+    vector<Product> products;
+    string line;
+    size_t lineNumber = 0;
+    while (getline(in, line)) {
+        ++lineNumber;
+        if (!line.empty() && line.back() == '\r')
+            line.pop_back();
+        if (line.empty() || line[0] == '#')
+            continue;
+        size_t first = line.find(','), last = line.rfind(',');
+        int id = 0;
+        auto parsed = first == string::npos ? from_chars_result{line.data(), errc::invalid_argument}
+                                            : from_chars(line.data(), line.data() + first, id);
+        if (parsed.ec != errc() || parsed.ptr != line.data() + first || first == last) {
+            if (products.empty() && lineNumber == 1)
+                continue;
+            throw runtime_error("Catalog line " + to_string(lineNumber) + ": expected id,name,price.");
+        }
+        vector<string> categories;
+        string_view lastField = string_view(line).substr(last + 1);
+        size_t priceComma = line.rfind(',', last - 1);
+        if ((lastField.empty() || lastField.find_first_not_of("0123456789.") != string_view::npos) && priceComma > first) {
+            for (size_t start = 0; start <= lastField.size();) {
+                size_t stop = min(lastField.find(';', start), lastField.size());
+                if (!normalizeCategory(lastField.substr(start, stop - start)).empty())
+                    categories.emplace_back(lastField.substr(start, stop - start));
+                start = stop + 1;
+            }
+            last = priceComma;
+        }
+        int64_t centavos = parseCentavos(string_view(line).substr(last + 1, line.find(',', last + 1) - last - 1));
+        products.push_back(Product(id, line.substr(first + 1, last - first - 1), Money::fromCentavos(centavos),
+                                   move(categories)));
+    }
+    return products;
+}
+
+// Opens a binary catalog file in place, or parses a CSV catalog
+CatalogRef loadCatalog(const string& path) {
+    ifstream file(path, ios::binary);
+    if (!file)
+        throw runtime_error("Cannot open catalog file " + path + ".");
+    char magic[sizeof(catalogFileMagic)] = {};
+    file.read(magic, sizeof(magic));
+    if (file.gcount() == sizeof(magic) && memcmp(magic, catalogFileMagic, sizeof(magic)) == 0)
+        return openCatalogFile(path);
+    file.clear();
+    file.seekg(0);
+    return makeCatalogSnapshot(readCatalogCsv(file));
+}
+
+// ----------------------------- Name Search -----------------------------
+struct SearchHit {
+    int slot;
+    double score;
+};
+
+// Trigram index over product names for substring and fuzzy search. Each
+// lowercased name (with a leading space, so word starts get their own
+// trigram) is split into three-letter keys; a name's first two letters
+// also get a key of their own. Names are grouped by length and known
+// within their group by an id (their place in it). Each key keeps, per
+// length, the ascending ids of the names that contain it; once at least
+// 1 in 32 names of that length have the key, the ids switch to a bitmap,
+// which is no bigger than the list and answers "does this name have it"
+// with one bit test. Shorter names score higher, so walking the groups in
+// order meets the best matches first, and a query stops as soon as
+// nothing left can beat the ones it has. Products can be added one at a
+// time as the catalog grows; ShopEngine builds the index when a catalog
+// is published, never on a query.
+class NameSearchIndex {
+private:
+    // First position at or after from whose id is >= target. Nearby ids
+    // are stepped to; farther ones are found by doubling the stride.
+    static size_t gallopTo(const vector<uint32_t>& list, size_t from, uint32_t target) {
+        for (size_t end = min(from + 8, list.size()); from < end; ++from)
+            if (list[from] >= target)
+                return from;
+        size_t step = 1, probe = from;
+        while (probe < list.size() && list[probe] < target) {
+            from = probe + 1;
+            probe = from + step;
+            step *= 2;
+        }
+        return lower_bound(list.begin() + from, list.begin() + min(probe, list.size()), target) - list.begin();
+    }
+
+    // The names of one length that contain a key
+    struct IdList {
+        vector<uint32_t> ids;  // ascending; emptied once the key is common
+        vector<uint64_t> bits; // bitmap of ids for common keys
+        size_t count = 0;
+
+        bool dense() const { return !bits.empty(); }
+
+        bool contains(uint32_t id) const {
+            if (dense())
+                return id / 64 < bits.size() && (bits[id / 64] >> (id % 64) & 1);
+            return binary_search(ids.begin(), ids.end(), id);
+        }
+
+        bool setBit(uint32_t id) {
+            if (id / 64 >= bits.size())
+                bits.resize(max<size_t>(id / 64 + 1, bits.size() * 2));
+            uint64_t mask = 1ull << (id % 64);
+            bool added = !(bits[id / 64] & mask);
+            bits[id / 64] |= mask;
+            return added;
+        }
+
+        bool add(uint32_t id) {
+            size_t before = count;
+            if (dense()) {
+                count += setBit(id);
+            } else if (ids.empty() || ids.back() < id) {
+                ids.push_back(id);
+                ++count;
+            } else if (!binary_search(ids.begin(), ids.end(), id)) {
+                ids.insert(lower_bound(ids.begin(), ids.end(), id), id);
+                ++count;
+            }
+            return count != before;
+        }
+
+        void makeDense() {
+            for (uint32_t id : ids)
+                setBit(id);
+            vector<uint32_t>().swap(ids);
+        }
+
+        bool remove(uint32_t id) {
+            if (!contains(id))
+                return false;
+            if (dense())
+                bits[id / 64] &= ~(1ull << (id % 64));
+            else
+                ids.erase(lower_bound(ids.begin(), ids.end(), id));
+            --count;
+            return true;
+        }
+
+        // Calls visit(id) in ascending order until it returns false;
+        // returns false if it did
+        template <typename Fn>
+        bool forEach(Fn visit) const {
+            if (!dense())
+                return all_of(ids.begin(), ids.end(), visit);
+            for (size_t word = 0; word < bits.size(); ++word)
+                for (uint64_t rest = bits[word]; rest; rest &= rest - 1)
+                    if (!visit((uint32_t)(word * 64 + __builtin_ctzll(rest))))
+                        return false;
+            return true;
+        }
+    };
+
+    // The names that contain a key, one IdList per name length. A copied
+    // index shares the lists with the original until it changes one.
+    struct Posting {
+        vector<uint32_t> lengths;              // ascending
+        vector<shared_ptr<const IdList>> groups; // parallel to lengths
+        size_t count = 0;
+
+        const IdList* atLength(uint32_t length) const {
+            auto it = lower_bound(lengths.begin(), lengths.end(), length);
+            return it != lengths.end() && *it == length ? groups[it - lengths.begin()].get() : nullptr;
+        }
+
+        // The list for length, copied first if another index shares it
+        IdList& groupFor(uint32_t length) {
+            auto it = lower_bound(lengths.begin(), lengths.end(), length);
+            size_t at = it - lengths.begin();
+            if (it == lengths.end() || *it != length) {
+                lengths.insert(it, length);
+                groups.insert(groups.begin() + at, make_shared<IdList>());
+            } else if (groups[at].use_count() > 1) {
+                groups[at] = make_shared<IdList>(*groups[at]);
+            }
+            return const_cast<IdList&>(*groups[at]);
+        }
+    };
+
+    vector<vector<uint32_t>> slotsByLength; // [length][id] -> slot, or noSlot once removed
+    vector<uint32_t> idOfSlot;              // [slot] -> id in its length group
+    unordered_map<uint32_t, Posting> postings;
+    size_t indexedNames = 0;
+    size_t removedNames = 0; // ids no longer in any list
+
+    static constexpr uint32_t noSlot = UINT32_MAX;
+
+    static constexpr size_t denseFraction = 32;
+    static constexpr size_t denseMinimum = 1024;
+    // Longer names share the last length group
+    static constexpr uint32_t maxGroupedLength = 255;
+    // Fuzzy search reads at most this many postings, which bounds its work
+    // at any catalog size
+    static constexpr size_t fuzzyPostingBudget = 1 << 16;
+    static constexpr size_t maxQueryLength = 100;
+    static constexpr uint32_t nameStartMark = 1; // first byte of the name-start keys
+
+    static const Posting noPosting;
+
+    static char asciiLower(char c) { return c >= 'A' && c <= 'Z' ? (char)(c + ('a' - 'A')) : c; }
+
+    static void lowercaseInto(string& out, string_view text) {
+        out.assign(text.data(), text.size());
+        for (char& c : out)
+            c = asciiLower(c);
+    }
+
+    static uint32_t keyOf(uint32_t first, char second, char third) {
+        return first << 16 | (uint32_t)(unsigned char)second << 8 | (unsigned char)third;
+    }
+
+    // Distinct trigrams of text, sorted
+    static void trigramsOf(const string& text, vector<uint32_t>& keys) {
+        keys.clear();
+        for (size_t i = 0; i + 3 <= text.size(); ++i)
+            keys.push_back(keyOf((unsigned char)text[i], text[i + 1], text[i + 2]));
+        sort(keys.begin(), keys.end());
+        keys.erase(unique(keys.begin(), keys.end()), keys.end());
+    }
+
+    static uint32_t groupOf(size_t nameLength) { return (uint32_t)min<size_t>(nameLength, maxGroupedLength); }
+
+    // Calls visit(id) for each id found in every list, in ascending
+    // order, until visit returns false; returns false if visit did. The
+    // rarest list proposes each of its ids, common keys check it with a bit
+    // test, and the other rare keys then step or gallop forward to confirm
+    // it. When every key is common the bitmaps are ANDed a word (64
+    // names) at a time.
+    template <typename Fn>
+    static bool intersect(vector<const IdList*>& lists, Fn visit) {
+        sort(lists.begin(), lists.end(), [](const IdList* a, const IdList* b) {
+            return a->dense() != b->dense() ? b->dense() : a->count < b->count;
+        });
+        size_t sparse = 0;
+        while (sparse < lists.size() && !lists[sparse]->dense())
+            ++sparse;
+
+        if (sparse == 0) {
+            size_t words = lists[0]->bits.size();
+            for (const IdList* list : lists)
+                words = min(words, list->bits.size());
+            for (size_t word = 0; word < words; ++word) {
+                uint64_t common = lists[0]->bits[word];
+                for (size_t k = 1; k < lists.size() && common; ++k)
+                    common &= lists[k]->bits[word];
+                for (; common; common &= common - 1)
+                    if (!visit((uint32_t)(word * 64 + __builtin_ctzll(common))))
+                        return false;
+            }
+            return true;
+        }
+
+        vector<size_t> cursor(sparse, 0);
+        for (uint32_t id : lists[0]->ids) {
+            bool inAll = true;
+            for (size_t k = sparse; k < lists.size() && inAll; ++k)
+                inAll = lists[k]->contains(id);
+            for (size_t k = 1; k < sparse && inAll; ++k) {
+                const vector<uint32_t>& other = lists[k]->ids;
+                cursor[k] = gallopTo(other, cursor[k], id);
+                if (cursor[k] == other.size())
+                    return true;
+                inAll = other[cursor[k]] == id;
+            }
+            if (inAll && !visit(id))
+                return false;
+        }
+        return true;
+    }
+
+    // Calls visit(length group, id) for each name in every posting,
+    // shorter names first, until visit returns false or a length comes up
+    // for which worth(length) is false
+    template <typename Worth, typename Fn>
+    void intersectByLength(const vector<const Posting*>& lists, Worth worth, Fn visit) const {
+        const Posting* rarest = *min_element(lists.begin(), lists.end(),
+                                             [](const Posting* a, const Posting* b) { return a->count < b->count; });
+        vector<const IdList*> groups(lists.size());
+        for (uint32_t length : rarest->lengths) {
+            if (!worth(length))
+                return;
+            bool everyList = true;
+            for (size_t k = 0; k < lists.size() && everyList; ++k)
+                everyList = (groups[k] = lists[k]->atLength(length)) != nullptr;
+            if (!everyList)
+                continue;
+            if (!intersect(groups, [&](uint32_t id) { return visit(length, id); }))
+                return;
+        }
+    }
+
+    const Posting& postingFor(uint32_t key) const {
+        auto it = postings.find(key);
+        return it == postings.end() ? noPosting : it->second;
+    }
+
+    // Position of lowercase needle in name ignoring case, or npos
+    static size_t findIgnoreCase(string_view name, const string& needle) {
+        for (size_t pos = 0; pos + needle.size() <= name.size(); ++pos) {
+            if (asciiLower(name[pos]) != needle[0])
+                continue;
+            size_t i = 1;
+            while (i < needle.size() && asciiLower(name[pos + i]) == needle[i])
+                ++i;
+            if (i == needle.size())
+                return pos;
+        }
+        return string::npos;
+    }
+
+    // Whether word appears in name; words shorter than three letters only
+    // count at the start of a word of the name
+    static bool containsWord(string_view name, const string& word) {
+        size_t pos = findIgnoreCase(name, word);
+        if (word.size() >= 3 || pos == 0 || pos == string::npos)
+            return pos != string::npos;
+        return findIgnoreCase(name, " " + word) != string::npos;
+    }
+
+    // Where the whole query is in a name, best first: the exact name, a
+    // prefix, at a word start, anywhere, or not at all (only its words)
+    enum Placement { Exact, Prefix, WordStart, Inside, Apart };
+
+    static Placement placementOf(string_view name, const string& needle) {
+        size_t pos = findIgnoreCase(name, needle);
+        if (pos == 0)
+            return name.size() == needle.size() ? Exact : Prefix;
+        if (pos == string::npos)
+            return Apart;
+        return name[pos - 1] == ' ' ? WordStart : Inside;
+    }
+
+    // Placement first, then shorter names
+    static double matchScore(Placement placement, size_t nameLength) {
+        static constexpr double bonus[] = {1.0, 0.5, 0.25, 0.1, 0.0};
+        return 2.0 + bonus[placement] - nameLength / 1e4;
+    }
+
+    static bool better(const SearchHit& a, const SearchHit& b) {
+        if (a.score != b.score)
+            return a.score > b.score;
+        return a.slot < b.slot;
+    }
+
+    // The keys a name is indexed under
+    static void keysOf(string_view name, vector<uint32_t>& keys) {
+        thread_local string text;
+        lowercaseInto(text, name);
+        text.insert(text.begin(), ' ');
+        trigramsOf(text, keys);
+        if (text.size() >= 3)
+            keys.push_back(keyOf(nameStartMark, text[1], text[2]));
+    }
+
+    // Takes the name at slot of the catalog this index was built for out
+    // of every list; its id stays in its group, unused
+    void remove(int slot, string_view name) {
+        thread_local vector<uint32_t> keys;
+        keysOf(name, keys);
+        uint32_t length = groupOf(name.size()), id = idOfSlot[slot];
+        for (uint32_t key : keys) {
+            Posting& posting = postings[key];
+            posting.count -= posting.groupFor(length).remove(id);
+        }
+        slotsByLength[length][id] = noSlot;
+        idOfSlot[slot] = noSlot;
+        --indexedNames;
+        ++removedNames;
+    }
+
+public:
+    // Each slot is added once
+    void add(int slot, string_view name) {
+        thread_local vector<uint32_t> keys;
+        keysOf(name, keys);
+
+        uint32_t length = groupOf(name.size());
+        if (slotsByLength.size() <= length)
+            slotsByLength.resize(length + 1);
+        vector<uint32_t>& group = slotsByLength[length];
+        uint32_t id = (uint32_t)group.size();
+        group.push_back((uint32_t)slot);
+        if (idOfSlot.size() <= (size_t)slot)
+            idOfSlot.resize(slot + 1, noSlot);
+        idOfSlot[slot] = id;
+        ++indexedNames;
+
+        for (uint32_t key : keys) {
+            Posting& posting = postings[key];
+            IdList& list = posting.groupFor(length);
+            posting.count += list.add(id);
+            if (!list.dense() && list.count >= denseMinimum && list.count * denseFraction >= group.size())
+                list.makeDense();
+        }
+    }
+
+    static shared_ptr<const NameSearchIndex> build(const CatalogSnapshot& catalog) {
+        shared_ptr<NameSearchIndex> built(new NameSearchIndex);
+        for (int slot = 0; slot < (int)catalog.size(); ++slot)
+            built->add(slot, catalog.nameAt(slot));
+        return built;
+    }
+
+    // The index for next, made from this one (built for previous): names
+    // with the same product id and text keep their id and only move to
+    // their new slot, sharing the lists that hold them; the others are
+    // removed or added. Once most of the catalog changed, or removed
+    // names would be more than a quarter of the ids, it is built afresh.
+    shared_ptr<const NameSearchIndex> updatedFor(const CatalogSnapshot& previous, const CatalogSnapshot& next) const {
+        vector<int> nextSlotOf(previous.size(), -1);
+        size_t kept = 0;
+        for (int slot = 0; slot < (int)next.size(); ++slot) {
+            int old = previous.findSlot(next.idAt(slot));
+            if (old >= 0 && previous.nameAt(old) == next.nameAt(slot)) {
+                nextSlotOf[old] = slot;
+                ++kept;
+            }
+        }
+        size_t removed = previous.size() - kept;
+        if (kept < next.size() / 2 || (removedNames + removed) * 4 > indexedNames + removedNames)
+            return build(next);
+
+        shared_ptr<NameSearchIndex> updated(new NameSearchIndex(*this));
+        for (int old = 0; old < (int)previous.size(); ++old)
+            if (nextSlotOf[old] < 0)
+                updated->remove(old, previous.nameAt(old));
+        vector<uint32_t> oldIds = move(updated->idOfSlot);
+        updated->idOfSlot.assign(next.size(), noSlot);
+        for (int old = 0; old < (int)previous.size(); ++old) {
+            int slot = nextSlotOf[old];
+            if (slot >= 0) {
+                uint32_t id = oldIds[old];
+                updated->slotsByLength[groupOf(previous.nameAt(old).size())][id] = (uint32_t)slot;
+                updated->idOfSlot[slot] = id;
+            }
+        }
+        for (int slot = 0; slot < (int)next.size(); ++slot)
+            if (updated->idOfSlot[slot] == noSlot)
+                updated->add(slot, next.nameAt(slot));
+        return updated;
+    }
+
+    size_t size() const { return indexedNames; }
+    size_t trigramCount() const { return postings.size(); }
+
+    size_t memoryBytes() const {
+        size_t bytes = postings.bucket_count() * sizeof(void*);
+        for (const auto& group : slotsByLength)
+            bytes += sizeof(group) + group.capacity() * sizeof(uint32_t);
+        bytes += idOfSlot.capacity() * sizeof(uint32_t);
+        for (const auto& entry : postings) {
+            bytes += sizeof(entry) + sizeof(void*) + entry.second.lengths.capacity() * sizeof(uint32_t);
+            for (const auto& list : entry.second.groups)
+                bytes += sizeof(list) + sizeof(*list) + list->ids.capacity() * sizeof(uint32_t) + list->bits.capacity() * sizeof(uint64_t);
+        }
+        return bytes;
+    }
+
+    // Best matches for query, highest score first. Names containing every
+    // word of the query, in any order, score above 2. Only if there are
+    // none, names sharing at least a third of the query's trigrams are
+    // returned with that share as score, so typos still find the product.
+    vector<SearchHit> search(const CatalogSnapshot& catalog, string_view query, size_t limit = 10) const {
+        string lowered;
+        lowercaseInto(lowered, query.substr(0, maxQueryLength));
+        istringstream split(lowered);
+        vector<string> words;
+        string needle;
+        for (string word; split >> word;) {
+            needle += (needle.empty() ? "" : " ") + word;
+            if (word.size() >= 2)
+                words.push_back(word);
+        }
+        if (needle.empty() || limit == 0)
+            return {};
+        if (words.empty())
+            throw runtime_error("Please enter at least 2 letters.");
+        // one- and two-letter words match word starts through the padded trigram
+        vector<uint32_t> keys, wordKeys;
+        for (const string& word : words) {
+            trigramsOf(word.size() < 3 ? " " + word : word, wordKeys);
+            keys.insert(keys.end(), wordKeys.begin(), wordKeys.end());
+        }
+        sort(keys.begin(), keys.end());
+        keys.erase(unique(keys.begin(), keys.end()), keys.end());
+        vector<const Posting*> lists;
+        for (uint32_t key : keys)
+            lists.push_back(&postingFor(key));
+        // the rarest trigram of the whole query that no single word has
+        const Posting* across = nullptr;
+        trigramsOf(needle, wordKeys);
+        for (uint32_t key : wordKeys)
+            if (!binary_search(keys.begin(), keys.end(), key) && (!across || postingFor(key).count < across->count))
+                across = &postingFor(key);
+
+        // Matches contain every query trigram, so candidates come from the
+        // intersection of the lists. The placements are walked best first,
+        // each narrowed by the keys it implies; placements whose rarest list
+        // is the same would meet much the same names, so they share one walk
+        // over the keys they all imply (the query's own trigrams). A
+        // walk meets names shortest first and stops once a name of that
+        // length could not make the top `limit` even in the walk's best
+        // placement. hits is a heap with the worst kept hit on top.
+        const Placement order[] = {Prefix, WordStart, Inside, Apart};
+        vector<const Posting*> narrowed[4];
+        const Posting* driver[4];
+        auto rarer = [](const Posting* a, const Posting* b) { return a->count < b->count; };
+        for (int i = 0; i < 4; ++i) {
+            narrowed[i] = lists;
+            if (order[i] != Apart && across)
+                narrowed[i].push_back(across);
+            if (order[i] == Prefix)
+                narrowed[i].push_back(&postingFor(keyOf(nameStartMark, needle[0], needle[1])));
+            if (order[i] == WordStart)
+                narrowed[i].push_back(&postingFor(keyOf(' ', needle[0], needle[1])));
+            driver[i] = *min_element(narrowed[i].begin(), narrowed[i].end(), rarer);
+        }
+        vector<SearchHit> hits;
+        auto worstFirst = [](const SearchHit& a, const SearchHit& b) { return better(a, b); };
+        for (int first = 0, last; first < 4; first = last + 1) {
+            last = first;
+            while (last + 1 < 4 && driver[last + 1] == driver[first])
+                ++last;
+            Placement best = order[first], worst = order[last];
+            // the best score a name of this length could have in this walk
+            auto bound = [&](uint32_t length) {
+                return matchScore(best == Prefix && length == needle.size() ? Exact : best, length);
+            };
+            auto worth = [&](uint32_t length) { return hits.size() < limit || bound(length) >= hits.front().score; };
+            uint32_t acrossLength = UINT32_MAX;
+            const IdList* acrossGroup = nullptr;
+            intersectByLength(narrowed[first == last ? first : max(last, 2)], worth, [&](uint32_t length, uint32_t id) {
+                uint32_t slot = slotsByLength[length][id];
+                if (hits.size() == limit) {
+                    SearchHit top{(int)slot, bound(length)};
+                    if (top.score < hits.front().score)
+                        return false;
+                    if (!better(top, hits.front()))
+                        return true;
+                    // a name without the across key cannot hold the whole
+                    // query, so it scores as Apart; skip it without reading it
+                    if (across && worst == Apart) {
+                        if (acrossLength != length)
+                            acrossGroup = across->atLength(acrossLength = length);
+                        if ((!acrossGroup || !acrossGroup->contains(id))
+                            && !better(SearchHit{(int)slot, matchScore(Apart, length)}, hits.front()))
+                            return true;
+                    }
+                }
+                string_view name = catalog.nameAt(slot);
+                Placement placement = placementOf(name, needle);
+                if (placement < best - (best == Prefix) || placement > worst)
+                    return true;
+                if (!all_of(words.begin(), words.end(), [name](const string& word) { return containsWord(name, word); }))
+                    return true;
+                SearchHit hit{(int)slot, matchScore(placement, name.size())};
+                if (hits.size() < limit) {
+                    hits.push_back(hit);
+                    push_heap(hits.begin(), hits.end(), worstFirst);
+                } else if (better(hit, hits.front())) {
+                    pop_heap(hits.begin(), hits.end(), worstFirst);
+                    hits.back() = hit;
+                    push_heap(hits.begin(), hits.end(), worstFirst);
+                }
+                return true;
+            });
+        }
+        if (!hits.empty()) {
+            sort_heap(hits.begin(), hits.end(), worstFirst);
+            return hits;
+        }
+
+        // Fuzzy matches, scored by the share of query trigrams (plus each
+        // word's padded start) found in the name; a third is enough. A name
+        // missing the n rarest lists has at most lists.size() - n of them, so
+        // the lists are read rarest first and the reading stops once a name
+        // not met yet could not make the top `limit`. Each name met is
+        // scored against every list, unless an earlier list already had it.
+        // Names that tie are kept in the order they were met, and the
+        // reading stops at the posting budget, so a query whose keys are all
+        // common may miss some of its best names.
+        for (const string& word : words) {
+            if (word.size() >= 3) {
+                trigramsOf(" " + word.substr(0, 2), wordKeys);
+                lists.push_back(&postingFor(wordKeys[0]));
+            }
+        }
+        if (lists.size() < 3)
+            return hits;
+        sort(lists.begin(), lists.end(), rarer);
+        size_t total = lists.size(), needed = max<size_t>(2, (total + 2) / 3);
+        // a name needs more than floor of the lists to make the top `limit`
+        size_t floor = needed - 1;
+        auto offer = [&](uint32_t length, uint32_t id, size_t matched) {
+            SearchHit hit{(int)slotsByLength[length][id], (double)matched / total};
+            if (any_of(hits.begin(), hits.end(), [&](const SearchHit& kept) { return kept.slot == hit.slot; }))
+                return;
+            if (hits.size() == limit)
+                pop_heap(hits.begin(), hits.end(), worstFirst);
+            else
+                hits.emplace_back();
+            hits.back() = hit;
+            push_heap(hits.begin(), hits.end(), worstFirst);
+            if (hits.size() == limit)
+                floor = (size_t)lround(hits.front().score * total);
+        };
+        // Names with every key but the n rarest are found first by
+        // intersecting the common lists, which is quick and raises the floor
+        size_t rare = 0;
+        while (rare < total && lists[rare]->count == 0)
+            ++rare;
+        for (; rare < total && total - rare > floor && hits.size() < limit; ++rare) {
+            vector<const Posting*> common(lists.begin() + rare, lists.end());
+            intersectByLength(common, [](uint32_t) { return true; }, [&](uint32_t length, uint32_t id) {
+                size_t matched = total - rare;
+                for (size_t k = 0; k < rare; ++k) {
+                    const IdList* group = lists[k]->atLength(length);
+                    matched += group && group->contains(id);
+                }
+                offer(length, id, matched);
+                return hits.size() < limit;
+            });
+        }
+        vector<const IdList*> groups(total);
+        vector<size_t> cursor(total);
+        size_t postingsRead = 0;
+        for (size_t i = 0; i < total && total - i > floor && postingsRead < fuzzyPostingBudget; ++i) {
+            const Posting& scanned = *lists[i];
+            for (size_t g = 0; g < scanned.groups.size() && total - i > floor && postingsRead < fuzzyPostingBudget; ++g) {
+                uint32_t length = scanned.lengths[g];
+                for (size_t k = 0; k < total; ++k) {
+                    groups[k] = lists[k]->atLength(length);
+                    cursor[k] = 0;
+                }
+                // ids come in ascending order, so rare keys step forward
+                auto has = [&](size_t k, uint32_t id) {
+                    const IdList* group = groups[k];
+                    if (!group || group->dense())
+                        return group && group->contains(id);
+                    cursor[k] = gallopTo(group->ids, cursor[k], id);
+                    return cursor[k] < group->ids.size() && group->ids[cursor[k]] == id;
+                };
+                postingsRead += scanned.groups[g]->count;
+                scanned.groups[g]->forEach([&](uint32_t id) {
+                    for (size_t k = 0; k < i; ++k)
+                        if (has(k, id))
+                            return true;
+                    size_t matched = 1;
+                    for (size_t k = i + 1; k < total && matched + (total - k) > floor; ++k)
+                        matched += has(k, id);
+                    if (matched > floor)
+                        offer(length, id, matched);
+                    return total - i > floor;
+                });
+            }
+        }
+        sort_heap(hits.begin(), hits.end(), worstFirst);
+        return hits;
+    }
+};
+
+const NameSearchIndex::Posting NameSearchIndex::noPosting;
+
+// ----------------------------- String Pool -----------------------------
+// Short strings that many users share (cities, provinces) are stored
+// once and named by a 32-bit handle. The text is kept in blocks that are
+// never moved or freed, so a view stays valid for the rest of the program
+// and reading one takes no lock. Handle 0 is the empty string; intern
+// also returns it for text longer than maxTextBytes and once the pool
+// holds about a million strings, so callers must keep their own copy of
+// anything that gets handle 0.
+class StringPool {
+public:
+    using Handle = uint32_t;
+    static constexpr size_t maxTextBytes = 64;
+
+private:
+    static constexpr size_t blockBytes = size_t(1) << 16;
+    static constexpr size_t segmentBits = 12; // views per segment: 4096
+    static constexpr size_t segmentMask = (size_t(1) << segmentBits) - 1;
+    static constexpr size_t maxSegments = size_t(1) << 8;
+
+    mutable shared_mutex lock;
+    unordered_map<string_view, Handle> handles;
+    vector<unique_ptr<char[]>> blocks;
+    char* block = nullptr; // the one being filled
+    size_t blockUsed = blockBytes;
+    size_t count = 1;
+    size_t textBytes = 0;
+    unique_ptr<string_view[]> segments[maxSegments];
+    // Handles below published have their segment and view written; it is
+    // stored with release after them and view() loads it with acquire
+    atomic<size_t> published{1};
+
+    const char* store(string_view text) {
+        if (blockUsed + text.size() > blockBytes) {
+            blocks.emplace_back(new char[blockBytes]);
+            block = blocks.back().get();
+            blockUsed = 0;
+        }
+        char* stored = block + blockUsed;
+        memcpy(stored, text.data(), text.size());
+        blockUsed += text.size();
+        return stored;
+    }
+
+public:
+    StringPool() { segments[0].reset(new string_view[segmentMask + 1]); }
+
+    Handle intern(string_view text) {
+        if (text.empty() || text.size() > maxTextBytes)
+            return 0;
+        {
+            shared_lock<shared_mutex> guard(lock);
+            auto found = handles.find(text);
+            if (found != handles.end())
+                return found->second;
+        }
+        unique_lock<shared_mutex> guard(lock);
+        auto found = handles.find(text);
+        if (found != handles.end())
+            return found->second;
+        if (count == maxSegments << segmentBits)
+            return 0;
+        string_view stored(store(text), text.size());
+        unique_ptr<string_view[]>& segment = segments[count >> segmentBits];
+        if (!segment)
+            segment.reset(new string_view[segmentMask + 1]);
+        segment[count & segmentMask] = stored;
+        handles.emplace(stored, (Handle)count);
+        textBytes += text.size();
+        published.store(count + 1, memory_order_release);
+        return (Handle)count++;
+    }
+
+    string_view view(Handle handle) const {
+        if (handle >= published.load(memory_order_acquire))
+            return string_view();
+        return segments[handle >> segmentBits][handle & segmentMask];
+    }
+
+    // Distinct strings (not counting "") and the bytes of their text
+    size_t size() const {
+        shared_lock<shared_mutex> guard(lock);
+        return count - 1;
+    }
+
+    size_t bytes() const {
+        shared_lock<shared_mutex> guard(lock);
+        return textBytes;
+    }
+};
+
+StringPool& sharedStrings() {
+    static StringPool pool;
+    return pool;
+}
+
+// A shipping address as views into its user and the string pool; the
+// "city, province" text is only put together when it is written out
+struct AddressView {
+    string_view city;     // or the whole address, when it was given whole
+    string_view province;
+    bool split = false;   // given as a city and a province
+
+    bool empty() const { return !split && city.empty(); }
+
+    string str() const { return split ? string(city) + ", " + string(province) : string(city); }
+};
+
+ostream& operator<<(ostream& out, const AddressView& address) {
+    out << address.city;
+    if (address.split)
+        out << ", " << address.province;
+    return out;
+}
+
+RenderBuffer& operator<<(RenderBuffer& out, const AddressView& address) {
+    out << address.city;
+    if (address.split)
+        out << ", " << address.province;
+    return out;
+}
+
+// ----------------------------- User Class -----------------------------
+// The username, email and an address given whole live in the given memory
+// resource (a signed-in user's come from their session arena). A city and
+// province are handles into the shared string pool, so users in one city
+// share one copy; a part the pool will not take is kept in address.
+class User {
+private:
+    pmr::string username;
+    pmr::string email;       
+    pmr::string address;        // an address given whole, or the unpooled city then province
+    StringPool::Handle city = 0;
+    StringPool::Handle province = 0;
+    uint32_t cityBytes = 0;     // of address, when the city is kept there
+    bool split = false;         // set as a city and a province
+
+public:
+    User(string_view uname, pmr::memory_resource* resource = pmr::get_default_resource())
+        : username(uname, resource), email(resource), address(resource) {}
+
+    string_view getUsername() const { return username; }
+    
+    void setEmail(string_view userEmail) {
+        email = userEmail;
+    }
+    
+    string_view getEmail() const {
+        return email;
+    }
+
+    // An address given whole has no separate city or province
+    void setAddress(string_view addr) {
+        address = addr;
+        city = province = 0;
+        cityBytes = 0;
+        split = false;
+    }
+
+    void setAddress(string_view cityName, string_view provinceName) {
+        StringPool& pool = sharedStrings();
+        city = pool.intern(cityName);
+        province = pool.intern(provinceName);
+        address.clear();
+        if (!city)
+            address.assign(cityName.data(), cityName.size());
+        cityBytes = (uint32_t)address.size();
+        if (!province)
+            address.append(provinceName.data(), provinceName.size());
+        split = true;
+    }
+
+    AddressView getAddress() const {
+        if (!split)
+            return {address, {}, false};
+        return {getCity(), getProvince(), true};
+    }
+
+    string_view getCity() const {
+        if (!split)
+            return {};
+        return city ? sharedStrings().view(city) : string_view(address).substr(0, cityBytes);
+    }
+
+    string_view getProvince() const {
+        if (!split)
+            return {};
+        return province ? sharedStrings().view(province) : string_view(address).substr(cityBytes);
+    }
+};
+
+// ----------------------------- Cart Lines -----------------------------
+// A vector of trivially copyable values whose first N elements are stored
+// inside the object, so short vectors never touch the heap. Longer ones
+// are allocated from the memory resource given at construction; copies
+// use the default resource, as pmr containers do.
+template <typename T, size_t N>
+class InlineVector {
+    static_assert(is_trivially_copyable<T>::value, "InlineVector moves elements with memmove");
+
+private:
+    T* items;
+    size_t count = 0;
+    size_t capacity = N;
+    pmr::memory_resource* resource;
+    T local[N];
+
+    bool onHeap() const { return items != local; }
+
+    void freeHeap() {
+        if (onHeap())
+            resource->deallocate(items, capacity * sizeof(T), alignof(T));
+    }
+
+    void grow() {
+        size_t bigger = capacity * 2;
+        T* moved = static_cast<T*>(resource->allocate(bigger * sizeof(T), alignof(T)));
+        memcpy(moved, items, count * sizeof(T));
+        freeHeap();
+        items = moved;
+        capacity = bigger;
+    }
+
+    // Takes other's elements; this must be empty and inline
+    void takeFrom(InlineVector& other) {
+        if (other.onHeap()) {
+            items = other.items;
+            capacity = other.capacity;
+            resource = other.resource;
+            other.items = other.local;
+            other.capacity = N;
+        } else {
+            memcpy(local, other.local, other.count * sizeof(T));
+        }
+        count = other.count;
+        other.count = 0;
+    }
+
+public:
+    explicit InlineVector(pmr::memory_resource* from = pmr::get_default_resource()) : items(local), resource(from) {}
+
+    InlineVector(const InlineVector& other) : items(local), resource(pmr::get_default_resource()) {
+        if (other.count > N) {
+            items = static_cast<T*>(resource->allocate(other.count * sizeof(T), alignof(T)));
+            capacity = other.count;
+        }
+        memcpy(items, other.items, other.count * sizeof(T));
+        count = other.count;
+    }
+
+    InlineVector(InlineVector&& other) noexcept : items(local), resource(other.resource) { takeFrom(other); }
+
+    InlineVector& operator=(InlineVector other) noexcept {
+        freeHeap();
+        items = local;
+        capacity = N;
+        count = 0;
+        takeFrom(other);
+        return *this;
+    }
+
+    ~InlineVector() { freeHeap(); }
+
+    size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+    const T* data() const { return items; }
+    const T* begin() const { return items; }
+    const T* end() const { return items + count; }
+    T& operator[](size_t i) { return items[i]; }
+    const T& operator[](size_t i) const { return items[i]; }
+
+    void insert(size_t pos, T value) {
+        if (count == capacity)
+            grow();
+        memmove(items + pos + 1, items + pos, (count - pos) * sizeof(T));
+        items[pos] = value;
+        ++count;
+    }
+
+    void erase(size_t pos) {
+        memmove(items + pos, items + pos + 1, (count - pos - 1) * sizeof(T));
+        --count;
+    }
+
+    // New elements are left for the caller to fill in
+    void resize(size_t size) {
+        while (capacity < size)
+            grow();
+        count = size;
+    }
+};
+
+// The lines of a cart as a flat map from product id to quantity, sorted by
+// id. Ids, quantities, catalog slots and the unit price each line was
+// priced at are parallel columns, so finding a line is a binary search
+// over the ids and totals run over contiguous (slot, quantity) arrays.
+// Adding or removing a line shifts the lines after it with one memmove per
+// column. Up to 16 lines are stored inline; longer carts use the given
+// memory resource.
+class CartLines {
+private:
+    InlineVector<int, 16> ids;
+    InlineVector<int, 16> quantities;
+    InlineVector<int, 16> slots;
+    InlineVector<int64_t, 16> prices; // centavos per unit
+
+    size_t lowerBound(int productId) const {
+        return lower_bound(ids.begin(), ids.end(), productId) - ids.begin();
+    }
+
+public:
+    static constexpr size_t npos = size_t(-1);
+
+    explicit CartLines(pmr::memory_resource* resource = pmr::get_default_resource())
+        : ids(resource), quantities(resource), slots(resource), prices(resource) {}
+
+    // Iterates as (productId, quantity) pairs, in product id order
+    class const_iterator {
+    private:
+        const CartLines* lines;
+        size_t line;
+
+    public:
+        const_iterator(const CartLines* owner, size_t index) : lines(owner), line(index) {}
+        pair<int, int> operator*() const { return {lines->ids[line], lines->quantities[line]}; }
+        const_iterator& operator++() { ++line; return *this; }
+        bool operator!=(const const_iterator& other) const { return line != other.line; }
+    };
+
+    const_iterator begin() const { return const_iterator(this, 0); }
+    const_iterator end() const { return const_iterator(this, ids.size()); }
+
+    size_t size() const { return ids.size(); }
+    bool empty() const { return ids.empty(); }
+
+    size_t find(int productId) const {
+        size_t line = lowerBound(productId);
+        return line < ids.size() && ids[line] == productId ? line : npos;
+    }
+
+    int productIdAt(size_t line) const { return ids[line]; }
+    int quantityAt(size_t line) const { return quantities[line]; }
+    int slotAt(size_t line) const { return slots[line]; }
+    int64_t priceAt(size_t line) const { return prices[line]; }
+    const int* slotData() const { return slots.data(); }
+    const int* quantityData() const { return quantities.data(); }
+
+    // Adds quantity to the product's line, creating it if needed. A new
+    // line takes unitPrice; an existing one keeps its price.
+    void add(int productId, int quantity, int slot, int64_t unitPrice = 0) {
+        size_t line = lowerBound(productId);
+        if (line < ids.size() && ids[line] == productId) {
+            quantities[line] += quantity;
+            return;
+        }
+        ids.insert(line, productId);
+        quantities.insert(line, quantity);
+        slots.insert(line, slot);
+        prices.insert(line, unitPrice);
+    }
+
+    bool setQuantity(int productId, int quantity) {
+        size_t line = find(productId);
+        if (line == npos)
+            return false;
+        quantities[line] = quantity;
+        return true;
+    }
+
+    bool erase(int productId) {
+        size_t line = find(productId);
+        if (line == npos)
+            return false;
+        eraseAt(line);
+        return true;
+    }
+
+    void eraseAt(size_t line) {
+        ids.erase(line);
+        quantities.erase(line);
+        slots.erase(line);
+        prices.erase(line);
+    }
+
+    void setQuantityAt(size_t line, int quantity) { quantities[line] = quantity; }
+    void setSlot(size_t line, int slot) { slots[line] = slot; }
+    void setPrice(size_t line, int64_t unitPrice) { prices[line] = unitPrice; }
+
+    struct NewLine {
+        int productId;
+        int quantity;
+        int slot;
+        int64_t unitPrice;
+    };
+
+    // Adds many lines at once, like add() for each. The batch must be
+    // sorted by product id with no id twice. The columns grow once and the
+    // batch is merged in from the back, so each line moves at most once.
+    void addSorted(const vector<NewLine>& batch) {
+        size_t oldSize = ids.size(), added = 0;
+        for (size_t line = 0, next = 0; next < batch.size(); ++next) {
+            while (line < oldSize && ids[line] < batch[next].productId)
+                ++line;
+            added += !(line < oldSize && ids[line] == batch[next].productId);
+        }
+        ids.resize(oldSize + added);
+        quantities.resize(oldSize + added);
+        slots.resize(oldSize + added);
+        prices.resize(oldSize + added);
+
+        size_t from = oldSize, to = oldSize + added, next = batch.size();
+        while (next > 0) {
+            const NewLine& line = batch[next - 1];
+            --to;
+            if (from > 0 && ids[from - 1] >= line.productId) {
+                --from;
+                if (ids[from] == line.productId) {
+                    quantities[from] += line.quantity;
+                    --next;
+                }
+                ids[to] = ids[from];
+                quantities[to] = quantities[from];
+                slots[to] = slots[from];
+                prices[to] = prices[from];
+            } else {
+                ids[to] = line.productId;
+                quantities[to] = line.quantity;
+                slots[to] = line.slot;
+                prices[to] = line.unitPrice;
+                --next;
+            }
+        }
+    }
+};
+
+// ----------------------------- Cart Class -----------------------------
+// The total is kept as a running sum that every edit adjusts by its own
+// line, so reading it costs the same for any cart size. Lines are priced
+// against the catalog named by getPricedVersion(); moving to another
+// catalog reprices only the lines whose price changed, and given the
+// catalog's changes it looks at no other line.
+class Cart {
+private:
+    CartLines lines; // sorted by product id
+    CatalogRef catalog;
+    int64_t subtotal = 0; // centavos, sum of price * quantity over lines
+    uint64_t pricedVersion = 0;
+
+    int64_t unitPrice(int slot) const {
+        return slot < 0 ? 0 : catalog->priceAt(slot).getCentavos();
+    }
+
+    void reprice(size_t line, int slot) {
+        int64_t price = unitPrice(slot);
+        if (price != lines.priceAt(line)) {
+            subtotal += (price - lines.priceAt(line)) * lines.quantityAt(line);
+            lines.setPrice(line, price);
+        }
+    }
+
+public:
+    explicit Cart(pmr::memory_resource* resource = pmr::get_default_resource()) : lines(resource) {}
+
+    // changes, if given, must lead up to snapshot
+    // changes, if given, must lead up to snapshot. Then the lines whose
+    // price did not change are skipped, and when very few prices changed
+    // (a binary search costs about as much as skipping 32 lines) only
+    // their lines are looked up.
+    void setCatalog(CatalogRef snapshot, const CatalogChanges* changes = nullptr) {
+        bool sameSlots = catalog && changes && changes->keepsSlotsOf(pricedVersion);
+        uint64_t previousVersion = pricedVersion;
+        catalog = move(snapshot);
+        pricedVersion = catalog ? catalog->getVersion() : 0;
+        if (sameSlots) {
+            size_t stale = changes->countChangedAfter(previousVersion);
+            if (stale * 32 < lines.size()) {
+                for (size_t k = 0; k < stale; ++k) {
+                    int slot = (int)changes->latestFirst[k];
+                    size_t line = lines.find(catalog->idAt(slot));
+                    if (line != CartLines::npos)
+                        reprice(line, slot);
+                }
+                return;
+            }
+        }
+        for (size_t i = 0; i < lines.size(); ++i) {
+            int slot = lines.slotAt(i);
+            if (sameSlots) {
+                if (slot < 0 || !changes->changedAfter(slot, previousVersion))
+                    continue;
+            } else {
+                slot = findSlot(lines.productIdAt(i));
+                lines.setSlot(i, slot);
+            }
+            reprice(i, slot);
+        }
+    }
+
+    uint64_t getPricedVersion() const { return pricedVersion; }
+
+    // Removes the lines whose product is not in the catalog; returns how many
+    size_t dropMissing() {
+        size_t dropped = 0;
+        for (size_t i = lines.size(); i-- > 0;) {
+            if (lines.slotAt(i) < 0) {
+                lines.eraseAt(i);
+                ++dropped;
+            }
+        }
+        return dropped;
+    }
+
+    int findSlot(int productId) const {
+        return catalog ? catalog->findSlot(productId) : -1;
+    }
+
+    void addProduct(const Product& product, int quantity) {
+        addProduct(product.getId(), quantity);
+    }
+
+    void addProduct(int productId, int quantity) {
+        if (quantity <= 0)
+            throw runtime_error("Quantity must be greater than 0.");
+        int slot = findSlot(productId);
+        if (slot < 0)
+            throw runtime_error("Product not found.");
+        if (quantityOf(productId) > numeric_limits<int>::max() - quantity)
+            throw runtime_error("Quantity is too large.");
+        int64_t price = unitPrice(slot);
+        lines.add(productId, quantity, slot, price);
+        subtotal += price * quantity;
+    }
+
+    // Adds (productId, quantity) pairs sorted by product id, with no id
+    // twice, as one edit: either all of them are added or none is.
+    void addProducts(const vector<pair<int, int>>& sortedAdds) {
+        thread_local vector<CartLines::NewLine> batch;
+        batch.clear();
+        int64_t added = 0;
+        for (const auto& add : sortedAdds) {
+            if (add.second <= 0)
+                throw runtime_error("Quantity must be greater than 0.");
+            int slot = findSlot(add.first);
+            if (slot < 0)
+                throw runtime_error("Product not found.");
+            if (quantityOf(add.first) > numeric_limits<int>::max() - add.second)
+                throw runtime_error("Quantity is too large.");
+            batch.push_back({add.first, add.second, slot, unitPrice(slot)});
+            added += unitPrice(slot) * add.second;
+        }
+        lines.addSorted(batch);
+        subtotal += added;
+    }
+
+    void removeProduct(int productId) {
+        size_t line = lines.find(productId);
+        if (line == CartLines::npos)
+            throw runtime_error("Product not in cart.");
+        subtotal -= lines.priceAt(line) * lines.quantityAt(line);
+        lines.eraseAt(line);
+    }
+
+    void updateQuantity(int productId, int newQuantity) {
+        if (newQuantity <= 0)
+            throw runtime_error("Quantity must be greater than 0.");
+        size_t line = lines.find(productId);
+        if (line == CartLines::npos)
+            throw runtime_error("Product not in cart.");
+        subtotal += lines.priceAt(line) * (newQuantity - lines.quantityAt(line));
+        lines.setQuantityAt(line, newQuantity);
+    }
+
+    void render(RenderBuffer& out) const {
+        out << "\n--- Cart ---\n";
+        for (size_t i = 0; i < lines.size(); ++i) {
+            int slot = lines.slotAt(i);
+            if (slot >= 0) {
+                Money itemTotal = Money::fromCentavos(lines.priceAt(i)) * lines.quantityAt(i);
+                out <<"ID: "<<catalog->idAt(slot)
+                    <<" | " <<catalog->nameAt(slot)
+                    << " x" <<lines.quantityAt(i)
+                    << " - Php " <<itemTotal<<'\n';
+            }
+        }
+        out<<"Total: Php "<<calculateTotal()<<'\n';
+    }
+
+    void showCart(ostream& out = cout) const {
+        thread_local RenderBuffer buffer;
+        buffer.clear();
+        render(buffer);
+        buffer.writeTo(out);
+    }
+
+    Money calculateTotal() const {
+        return Money::fromCentavos(subtotal);
+    }
+
+    bool isEmpty() const {
+        return lines.empty();
+    }
+
+    int quantityOf(int productId) const {
+        size_t line = lines.find(productId);
+        return line == CartLines::npos ? 0 : lines.quantityAt(line);
+    }
+
+    // For receipt generation
+    const CartLines& getItems() const {
+        return lines;
+    }
+
+    const CatalogSnapshot& getCatalog() const {
+        if (!catalog)
+            throw runtime_error("Cart has no catalog.");
+        return *catalog;
+    }
+};
+
+// ----------------------------- Cart Import -----------------------------
+// Bulk cart entry from "id,qty" lines (a file or pasted text), e.g.
+//   product_id,quantity
+//   12,3
+//   7, 1
+struct CartImportRecord {
+    size_t line;
+    int productId;
+    int quantity;
+};
+
+struct CartImportError {
+    size_t line;
+    string message;
+};
+
+struct CartImportResult {
+    size_t records = 0; // id,qty lines read, good or bad
+    size_t added = 0;   // of those, added to the cart
+    vector<CartImportError> errors; // in line order
+};
+
+// Splits text into lines with memchr and reads the numbers with
+// from_chars, with no stream or per-line string. Spaces around the
+// fields, blank lines, # comments and a header line are skipped.
+void parseCartImport(string_view text, vector<CartImportRecord>& records, vector<CartImportError>& errors) {
+    const char* at = text.data();
+    const char* end = at + text.size();
+    auto skipSpaces = [](const char* from, const char* to) {
+        while (from < to && (*from == ' ' || *from == '\t'))
+            ++from;
+        return from;
+    };
+    for (size_t lineNumber = 1; at < end; ++lineNumber) {
+        const char* stop = static_cast<const char*>(memchr(at, '\n', end - at));
+        const char* next = stop ? stop + 1 : end;
+        if (!stop)
+            stop = end;
+        if (stop > at && stop[-1] == '\r')
+            --stop;
+        const char* field = skipSpaces(at, stop);
+        at = next;
+        if (field == stop || *field == '#')
+            continue;
+
+        CartImportRecord record{lineNumber, 0, 0};
+        auto id = from_chars(field, stop, record.productId);
+        const char* comma = skipSpaces(id.ptr, stop);
+        bool valid = id.ec == errc() && comma < stop && *comma == ',';
+        if (valid) {
+            auto quantity = from_chars(skipSpaces(comma + 1, stop), stop, record.quantity);
+            valid = quantity.ec == errc() && skipSpaces(quantity.ptr, stop) == stop;
+        }
+        if (valid)
+            records.push_back(record);
+        else if (!(lineNumber == 1 && !isdigit((unsigned char)*field) && *field != '-'))
+            errors.push_back({lineNumber, "Expected <product ID>,<quantity>."});
+    }
+}
+
+// The whole of a file (or of stdin for "-"), read in large blocks
+string readImportFile(const string& path) {
+    FILE* file = path == "-" ? stdin : fopen(path.c_str(), "rb");
+    if (!file)
+        throw runtime_error("Cannot open " + path + ".");
+    string text;
+    char block[1 << 16];
+    size_t got;
+    while ((got = fread(block, 1, sizeof(block), file)) > 0)
+        text.append(block, got);
+    if (file != stdin)
+        fclose(file);
+    return text;
+}
+
+void renderCartImport(RenderBuffer& out, const CartImportResult& result) {
+    for (const CartImportError& error : result.errors)
+        out << "line " << error.line << ": " << error.message << '\n';
+    out << "Added " << result.added << " of " << result.records << " line(s) to the cart.\n";
+}
+
+// ----------------------------- Payment Strategy (Interface) -----------------------------
+class PaymentStrategy {
+public:
+    virtual void pay(Money amount, RenderBuffer& out) = 0;
+    virtual ~PaymentStrategy() = default;
+};
+
+class CreditCardPayment : public PaymentStrategy {
+public:
+    void pay(Money amount, RenderBuffer& out) override {
+        out<<"Paid Php "<<amount<<" using Credit Card.\n";
+    }
+};
+
+class GcashPayment : public PaymentStrategy {
+public:
+    void pay(Money amount, RenderBuffer& out) override {
+        out<<"Paid Php "<<amount<<" using Gcash.\n";
+    }
+};
+
+class CashOnDeliver : public PaymentStrategy {
+    public:
+        void pay(Money amount, RenderBuffer& out) override {
+            out<<"Please pay "<<amount<<" upon delivery.\n";
+        }
+};
+
+enum class PaymentMethod { CreditCard = 1, Gcash = 2, CashOnDelivery = 3 };
+
+string_view paymentMethodName(PaymentMethod method) {
+    switch (method) {
+        case PaymentMethod::CreditCard: return "Credit Card";
+        case PaymentMethod::Gcash: return "Gcash";
+        case PaymentMethod::CashOnDelivery: return "Cash On Delivery";
+    }
+    throw runtime_error("Invalid payment option.");
+}
+
+// The strategies hold no state, so one shared instance of each serves
+// every checkout
+PaymentStrategy& paymentStrategyFor(PaymentMethod method) {
+    static CreditCardPayment creditCard;
+    static GcashPayment gcash;
+    static CashOnDeliver cashOnDelivery;
+    switch (method) {
+        case PaymentMethod::CreditCard: return creditCard;
+        case PaymentMethod::Gcash: return gcash;
+        case PaymentMethod::CashOnDelivery: return cashOnDelivery;
+    }
+    throw runtime_error("Invalid payment option.");
+}
+
+// ----------------------------- Payment Gateway -----------------------------
+// The remote side of a payment. charge() takes a batch of charges for one
+// method and fills in one outcome per charge; Failed means the gateway could
+// not process it this time (it may succeed if sent again). A gateway must
+// give up by the deadline and report what it did not finish as Failed.
+// Each checkout attempt has its own idempotency key, sent again with every
+// retry: a gateway charges a key at most once and answers a repeat of an
+// approved key with Approved, so a retry after a lost reply cannot charge
+// the shopper twice.
+enum class ChargeOutcome { Approved, Failed };
+
+struct ChargeRequest {
+    uint64_t idempotencyKey;
+    Money amount;
+};
+
+class PaymentGateway {
+public:
+    virtual void charge(PaymentMethod method, const vector<ChargeRequest>& charges,
+                        chrono::steady_clock::time_point deadline, vector<ChargeOutcome>& outcomes) = 0;
+    virtual ~PaymentGateway() = default;
+};
+
+// In-process stand-in for a real gateway: every call takes `latency`
+// (however many charges it carries) and each new charge fails with the
+// given probability. Keys it approved before are approved again.
+class StubGateway : public PaymentGateway {
+private:
+    chrono::microseconds latency;
+    double failureRate;
+    mutex rngLock;
+    mt19937 rng{12345};
+    unordered_set<uint64_t> approvedKeys;
+    atomic<uint64_t> calls{0};
+
+public:
+    StubGateway(chrono::microseconds callLatency, double failRate) : latency(callLatency), failureRate(failRate) {}
+
+    uint64_t callCount() const { return calls; }
+
+    void charge(PaymentMethod, const vector<ChargeRequest>& charges, chrono::steady_clock::time_point deadline,
+                vector<ChargeOutcome>& outcomes) override {
+        ++calls;
+        auto done = chrono::steady_clock::now() + latency;
+        this_thread::sleep_until(min(done, deadline));
+        outcomes.assign(charges.size(), ChargeOutcome::Failed);
+        if (done > deadline)
+            return;
+        uniform_real_distribution<double> roll(0.0, 1.0);
+        lock_guard<mutex> guard(rngLock);
+        for (size_t i = 0; i < charges.size(); ++i) {
+            if (approvedKeys.count(charges[i].idempotencyKey) || roll(rng) >= failureRate) {
+                outcomes[i] = ChargeOutcome::Approved;
+                approvedKeys.insert(charges[i].idempotencyKey);
+            }
+        }
+    }
+};
+
+// ----------------------------- Payment Dispatcher -----------------------------
+enum class PaymentStatus { Approved, Failed, TimedOut };
+
+struct PaymentResult {
+    PaymentStatus status;
+    int attempts;
+    uint64_t idempotencyKey;
+};
+
+// Sends payments to a gateway without blocking the caller. submit() queues
+// a payment and returns a future for its result. A fixed set of caller
+// threads (the gateway connections) each take up to maxBatch queued
+// payments of one method at a time, oldest method first, so payments
+// queue up into batches while every connection is busy. Failed payments
+// are queued again (up to maxRetries more times); any payment still
+// unpaid when its timeout runs out is reported as TimedOut. Every submit()
+// is one checkout attempt with its own idempotency key, which each retry
+// of it sends again.
+class PaymentDispatcher {
+private:
+    struct Pending {
+        uint64_t idempotencyKey;
+        Money amount;
+        chrono::steady_clock::time_point deadline;
+        chrono::steady_clock::time_point queuedAt;
+        int attempts = 0;
+        promise<PaymentResult> result;
+        function<void()> whenDone; // run on the caller thread once result is set
+    };
+
+    static void finish(Pending& payment, PaymentStatus status) {
+        payment.result.set_value({status, payment.attempts, payment.idempotencyKey});
+        if (payment.whenDone)
+            payment.whenDone();
+    }
+
+    PaymentGateway& gateway;
+    size_t maxBatch;
+    chrono::milliseconds timeout;
+    int maxRetries;
+    array<deque<Pending>, 3> lanes; // one per PaymentMethod
+    mutex lock;
+    condition_variable ready;
+    bool stopping = false;
+    vector<thread> callers;
+    // Random per dispatcher, so keys do not repeat across restarts
+    const uint64_t keyBase = (uint64_t)random_device()() << 32 ^ random_device()();
+    atomic<uint64_t> attemptCount{0};
+
+    static PaymentMethod methodOf(size_t lane) { return static_cast<PaymentMethod>(lane + 1); }
+
+    // Picks the method whose oldest payment has waited longest
+    bool takeBatch(size_t& lane, vector<Pending>& batch) {
+        bool found = false;
+        for (size_t i = 0; i < lanes.size(); ++i) {
+            if (!lanes[i].empty() && (!found || lanes[i].front().queuedAt < lanes[lane].front().queuedAt)) {
+                lane = i;
+                found = true;
+            }
+        }
+        if (!found)
+            return false;
+        while (!lanes[lane].empty() && batch.size() < maxBatch) {
+            batch.push_back(move(lanes[lane].front()));
+            lanes[lane].pop_front();
+        }
+        return true;
+    }
+
+    void callerLoop() {
+        vector<Pending> batch, again;
+        vector<ChargeRequest> charges;
+        vector<ChargeOutcome> outcomes;
+        while (true) {
+            size_t lane = 0;
+            batch.clear();
+            {
+                unique_lock<mutex> guard(lock);
+                ready.wait(guard, [&] { return takeBatch(lane, batch) || stopping; });
+                if (batch.empty())
+                    return;
+            }
+
+            auto now = chrono::steady_clock::now();
+            auto deadline = chrono::steady_clock::time_point::max();
+            charges.clear();
+            for (Pending& payment : batch) {
+                charges.push_back({payment.idempotencyKey, payment.amount});
+                deadline = min(deadline, payment.deadline);
+                ++payment.attempts;
+            }
+            if (deadline > now)
+                gateway.charge(methodOf(lane), charges, deadline, outcomes);
+            else
+                outcomes.assign(batch.size(), ChargeOutcome::Failed);
+
+            now = chrono::steady_clock::now();
+            again.clear();
+            for (size_t i = 0; i < batch.size(); ++i) {
+                Pending& payment = batch[i];
+                if (outcomes[i] == ChargeOutcome::Approved)
+                    finish(payment, PaymentStatus::Approved);
+                else if (payment.deadline <= now)
+                    finish(payment, PaymentStatus::TimedOut);
+                else if (payment.attempts > maxRetries)
+                    finish(payment, PaymentStatus::Failed);
+                else
+                    again.push_back(move(payment));
+            }
+            if (!again.empty()) {
+                {
+                    lock_guard<mutex> guard(lock);
+                    for (auto it = again.rbegin(); it != again.rend(); ++it)
+                        lanes[lane].push_front(move(*it));
+                }
+                ready.notify_one();
+            }
+        }
+    }
+
+public:
+    PaymentDispatcher(PaymentGateway& paymentGateway, int connections = 4, size_t batchLimit = 64,
+                      chrono::milliseconds paymentTimeout = chrono::milliseconds(2000), int retries = 2)
+        : gateway(paymentGateway), maxBatch(max<size_t>(1, batchLimit)), timeout(paymentTimeout), maxRetries(retries) {
+        for (int i = 0; i < max(1, connections); ++i)
+            callers.emplace_back([this] { callerLoop(); });
+    }
+
+    // Payments already queued are still sent before the callers stop
+    ~PaymentDispatcher() {
+        {
+            lock_guard<mutex> guard(lock);
+            stopping = true;
+        }
+        ready.notify_all();
+        for (auto& caller : callers)
+            caller.join();
+    }
+
+    uint64_t newKey() { return keyBase + attemptCount.fetch_add(1, memory_order_relaxed); }
+
+    future<PaymentResult> submit(PaymentMethod method, Money amount) { return submit(method, amount, newKey()); }
+
+    // Sends a payment under a key from an earlier attempt, which the gateway
+    // approves without charging again if it already took that payment.
+    // whenDone, if given, is called once the result is ready; it runs on a
+    // gateway caller thread, so it should only hand the work on.
+    future<PaymentResult> submit(PaymentMethod method, Money amount, uint64_t idempotencyKey,
+                                 function<void()> whenDone = nullptr) {
+        size_t lane = static_cast<size_t>(method) - 1;
+        if (lane >= lanes.size())
+            throw runtime_error("Invalid payment option.");
+        auto now = chrono::steady_clock::now();
+        Pending payment;
+        payment.idempotencyKey = idempotencyKey;
+        payment.amount = amount;
+        payment.deadline = now + timeout;
+        payment.queuedAt = now;
+        payment.whenDone = move(whenDone);
+        future<PaymentResult> result = payment.result.get_future();
+        {
+            lock_guard<mutex> guard(lock);
+            lanes[lane].push_back(move(payment));
+        }
+        ready.notify_one();
+        return result;
+    }
+};
+
+// ----------------------------- Order Class -----------------------------
+class Order {
+private:
+    Cart& cart;
+
+public:
+    Order(Cart& c) : cart(c) {}
+
+    void checkout(PaymentStrategy* strategy, RenderBuffer& out) {
+        if (cart.isEmpty())
+            throw runtime_error("Cart is empty. Add items before checkout.");
+        Money total = cart.calculateTotal();
+        strategy->pay(total, out);
+        out << "Checkout complete. Thank you for your purchase!\n";
+    }
+};
+
+// ----------------------------- Receipt Generation -----------------------------
+void renderReceipt(RenderBuffer& out, const User& user, const Cart& cart, string_view paymentMethod) {
+    out<<"\n--- Receipt ---\n";
+    out<<"User: "<<user.getUsername()<<'\n';
+    out<<"Email: "<<user.getEmail()<<'\n';
+    out<<"Shipping Address: "<<user.getAddress()<<'\n';
+    out<<"Payment Method: "<<paymentMethod<<'\n';
+    out<<"Items Purchased:\n";
+
+    Money grandTotal;
+    for (const auto& entry : cart.getItems()) {
+        int productId = entry.first;
+        int quantity = entry.second;
+        int slot = cart.findSlot(productId);
+        if (slot >= 0) {
+            const CatalogSnapshot& catalog = cart.getCatalog();
+            Money itemTotal = catalog.priceAt(slot) * quantity;
+            out << "- " << catalog.nameAt(slot) << " x" << quantity << " - Php " << itemTotal << '\n';
+            grandTotal += itemTotal;
+        }
+    }
+    out << "\nTotal: Php " << grandTotal << '\n';
+    out << "---------------------\n";
+}
+
+void appendJsonChars(RenderBuffer& out, string_view text) {
+    for (char c : text) {
+        if (c == '"' || c == '\\') {
+            out << '\\' << c;
+        } else if ((unsigned char)c < 0x20) {
+            const char* hex = "0123456789abcdef";
+            out << "\\u00" << hex[(c >> 4) & 0xf] << hex[c & 0xf];
+        } else {
+            out << c;
+        }
+    }
+}
+
+void appendJsonString(RenderBuffer& out, string_view text) {
+    out << '"';
+    appendJsonChars(out, text);
+    out << '"';
+}
+
+void appendJsonString(RenderBuffer& out, const AddressView& address) {
+    out << '"';
+    appendJsonChars(out, address.city);
+    if (address.split) {
+        out << ", ";
+        appendJsonChars(out, address.province);
+    }
+    out << '"';
+}
+
+// One JSON object per line; amounts are in centavos.
+void renderReceiptCompact(RenderBuffer& out, const User& user, const Cart& cart, string_view paymentMethod) {
+    out << "{\"user\":";
+    appendJsonString(out, user.getUsername());
+    out << ",\"email\":";
+    appendJsonString(out, user.getEmail());
+    out << ",\"address\":";
+    appendJsonString(out, user.getAddress());
+    out << ",\"payment\":";
+    appendJsonString(out, paymentMethod);
+    out << ",\"items\":[";
+    Money grandTotal;
+    bool first = true;
+    for (const auto& entry : cart.getItems()) {
+        int slot = cart.findSlot(entry.first);
+        if (slot < 0)
+            continue;
+        Money itemTotal = cart.getCatalog().priceAt(slot) * entry.second;
+        out << (first ? "" : ",") << "{\"id\":" << entry.first << ",\"qty\":" << entry.second
+            << ",\"amount\":" << itemTotal.getCentavos() << '}';
+        grandTotal += itemTotal;
+        first = false;
+    }
+    out << "],\"total\":" << grandTotal.getCentavos() << "}\n";
+}
+
+void generateReceipt(const User& user, const Cart& cart, string_view paymentMethod, ostream& out = cout) {
+    thread_local RenderBuffer buffer;
+    buffer.clear();
+    renderReceipt(buffer, user, cart, paymentMethod);
+    buffer.writeTo(out);
+}
+
+// Appends receipts to a file, batching them into large writes.
+enum class ReceiptFormat { Text, Compact };
+
+class ReceiptWriter {
+private:
+    FILE* file;
+    ReceiptFormat format;
+    size_t batchBytes;
+    RenderBuffer pending;
+    mutex lock;
+
+public:
+    ReceiptWriter(const string& path, ReceiptFormat fmt, size_t batch = 1 << 20)
+        : file(fopen(path.c_str(), "ab")), format(fmt), batchBytes(batch) {
+        if (!file)
+            throw runtime_error("Cannot open receipt file: " + path);
+    }
+
+    ~ReceiptWriter() {
+        flush();
+        fclose(file);
+    }
+
+    void write(const User& user, const Cart& cart, string_view paymentMethod) {
+        lock_guard<mutex> guard(lock);
+        if (format == ReceiptFormat::Text)
+            renderReceipt(pending, user, cart, paymentMethod);
+        else
+            renderReceiptCompact(pending, user, cart, paymentMethod);
+        if (pending.size() >= batchBytes) {
+            pending.writeTo(file);
+            pending.clear();
+        }
+    }
+
+    void flush() {
+        lock_guard<mutex> guard(lock);
+        pending.writeTo(file);
+        pending.clear();
+        fflush(file);
+    }
+};
+
+// ----------------------------- Input Utility Functions -----------------------------
+int readInt(const string& prompt, int minValue, int maxValue) {
+    int choice;
+    while (true) {
+        cout << prompt;
+        if (cin >> choice && choice >= minValue && choice <= maxValue) {
+            cin.ignore(numeric_limits<streamsize>::max(), '\n');
+            return choice;
+        } else {
+            cout << "Invalid input. Please enter a number between " << minValue << " and " << maxValue << "." << endl;
+            cin.clear();
+            cin.ignore(numeric_limits<streamsize>::max(), '\n');
+        }
+    }
+}
+
+string readNonEmptyLine(const string& prompt) {
+    string input;
+    do {
+        cout << prompt;
+        getline(cin, input);
+        if (input.empty()) {
+            cout << "Input cannot be empty. Please try again." << endl;
+        }
+    } while (input.empty());
+    return input;
+}
+
+// ----------------------------- Email Validation Function -----------------------------
+// An email needs an '@' that is neither its first nor its last character,
+// and a '.' after the '@' that is not the last character. The email is
+// read 8 bytes at a time and every byte of a word is tested for '@' or '.'
+// at once with integer arithmetic (SWAR), so there is no branch per
+// character.
+constexpr uint64_t swarLowBits = 0x7f7f7f7f7f7f7f7full;
+constexpr uint64_t swarHighBits = 0x8080808080808080ull;
+
+// Bytes [0, count) of p, byte i in bits 8i..8i+7; the rest are zero
+uint64_t loadSwarWord(const char* p, size_t count) {
+    uint64_t word = 0;
+    if (count == 8)
+        memcpy(&word, p, 8);
+    else
+        memcpy(&word, p, count);
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    word = __builtin_bswap64(word);
+#endif
+    return word;
+}
+
+// The high bit of each byte of word that equals c (no carries between bytes)
+uint64_t swarMatch(uint64_t word, unsigned char c) {
+    uint64_t x = word ^ (0x0101010101010101ull * c);
+    return ~(((x & swarLowBits) + swarLowBits) | x) & swarHighBits;
+}
+
+// Bytes [0, count) of a word
+uint64_t swarLowBytes(size_t count) {
+    return count >= 8 ? ~0ull : (uint64_t(1) << (8 * count)) - 1;
+}
+
+bool isValidEmail(string_view email) {
+    size_t size = email.size(), atPos = string_view::npos;
+    for (size_t i = 0; i < size; i += 8) {
+        uint64_t word = loadSwarWord(email.data() + i, min<size_t>(8, size - i));
+        if (atPos == string_view::npos) {
+            uint64_t ats = swarMatch(word, '@');
+            if (!ats)
+                continue;
+            atPos = i + __builtin_ctzll(ats) / 8;
+            if (atPos == 0 || atPos == size - 1)
+                return false;
+        }
+        uint64_t dots = swarMatch(word, '.') & swarLowBytes(size - 1 - i);
+        if (atPos >= i)
+            dots &= ~swarLowBytes(atPos - i + 1);
+        if (dots)
+            return true;
+    }
+    return false;
+}
+
+// ----------------------------- User Authentication -----------------------------
+struct Credential {
+    string username;
+    string password;
+    string email;
+};
+
+// Accounts indexed by username in an open-addressing hash table (linear
+// probing), so signup and login cost the same however many users exist.
+class CredentialStore {
+private:
+    struct Bucket {
+        uint32_t tag;  // upper hash bits, checked before comparing strings
+        int32_t record; // index into records, -1 if empty
+    };
+
+    vector<Credential> records;
+    vector<Bucket> buckets;
+
+    // Bucket holding username, or the empty bucket where it would go
+    size_t locate(string_view username, uint64_t h) const {
+        size_t mask = buckets.size() - 1;
+        uint32_t tag = (uint32_t)(h >> 32);
+        for (size_t pos = h & mask;; pos = (pos + 1) & mask) {
+            const Bucket& b = buckets[pos];
+            if (b.record < 0 || (b.tag == tag && records[b.record].username == username))
+                return pos;
+        }
+    }
+
+    void rehash(size_t capacity) {
+        buckets.assign(capacity, Bucket{0, -1});
+        for (size_t i = 0; i < records.size(); ++i) {
+            uint64_t h = hashName(records[i].username);
+            buckets[locate(records[i].username, h)] = Bucket{(uint32_t)(h >> 32), (int32_t)i};
+        }
+    }
+
+public:
+    static uint64_t hashName(string_view name) {
+        uint64_t h = 1469598103934665603ULL; // FNV-1a
+        for (unsigned char c : name) {
+            h ^= c;
+            h *= 1099511628211ULL;
+        }
+        return h;
+    }
+
+    size_t size() const { return records.size(); }
+    bool empty() const { return records.empty(); }
+
+    void reserve(size_t count) {
+        records.reserve(count);
+        size_t capacity = 16;
+        while (capacity < count * 2)
+            capacity *= 2;
+        if (capacity > buckets.size())
+            rehash(capacity);
+    }
+
+    const Credential* find(const string& username) const {
+        if (buckets.empty())
+            return nullptr;
+        const Bucket& b = buckets[locate(username, hashName(username))];
+        return b.record < 0 ? nullptr : &records[b.record];
+    }
+
+    // Returns false (and stores nothing) if the username is already taken
+    bool insert(const Credential& cred) {
+        if ((records.size() + 1) * 2 > buckets.size())
+            rehash(max<size_t>(16, buckets.size() * 2));
+        uint64_t h = hashName(cred.username);
+        size_t pos = locate(cred.username, h);
+        if (buckets[pos].record >= 0)
+            return false;
+        buckets[pos] = Bucket{(uint32_t)(h >> 32), (int32_t)records.size()};
+        records.push_back(cred);
+        return true;
+    }
+
+    // Moves the accounts in, in order, with one probe each; hashes[i] is
+    // hashName(batch[i].username). holders[i] is -1 if account i was added,
+    // or else the index of the account that already had the username.
+    // The buckets are fetched a few accounts ahead, since the hashes are
+    // known up front.
+    void insertBatch(vector<Credential>& batch, const vector<uint64_t>& hashes, vector<int32_t>& holders) {
+        reserve(records.size() + batch.size());
+        holders.assign(batch.size(), -1);
+        size_t mask = buckets.size() - 1;
+        for (size_t i = 0; i < batch.size(); ++i) {
+            if (i + 8 < batch.size())
+                __builtin_prefetch(&buckets[hashes[i + 8] & mask]);
+            size_t pos = locate(batch[i].username, hashes[i]);
+            if (buckets[pos].record >= 0) {
+                holders[i] = buckets[pos].record;
+                continue;
+            }
+            buckets[pos] = Bucket{(uint32_t)(hashes[i] >> 32), (int32_t)records.size()};
+            records.push_back(move(batch[i]));
+        }
+    }
+};
+
+CredentialStore credentials;
+
+bool isValidCredential(string_view input) {
+    return input.length() >= 3;
+}
+
+// ----------------------------- User Import -----------------------------
+// Bulk sign-up from "username,password,email" lines (a file or pasted
+// text), e.g.
+//   username,password,email
+//   juan,secret123,juan@example.com
+struct UserImportError {
+    size_t line;
+    string message;
+};
+
+struct UserImportResult {
+    size_t records = 0; // account lines read, good or bad
+    size_t added = 0;   // of those, signed up
+    vector<UserImportError> errors; // in line order
+    double seconds = 0;
+};
+
+// A run of whole lines, parsed and checked on one thread. Line numbers
+// count from the start of the chunk until the chunks are put together.
+struct UserImportChunk {
+    string_view text;
+    size_t lines = 0;
+    size_t records = 0;
+    vector<Credential> accounts;
+    vector<uint64_t> hashes; // CredentialStore::hashName of each username
+    vector<size_t> accountLines;
+    vector<UserImportError> errors;
+};
+
+// Splits text at line ends into about `pieces` chunks of equal size
+vector<UserImportChunk> splitUserImport(string_view text, size_t pieces) {
+    vector<UserImportChunk> chunks;
+    size_t target = max<size_t>(1 << 16, text.size() / max<size_t>(1, pieces) + 1);
+    for (size_t start = 0; start < text.size();) {
+        size_t stop = min(text.size(), start + target);
+        if (stop < text.size()) {
+            const void* newline = memchr(text.data() + stop, '\n', text.size() - stop);
+            stop = newline ? static_cast<const char*>(newline) - text.data() + 1 : text.size();
+        }
+        chunks.emplace_back();
+        chunks.back().text = text.substr(start, stop - start);
+        start = stop;
+    }
+    return chunks;
+}
+
+// Reads the lines of the chunk like parseCartImport and runs the sign-up
+// checks on each account. Spaces around the fields, blank lines, # comments
+// and (in the first chunk) a header line are skipped.
+void parseUserImportChunk(UserImportChunk& chunk, bool firstChunk) {
+    const char* at = chunk.text.data();
+    const char* end = at + chunk.text.size();
+    auto field = [](const char* from, const char* to) {
+        while (from < to && (*from == ' ' || *from == '\t'))
+            ++from;
+        while (to > from && (to[-1] == ' ' || to[-1] == '\t'))
+            --to;
+        return string_view(from, to - from);
+    };
+    for (size_t lineNumber = 1; at < end; ++lineNumber) {
+        const char* stop = static_cast<const char*>(memchr(at, '\n', end - at));
+        const char* next = stop ? stop + 1 : end;
+        if (!stop)
+            stop = end;
+        if (stop > at && stop[-1] == '\r')
+            --stop;
+        chunk.lines = lineNumber;
+        const char* line = at;
+        at = next;
+        string_view whole = field(line, stop);
+        if (whole.empty() || whole[0] == '#' || (firstChunk && lineNumber == 1 && whole == "username,password,email"))
+            continue;
+
+        ++chunk.records;
+        const char* comma1 = static_cast<const char*>(memchr(line, ',', stop - line));
+        const char* comma2 = comma1 ? static_cast<const char*>(memchr(comma1 + 1, ',', stop - comma1 - 1)) : nullptr;
+        if (!comma2 || memchr(comma2 + 1, ',', stop - comma2 - 1)) {
+            chunk.errors.push_back({lineNumber, "Expected <username>,<password>,<email>."});
+            continue;
+        }
+        string_view username = field(line, comma1), password = field(comma1 + 1, comma2),
+                    email = field(comma2 + 1, stop);
+        const char* problem = !isValidCredential(username)   ? "Username must be at least 3 characters long."
+                              : !isValidCredential(password) ? "Password must be at least 3 characters long."
+                              : !isValidEmail(email)         ? "Invalid email format."
+                                                             : nullptr;
+        if (problem) {
+            chunk.errors.push_back({lineNumber, problem});
+            continue;
+        }
+        chunk.accounts.push_back({string(username), string(password), string(email)});
+        chunk.hashes.push_back(CredentialStore::hashName(username));
+        chunk.accountLines.push_back(lineNumber);
+    }
+}
+
+void renderUserImport(RenderBuffer& out, const UserImportResult& result) {
+    for (const UserImportError& error : result.errors)
+        out << "line " << error.line << ": " << error.message << '\n';
+    char timing[64];
+    snprintf(timing, sizeof(timing), "%.3f s (%.0f records/s)", result.seconds,
+             result.seconds > 0 ? result.records / result.seconds : 0.0);
+    out << "Signed up " << result.added << " of " << result.records << " account(s) in " << timing << ".\n";
+}
+
+// ----------------------------- Epoch Reclamation -----------------------------
+// Lets readers follow a published pointer with no lock and no reference
+// count. A reader pins the current epoch for the life of a Guard; a writer
+// that swaps a pointer out retires the old object, and it is freed once
+// every pinned reader has moved past the epoch it was retired in.
+class EpochDomain {
+private:
+    static constexpr size_t maxThreads = 1024;
+
+    struct alignas(64) ThreadSlot {
+        atomic<uint64_t> pinned{0}; // 0 while the thread is not reading
+        atomic<bool> taken{false};
+    };
+
+    struct Retired {
+        uint64_t epoch;
+        function<void()> free;
+    };
+
+    // A thread's claim on a slot, given back when the thread exits
+    struct SlotLease {
+        ThreadSlot* slot = nullptr;
+        int depth = 0;
+        ~SlotLease() {
+            if (slot)
+                slot->taken.store(false, memory_order_release);
+        }
+    };
+
+    array<ThreadSlot, maxThreads> slots;
+    atomic<size_t> slotsUsed{0};
+    atomic<uint64_t> epoch{1};
+    mutex retireLock;
+    vector<Retired> retired;
+
+    SlotLease& lease() {
+        thread_local SlotLease mine;
+        if (!mine.slot) {
+            for (size_t i = 0; i < maxThreads && !mine.slot; ++i) {
+                bool expected = false;
+                if (slots[i].taken.compare_exchange_strong(expected, true)) {
+                    mine.slot = &slots[i];
+                    size_t used = slotsUsed.load();
+                    while (used < i + 1 && !slotsUsed.compare_exchange_weak(used, i + 1)) {}
+                }
+            }
+            if (!mine.slot)
+                throw runtime_error("Too many threads reading the catalog.");
+        }
+        return mine;
+    }
+
+public:
+    // Pins the current epoch; guards on one thread may nest
+    class Guard {
+    private:
+        SlotLease& mine;
+
+    public:
+        explicit Guard(EpochDomain& epochs) : mine(epochs.lease()) {
+            if (mine.depth++ == 0)
+                mine.slot->pinned.store(epochs.epoch.load(), memory_order_seq_cst);
+        }
+        ~Guard() {
+            if (--mine.depth == 0)
+                mine.slot->pinned.store(0, memory_order_release);
+        }
+        Guard(const Guard&) = delete;
+        Guard& operator=(const Guard&) = delete;
+    };
+
+    ~EpochDomain() {
+        for (Retired& entry : retired)
+            entry.free();
+    }
+
+    // Frees the object with `free` once no reader can still see it
+    void retire(function<void()> free) {
+        {
+            lock_guard<mutex> guard(retireLock);
+            retired.push_back({epoch.fetch_add(1), move(free)});
+        }
+        reclaim();
+    }
+
+    void reclaim() {
+        vector<Retired> ready;
+        {
+            lock_guard<mutex> guard(retireLock);
+            uint64_t oldest = UINT64_MAX;
+            for (size_t i = 0; i < slotsUsed.load(); ++i) {
+                uint64_t pinned = slots[i].pinned.load(memory_order_seq_cst);
+                if (pinned != 0)
+                    oldest = min(oldest, pinned);
+            }
+            auto keep = partition(retired.begin(), retired.end(),
+                                  [oldest](const Retired& entry) { return entry.epoch >= oldest; });
+            move(keep, retired.end(), back_inserter(ready));
+            retired.erase(keep, retired.end());
+        }
+        for (Retired& entry : ready)
+            entry.free();
+    }
+
+    size_t pendingCount() {
+        lock_guard<mutex> guard(retireLock);
+        return retired.size();
+    }
+};
+
+// The domain shared by everything published to session threads
+EpochDomain& sharedEpochs() {
+    static EpochDomain epochs;
+    return epochs;
+}
+
+// A pointer readers load inside a Guard with no lock. publish() swaps in
+// a new object and retires the old one; writers must not publish
+// concurrently with each other.
+template <typename T>
+class RcuPointer {
+private:
+    atomic<T*> current{nullptr};
+
+public:
+    RcuPointer() = default;
+    explicit RcuPointer(unique_ptr<T> initial) : current(initial.release()) {}
+    ~RcuPointer() { delete current.load(); }
+    RcuPointer(const RcuPointer&) = delete;
+    RcuPointer& operator=(const RcuPointer&) = delete;
+
+    // Valid until the caller's Guard ends
+    T* read() const { return current.load(memory_order_seq_cst); }
+
+    void publish(unique_ptr<T> next) {
+        T* old = current.exchange(next.release(), memory_order_seq_cst);
+        if (old)
+            sharedEpochs().retire([old] { delete old; });
+    }
+};
+
+// ----------------------------- Inventory -----------------------------
+// Units in stock per product, one atomic counter each. Checkout reserves
+// every cart line with compare-and-swap and rolls back what it took if a
+// line cannot be filled, so no lock is held and stock never goes negative.
+// Counters are found through a view of the current catalog; a new catalog
+// gets a new view that keeps the counters of the products it carries over,
+// so stock taken during a reload is never lost. Counters are made in one
+// block per catalog that added products, and each view holds the blocks
+// it uses, so a block is freed with the last view (retired through the
+// epoch domain) that still counts a product in it.
+class Inventory {
+private:
+    struct CounterBlock {
+        unique_ptr<atomic<int>[]> counters;
+        size_t size;
+    };
+
+    struct StockView {
+        CatalogRef catalog;
+        atomic<int>* base = nullptr; // counters in slot order, when none were carried over
+        vector<atomic<int>*> bySlot; // otherwise one per slot
+        vector<shared_ptr<const CounterBlock>> blocks; // every block the counters are in
+    };
+
+    int initialStock;
+    mutex reloadLock;
+    RcuPointer<const StockView> view;
+
+    static atomic<int>* counterFor(const StockView& stock, int productId) {
+        int slot = stock.catalog->findSlot(productId);
+        if (slot < 0)
+            return nullptr;
+        return stock.base ? stock.base + slot : stock.bySlot[slot];
+    }
+
+public:
+    Inventory(CatalogRef snapshot, int startingStock) : initialStock(startingStock) {
+        setCatalog(move(snapshot));
+    }
+
+    // Products new to this catalog start with the initial stock; products
+    // that were removed lose theirs
+    void setCatalog(CatalogRef snapshot) {
+        lock_guard<mutex> guard(reloadLock);
+        EpochDomain::Guard pin(sharedEpochs());
+        const StockView* old = view.read();
+        unique_ptr<StockView> next(new StockView{move(snapshot), nullptr, {}, {}});
+        size_t count = next->catalog->size();
+        auto newBlock = [&](size_t size) {
+            shared_ptr<CounterBlock> block(new CounterBlock{unique_ptr<atomic<int>[]>(new atomic<int>[size]), size});
+            for (size_t i = 0; i < size; ++i)
+                block->counters[i].store(initialStock, memory_order_relaxed);
+            next->blocks.push_back(block);
+            return block->counters.get();
+        };
+        if (!old) {
+            next->base = newBlock(count);
+            view.publish(move(next));
+            return;
+        }
+
+        // Old blocks by address, to find the one a carried counter is in
+        map<const atomic<int>*, size_t> blockAt;
+        for (size_t i = 0; i < old->blocks.size(); ++i)
+            blockAt.emplace(old->blocks[i]->counters.get(), i);
+        vector<bool> used(old->blocks.size());
+        next->bySlot.resize(count);
+        vector<size_t> added;
+        for (size_t slot = 0; slot < count; ++slot) {
+            atomic<int>* counter = counterFor(*old, next->catalog->idAt(slot));
+            if (counter) {
+                next->bySlot[slot] = counter;
+                used[prev(blockAt.upper_bound(counter))->second] = true;
+            } else {
+                added.push_back(slot);
+            }
+        }
+        for (size_t i = 0; i < old->blocks.size(); ++i)
+            if (used[i])
+                next->blocks.push_back(old->blocks[i]);
+        if (!added.empty()) {
+            atomic<int>* block = newBlock(added.size());
+            for (size_t i = 0; i < added.size(); ++i)
+                next->bySlot[added[i]] = &block[i];
+        }
+        view.publish(move(next));
+    }
+
+    void setStock(int productId, int units) {
+        EpochDomain::Guard pin(sharedEpochs());
+        atomic<int>* counter = counterFor(*view.read(), productId);
+        if (!counter)
+            throw runtime_error("Product not found.");
+        counter->store(units);
+    }
+
+    int available(int productId) const {
+        EpochDomain::Guard pin(sharedEpochs());
+        atomic<int>* counter = counterFor(*view.read(), productId);
+        return counter ? counter->load(memory_order_relaxed) : 0;
+    }
+
+    // Takes quantity units of every (productId, quantity) line, or none of
+    // them. Returns the index of the first line that could not be filled,
+    // or -1 when all lines were reserved.
+    int reserve(const CartLines& lines) {
+        EpochDomain::Guard pin(sharedEpochs());
+        const StockView& stock = *view.read();
+        for (size_t i = 0; i < lines.size(); ++i) {
+            atomic<int>* counter = counterFor(stock, lines.productIdAt(i));
+            bool taken = false;
+            if (counter) {
+                int current = counter->load(memory_order_relaxed);
+                while (current >= lines.quantityAt(i)) {
+                    if (counter->compare_exchange_weak(current, current - lines.quantityAt(i),
+                                                       memory_order_acq_rel, memory_order_relaxed)) {
+                        taken = true;
+                        break;
+                    }
+                }
+            }
+            if (!taken) {
+                for (size_t j = 0; j < i; ++j)
+                    counterFor(stock, lines.productIdAt(j))->fetch_add(lines.quantityAt(j), memory_order_acq_rel);
+                return (int)i;
+            }
+        }
+        return -1;
+    }
+
+    void release(const CartLines& lines) {
+        EpochDomain::Guard pin(sharedEpochs());
+        const StockView& stock = *view.read();
+        for (const auto& line : lines) {
+            if (atomic<int>* counter = counterFor(stock, line.first))
+                counter->fetch_add(line.second, memory_order_acq_rel);
+        }
+    }
+};
+
+// ----------------------------- Order History -----------------------------
+struct OrderLine {
+    int32_t productId;
+    int32_t quantity;
+    int64_t amountCentavos;
+};
+
+struct OrderRecord {
+    uint64_t orderId = 0;
+    int64_t timestampMillis = 0;
+    int64_t totalCentavos = 0;
+    PaymentMethod method = PaymentMethod::CreditCard;
+    string username;
+    string province; // of the shipping address
+    vector<OrderLine> lines;
+};
+
+OrderRecord makeOrderRecord(const User& user, const Cart& cart, PaymentMethod method) {
+    OrderRecord record;
+    record.timestampMillis = chrono::duration_cast<chrono::milliseconds>(
+        chrono::system_clock::now().time_since_epoch()).count();
+    record.method = method;
+    record.username = user.getUsername();
+    record.province = user.getProvince();
+    record.lines.reserve(cart.getItems().size());
+    for (const auto& item : cart.getItems()) {
+        int slot = cart.findSlot(item.first);
+        if (slot < 0)
+            continue;
+        Money amount = cart.getCatalog().priceAt(slot) * item.second;
+        record.lines.push_back({item.first, item.second, amount.getCentavos()});
+        record.totalCentavos += amount.getCentavos();
+    }
+    return record;
+}
+
+// Every completed order, in checkout order, stored column by column for
+// analytics. Each order line is one row of productId, quantity, amount,
+// payment method, province and time; orders keep their id, user, total
+// and range of lines. Rows go into fixed-size segments that are filled
+// once and never move, so a reader that took the row count under the lock
+// can scan up to it afterwards without the lock.
+class OrderHistory {
+public:
+    static constexpr size_t segmentRows = size_t(1) << 16;
+    // Provinces past the first 65535 share this id, so the province
+    // columns stay 16 bits and add() cannot run out of ids
+    static constexpr uint16_t otherProvince = 0xffff;
+    static constexpr size_t maxSpellings = size_t(1) << 16;
+
+    struct LineSegment {
+        int32_t productIds[segmentRows];
+        int32_t quantities[segmentRows];
+        int64_t amounts[segmentRows]; // centavos
+        uint32_t seconds[segmentRows]; // checkout time, Unix seconds
+        uint16_t provinces[segmentRows];
+        uint8_t methods[segmentRows];
+    };
+
+    struct OrderSegment {
+        uint64_t orderIds[segmentRows];
+        int64_t timestamps[segmentRows]; // ms
+        int64_t totals[segmentRows];
+        uint64_t firstLines[segmentRows];
+        uint32_t lineCounts[segmentRows];
+        uint32_t users[segmentRows];
+        uint16_t provinces[segmentRows];
+        uint8_t methods[segmentRows];
+    };
+
+    // The rows that existed when it was taken; the segments stay valid
+    // for as long as the history does
+    struct LineSnapshot {
+        vector<const LineSegment*> segments;
+        size_t rows = 0;
+
+        size_t rowsIn(size_t segment) const { return min(segmentRows, rows - segment * segmentRows); }
+    };
+
+private:
+    mutable mutex lock;
+    vector<unique_ptr<LineSegment>> lineSegments;
+    vector<unique_ptr<OrderSegment>> orderSegments;
+    size_t lineRows = 0, orderRows = 0;
+    uint64_t nextOrderId = 1;
+    vector<string> usernames, provinceNames;
+    unordered_map<string, uint32_t> userIds;
+    vector<vector<uint64_t>> userOrders; // order rows of each user
+    unordered_map<string, uint16_t> provinceIds; // by normalized name
+    unordered_map<string, uint16_t> provinceSpellings; // by name as entered, up to maxSpellings
+
+    uint32_t userId(const string& username) {
+        auto found = userIds.find(username);
+        if (found != userIds.end())
+            return found->second;
+        usernames.push_back(username);
+        userOrders.emplace_back();
+        return userIds[username] = (uint32_t)usernames.size() - 1;
+    }
+
+    // Provinces are grouped without regard to case or surrounding spaces
+    uint16_t provinceId(const string& province) {
+        auto spelled = provinceSpellings.find(province);
+        if (spelled != provinceSpellings.end())
+            return spelled->second;
+        string key = normalizeCategory(province);
+        auto found = provinceIds.find(key);
+        uint16_t id = otherProvince;
+        if (found != provinceIds.end()) {
+            id = found->second;
+        } else if (provinceNames.size() < otherProvince) {
+            provinceNames.push_back(key.empty() ? string() : province.substr(province.find_first_not_of(" \t"), key.size()));
+            id = (uint16_t)(provinceNames.size() - 1);
+            provinceIds.emplace(key, id);
+        }
+        if (provinceSpellings.size() < maxSpellings)
+            provinceSpellings.emplace(province, id);
+        return id;
+    }
+
+    string nameOfProvince(uint16_t province) const {
+        if (province == otherProvince)
+            return "(other provinces)";
+        return province < provinceNames.size() ? provinceNames[province] : string();
+    }
+
+public:
+    // Records without an id (no journal attached) are numbered here
+    void add(const OrderRecord& record) {
+        lock_guard<mutex> guard(lock);
+        uint64_t orderId = record.orderId == 0 ? nextOrderId : record.orderId;
+        nextOrderId = max(nextOrderId, orderId + 1);
+        uint16_t province = provinceId(record.province);
+        uint32_t seconds = (uint32_t)max<int64_t>(0, record.timestampMillis / 1000);
+
+        if (orderRows % segmentRows == 0)
+            orderSegments.emplace_back(new OrderSegment);
+        OrderSegment& order = *orderSegments.back();
+        size_t row = orderRows % segmentRows;
+        order.orderIds[row] = orderId;
+        order.timestamps[row] = record.timestampMillis;
+        order.totals[row] = record.totalCentavos;
+        order.firstLines[row] = lineRows;
+        order.lineCounts[row] = (uint32_t)record.lines.size();
+        order.users[row] = userId(record.username);
+        userOrders[order.users[row]].push_back(orderRows);
+        order.provinces[row] = province;
+        order.methods[row] = (uint8_t)record.method;
+        ++orderRows;
+
+        for (const OrderLine& line : record.lines) {
+            if (lineRows % segmentRows == 0)
+                lineSegments.emplace_back(new LineSegment);
+            LineSegment& lines = *lineSegments.back();
+            size_t at = lineRows % segmentRows;
+            lines.productIds[at] = line.productId;
+            lines.quantities[at] = line.quantity;
+            lines.amounts[at] = line.amountCentavos;
+            lines.seconds[at] = seconds;
+            lines.provinces[at] = province;
+            lines.methods[at] = (uint8_t)record.method;
+            ++lineRows;
+        }
+    }
+
+    size_t size() const {
+        lock_guard<mutex> guard(lock);
+        return orderRows;
+    }
+
+    size_t lineCount() const {
+        lock_guard<mutex> guard(lock);
+        return lineRows;
+    }
+
+    LineSnapshot lines() const {
+        lock_guard<mutex> guard(lock);
+        LineSnapshot snapshot;
+        for (const auto& segment : lineSegments)
+            snapshot.segments.push_back(segment.get());
+        snapshot.rows = lineRows;
+        return snapshot;
+    }
+
+    string provinceName(uint16_t province) const {
+        lock_guard<mutex> guard(lock);
+        return nameOfProvince(province);
+    }
+
+    // Reads only the user's own rows, so it costs the same however long
+    // the history is
+    vector<OrderRecord> ordersFor(string_view username) const {
+        lock_guard<mutex> guard(lock);
+        vector<OrderRecord> result;
+        auto found = userIds.find(string(username));
+        if (found == userIds.end())
+            return result;
+        const vector<uint64_t>& rows = userOrders[found->second];
+        result.reserve(rows.size());
+        for (uint64_t row : rows) {
+            const OrderSegment& order = *orderSegments[row / segmentRows];
+            size_t at = row % segmentRows;
+            OrderRecord record;
+            record.orderId = order.orderIds[at];
+            record.timestampMillis = order.timestamps[at];
+            record.totalCentavos = order.totals[at];
+            record.method = (PaymentMethod)order.methods[at];
+            record.username = usernames[order.users[at]];
+            record.province = nameOfProvince(order.provinces[at]);
+            for (uint64_t line = order.firstLines[at]; line < order.firstLines[at] + order.lineCounts[at]; ++line) {
+                const LineSegment& lines = *lineSegments[line / segmentRows];
+                size_t lineAt = line % segmentRows;
+                record.lines.push_back({lines.productIds[lineAt], lines.quantities[lineAt], lines.amounts[lineAt]});
+            }
+            result.push_back(move(record));
+        }
+        return result;
+    }
+};
+
+// ----------------------------- Order Analytics -----------------------------
+// Revenue, units and line counts of the order history grouped by one
+// column. Threads take whole segments in turn and sum them into a table of
+// their own; the tables are merged once every segment is done, so the scan
+// itself shares nothing between threads.
+enum class OrderDimension { Product, Province, Method, Day };
+
+OrderDimension parseOrderDimension(const string& name) {
+    if (name == "product")
+        return OrderDimension::Product;
+    if (name == "province")
+        return OrderDimension::Province;
+    if (name == "method")
+        return OrderDimension::Method;
+    if (name == "day")
+        return OrderDimension::Day;
+    throw runtime_error("Group orders by product, province, method or day.");
+}
+
+struct GroupTotal {
+    int64_t key = 0;
+    int64_t revenueCentavos = 0;
+    int64_t units = 0;
+    int64_t lines = 0;
+};
+
+// Totals by key in an open-addressing table kept at most half full
+class GroupTotals {
+private:
+    vector<GroupTotal> slots;
+    vector<bool> used;
+    size_t count = 0;
+    int bits = 6;
+
+    size_t home(int64_t key) const { return (size_t)(((uint64_t)key * 0x9E3779B97F4A7C15ull) >> (64 - bits)); }
+
+    GroupTotal& slotFor(int64_t key) {
+        size_t mask = slots.size() - 1;
+        size_t pos = home(key);
+        for (; used[pos]; pos = (pos + 1) & mask)
+            if (slots[pos].key == key)
+                return slots[pos];
+        if ((count + 1) * 2 > slots.size()) {
+            grow();
+            return slotFor(key);
+        }
+        used[pos] = true;
+        ++count;
+        slots[pos] = GroupTotal{key, 0, 0, 0};
+        return slots[pos];
+    }
+
+    void grow() {
+        vector<GroupTotal> old = move(slots);
+        vector<bool> oldUsed = move(used);
+        ++bits;
+        slots.assign(size_t(1) << bits, GroupTotal());
+        used.assign(slots.size(), false);
+        count = 0;
+        for (size_t i = 0; i < old.size(); ++i)
+            if (oldUsed[i])
+                slotFor(old[i].key) = old[i];
+    }
+
+public:
+    GroupTotals() : slots(size_t(1) << 6), used(slots.size(), false) {}
+
+    void add(int64_t key, int64_t revenueCentavos, int64_t units, int64_t lines = 1) {
+        GroupTotal& total = slotFor(key);
+        total.revenueCentavos += revenueCentavos;
+        total.units += units;
+        total.lines += lines;
+    }
+
+    void merge(const GroupTotals& other) {
+        for (size_t i = 0; i < other.slots.size(); ++i)
+            if (other.used[i])
+                add(other.slots[i].key, other.slots[i].revenueCentavos, other.slots[i].units, other.slots[i].lines);
+    }
+
+    vector<GroupTotal> rows() const {
+        vector<GroupTotal> result;
+        for (size_t i = 0; i < slots.size(); ++i)
+            if (used[i])
+                result.push_back(slots[i]);
+        return result;
+    }
+};
+
+// One row per key, in no particular order
+vector<GroupTotal> aggregateOrderLines(const OrderHistory::LineSnapshot& lines, OrderDimension by, int threads) {
+    threads = max(1, min<int>(threads, (int)lines.segments.size()));
+    vector<GroupTotals> partials(threads);
+    atomic<size_t> nextSegment{0};
+    auto scan = [&](GroupTotals& mine) {
+        for (size_t segment; (segment = nextSegment.fetch_add(1)) < lines.segments.size();) {
+            const OrderHistory::LineSegment& rows = *lines.segments[segment];
+            size_t count = lines.rowsIn(segment);
+            for (size_t i = 0; i < count; ++i) {
+                int64_t key = by == OrderDimension::Product    ? rows.productIds[i]
+                              : by == OrderDimension::Province ? rows.provinces[i]
+                              : by == OrderDimension::Method   ? rows.methods[i]
+                                                               : rows.seconds[i] / 86400;
+                mine.add(key, rows.amounts[i], rows.quantities[i]);
+            }
+        }
+    };
+    vector<thread> workers;
+    for (int t = 1; t < threads; ++t)
+        workers.emplace_back(scan, ref(partials[t]));
+    scan(partials[0]);
+    for (auto& worker : workers)
+        worker.join();
+    for (int t = 1; t < threads; ++t)
+        partials[0].merge(partials[t]);
+    return partials[0].rows();
+}
+
+// Days since 1970-01-01 -> "YYYY-MM-DD" (proleptic Gregorian calendar)
+string formatDay(int64_t days) {
+    days += 719468;
+    int64_t era = (days >= 0 ? days : days - 146096) / 146097;
+    int64_t dayOfEra = days - era * 146097;
+    int64_t yearOfEra = (dayOfEra - dayOfEra / 1460 + dayOfEra / 36524 - dayOfEra / 146096) / 365;
+    int64_t dayOfYear = dayOfEra - (365 * yearOfEra + yearOfEra / 4 - yearOfEra / 100);
+    int64_t shifted = (5 * dayOfYear + 2) / 153;
+    int64_t day = dayOfYear - (153 * shifted + 2) / 5 + 1;
+    int64_t month = shifted < 10 ? shifted + 3 : shifted - 9;
+    int64_t year = yearOfEra + era * 400 + (month <= 2);
+    char text[16];
+    snprintf(text, sizeof(text), "%04d-%02d-%02d", (int)year, (int)month, (int)day);
+    return text;
+}
+
+// The `top` groups with the most revenue (days: the latest `top` days, in
+// order), then the totals over every group
+void renderOrderAnalytics(RenderBuffer& out, const OrderHistory& history, const CatalogSnapshot& catalog,
+                          OrderDimension by, size_t top, int threads) {
+    vector<GroupTotal> groups = aggregateOrderLines(history.lines(), by, threads);
+    GroupTotal all;
+    for (const GroupTotal& group : groups) {
+        all.revenueCentavos += group.revenueCentavos;
+        all.units += group.units;
+        all.lines += group.lines;
+    }
+    if (by == OrderDimension::Day) {
+        sort(groups.begin(), groups.end(), [](const GroupTotal& a, const GroupTotal& b) { return a.key < b.key; });
+        groups.erase(groups.begin(), groups.end() - min(top, groups.size()));
+    } else {
+        sort(groups.begin(), groups.end(), [](const GroupTotal& a, const GroupTotal& b) {
+            return a.revenueCentavos != b.revenueCentavos ? a.revenueCentavos > b.revenueCentavos : a.key < b.key;
+        });
+        groups.resize(min(top, groups.size()));
+    }
+
+    static const char* const titles[] = {"product", "province", "payment method", "day"};
+    out << "\n--- Revenue by " << titles[(int)by] << " ---\n";
+    for (const GroupTotal& group : groups) {
+        if (by == OrderDimension::Product) {
+            int slot = catalog.findSlot((int)group.key);
+            out << "ID: " << group.key << " | " << (slot >= 0 ? catalog.nameAt(slot) : string_view("(no longer sold)"));
+        } else if (by == OrderDimension::Province) {
+            string name = history.provinceName((uint16_t)group.key);
+            out << (name.empty() ? "(no province)" : name);
+        } else if (by == OrderDimension::Method) {
+            out << paymentMethodName((PaymentMethod)group.key);
+        } else {
+            out << formatDay(group.key);
+        }
+        out << " | Php " << Money::fromCentavos(group.revenueCentavos) << " | " << group.units << " unit(s) | "
+            << group.lines << " line(s)\n";
+    }
+    out << "Total: Php " << Money::fromCentavos(all.revenueCentavos) << " | " << all.units << " unit(s) | "
+        << all.lines << " line(s)\n";
+}
+
+#ifdef SHOP_POSIX
+// ----------------------------- Order Journal -----------------------------
+// Append-only binary log of completed orders. The file starts with an
+// 8-byte magic, followed by records of
+//   u32 payload size | u32 FNV-1a checksum of payload | payload
+// where the payload is
+//   u64 order id | i64 timestamp (ms) | i64 total (centavos) | u8 payment
+//   u16 username length | u32 line count | u16 province length | username
+//   province | lines (i32, i32, i64)
+// Journals from before provinces were recorded (magic SHOPJRN1, without the
+// province fields) are still read and are appended to in their own format.
+// Checkouts only copy their record into a memory batch. A flusher thread
+// writes the batch and fdatasync()s it every syncIntervalMs, so concurrent
+// checkouts share one sync. If a write or sync fails, the file is cut back
+// to its last synced record and the journal fails: waiters and every later
+// append get the error. On open, a torn record at the end is cut off and
+// damaged bytes between intact records are skipped.
+class OrderJournal {
+private:
+    static constexpr char magic[9] = "SHOPJRN2";
+    static constexpr char magicWithoutProvince[9] = "SHOPJRN1";
+    static constexpr size_t headerSize = 8;
+    static constexpr size_t fixedPayloadWithoutProvince = 8 + 8 + 8 + 1 + 2 + 4;
+    static constexpr size_t fixedPayload = fixedPayloadWithoutProvince + 2;
+
+    int fd = -1;
+    bool withProvince = true;
+    int syncIntervalMs;
+    mutex lock;
+    condition_variable wake, synced;
+    string pending, spare;
+    uint64_t appendedSeq = 0, durableSeq = 0;
+    off_t durableEnd = 0;  // file length up to the last synced record
+    string failure;        // set once a write or sync fails
+    size_t skippedOnOpen = 0;
+    atomic<uint64_t> nextOrderId{1};
+    bool stopping = false;
+    thread flusher;
+
+    static uint32_t checksum(const char* data, size_t size) {
+        uint32_t h = 2166136261u;
+        for (size_t i = 0; i < size; ++i) {
+            h ^= (unsigned char)data[i];
+            h *= 16777619u;
+        }
+        return h;
+    }
+
+    template <typename T>
+    static void put(string& out, T value) {
+        out.append(reinterpret_cast<const char*>(&value), sizeof(T));
+    }
+
+    template <typename T>
+    static T get(const char* p) {
+        T value;
+        memcpy(&value, p, sizeof(T));
+        return value;
+    }
+
+    static void encode(const OrderRecord& record, bool withProvince, string& out) {
+        size_t start = out.size();
+        out.append(8, '\0'); // size and checksum, filled in below
+        put<uint64_t>(out, record.orderId);
+        put<int64_t>(out, record.timestampMillis);
+        put<int64_t>(out, record.totalCentavos);
+        put<uint8_t>(out, (uint8_t)record.method);
+        put<uint16_t>(out, (uint16_t)min<size_t>(record.username.size(), 0xffff));
+        put<uint32_t>(out, (uint32_t)record.lines.size());
+        if (withProvince)
+            put<uint16_t>(out, (uint16_t)min<size_t>(record.province.size(), 0xffff));
+        out.append(record.username, 0, 0xffff);
+        if (withProvince)
+            out.append(record.province, 0, 0xffff);
+        for (const auto& line : record.lines) {
+            put<int32_t>(out, line.productId);
+            put<int32_t>(out, line.quantity);
+            put<int64_t>(out, line.amountCentavos);
+        }
+        uint32_t size = (uint32_t)(out.size() - start - 8);
+        uint32_t sum = checksum(out.data() + start + 8, size);
+        memcpy(&out[start], &size, 4);
+        memcpy(&out[start + 4], &sum, 4);
+    }
+
+    static bool writeAll(int fd, const char* data, size_t size) {
+        while (size > 0) {
+            ssize_t n = ::write(fd, data, size);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                return false;
+            data += n;
+            size -= n;
+        }
+        return true;
+    }
+
+    static bool syncData(int fd) {
+        int result;
+        do
+            result = fdatasync(fd);
+        while (result != 0 && errno == EINTR);
+        return result == 0;
+    }
+
+    void flushLoop() {
+        unique_lock<mutex> guard(lock);
+        while (true) {
+            if (syncIntervalMs > 0)
+                wake.wait_for(guard, chrono::milliseconds(syncIntervalMs), [this] { return stopping; });
+            else
+                wake.wait(guard, [this] { return stopping || !pending.empty(); });
+            if (pending.empty()) {
+                if (stopping)
+                    return;
+                continue;
+            }
+            spare.swap(pending);
+            uint64_t batchSeq = appendedSeq;
+            guard.unlock();
+
+            bool written = writeAll(fd, spare.data(), spare.size()) && syncData(fd);
+            string error = written ? string() : string("Order journal write failed: ") + strerror(errno);
+            if (written)
+                durableEnd += spare.size();
+            else if (ftruncate(fd, durableEnd) == 0) // no torn record before later ones
+                lseek(fd, durableEnd, SEEK_SET);
+            spare.clear();
+
+            guard.lock();
+            if (written) {
+                durableSeq = batchSeq;
+            } else {
+                failure = error;
+                pending.clear();
+            }
+            synced.notify_all();
+        }
+    }
+
+public:
+    // A decoded record that points into the mapped journal file. Only
+    // records whose checksum matched and that fit() their size are visited.
+    struct RecordView {
+        const char* payload;
+        bool withProvince;
+
+        uint64_t orderId() const { return get<uint64_t>(payload); }
+        int64_t timestampMillis() const { return get<int64_t>(payload + 8); }
+        int64_t totalCentavos() const { return get<int64_t>(payload + 16); }
+        PaymentMethod method() const { return (PaymentMethod)get<uint8_t>(payload + 24); }
+        uint16_t usernameLength() const { return get<uint16_t>(payload + 25); }
+        uint16_t provinceLength() const { return withProvince ? get<uint16_t>(payload + 31) : 0; }
+        size_t fixedSize() const { return withProvince ? fixedPayload : fixedPayloadWithoutProvince; }
+        string_view username() const { return string_view(payload + fixedSize(), usernameLength()); }
+        string_view province() const {
+            return string_view(payload + fixedSize() + usernameLength(), provinceLength());
+        }
+        uint32_t lineCount() const { return get<uint32_t>(payload + 27); }
+        // Whether the lengths and line count add up to exactly size bytes
+        // and the payment method is known
+        bool fits(uint32_t size) const {
+            if (size < fixedSize())
+                return false;
+            uint64_t needed = fixedSize() + (uint64_t)usernameLength() + provinceLength() + (uint64_t)lineCount() * 16;
+            uint8_t payment = get<uint8_t>(payload + 24);
+            return needed == size && payment >= (uint8_t)PaymentMethod::CreditCard &&
+                   payment <= (uint8_t)PaymentMethod::CashOnDelivery;
+        }
+        OrderLine line(uint32_t i) const {
+            const char* p = payload + fixedSize() + usernameLength() + provinceLength() + i * 16;
+            return OrderLine{get<int32_t>(p), get<int32_t>(p + 4), get<int64_t>(p + 8)};
+        }
+
+        OrderRecord toRecord() const {
+            OrderRecord record;
+            record.orderId = orderId();
+            record.timestampMillis = timestampMillis();
+            record.totalCentavos = totalCentavos();
+            record.method = method();
+            record.username = string(username());
+            record.province = string(province());
+            for (uint32_t i = 0; i < lineCount(); ++i)
+                record.lines.push_back(line(i));
+            return record;
+        }
+    };
+
+    // Maps the journal and calls visit for every intact record. Returns the
+    // end of the last intact record (0 if the file does not exist).
+    // withProvince is set to the journal's format, and skipped to the
+    // number of damaged bytes passed over before the last intact record.
+    static size_t replay(const string& path, const function<void(const RecordView&)>& visit,
+                         bool* withProvince = nullptr, size_t* skipped = nullptr) {
+        int in = open(path.c_str(), O_RDONLY);
+        if (in < 0)
+            return 0;
+        struct stat info;
+        fstat(in, &info);
+        size_t length = info.st_size;
+        if (length < headerSize) {
+            ::close(in);
+            return 0;
+        }
+        void* mapped = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, in, 0);
+        ::close(in);
+        if (mapped == MAP_FAILED)
+            throw runtime_error("Cannot map journal: " + path);
+        madvise(mapped, length, MADV_SEQUENTIAL);
+        const char* data = static_cast<const char*>(mapped);
+        bool current = memcmp(data, magic, headerSize) == 0;
+        if (!current && memcmp(data, magicWithoutProvince, headerSize) != 0) {
+            munmap(mapped, length);
+            throw runtime_error("Not an order journal: " + path);
+        }
+        if (withProvince)
+            *withProvince = current;
+
+        // A record that does not check out is stepped over one byte at a
+        // time until the next intact one, so a torn record does not hide
+        // the records written after it.
+        size_t offset = headerSize, end = headerSize, damaged = 0;
+        size_t minimum = current ? fixedPayload : fixedPayloadWithoutProvince;
+        while (offset + 8 <= length) {
+            uint32_t size = get<uint32_t>(data + offset);
+            RecordView record{data + offset + 8, current};
+            if (size < minimum || size > length - offset - 8 ||
+                checksum(data + offset + 8, size) != get<uint32_t>(data + offset + 4) || !record.fits(size)) {
+                ++offset;
+                continue;
+            }
+            visit(record);
+            damaged += offset - end;
+            offset += 8 + size;
+            end = offset;
+        }
+        munmap(mapped, length);
+        if (skipped)
+            *skipped = damaged;
+        return end;
+    }
+
+    // Replays the existing journal through visit, then opens it for appending.
+    OrderJournal(const string& path, int syncInterval, const function<void(const RecordView&)>& visit)
+        : syncIntervalMs(syncInterval) {
+        size_t valid = replay(path, [&](const RecordView& record) {
+            nextOrderId = max<uint64_t>(nextOrderId, record.orderId() + 1);
+            if (visit)
+                visit(record);
+        }, &withProvince, &skippedOnOpen);
+        fd = open(path.c_str(), O_RDWR | O_CREAT, 0644);
+        if (fd < 0)
+            throw runtime_error("Cannot open journal: " + path);
+        if (valid == 0) {
+            withProvince = true;
+            if (ftruncate(fd, 0) != 0 || ::write(fd, magic, headerSize) != (ssize_t)headerSize)
+                throw runtime_error("Cannot write journal: " + path);
+        } else if (ftruncate(fd, valid) != 0) {
+            throw runtime_error("Cannot truncate journal: " + path);
+        }
+        durableEnd = lseek(fd, 0, SEEK_END);
+        flusher = thread([this] { flushLoop(); });
+    }
+
+    ~OrderJournal() {
+        {
+            lock_guard<mutex> guard(lock);
+            stopping = true;
+        }
+        wake.notify_all();
+        flusher.join();
+        ::close(fd);
+    }
+
+    // Damaged bytes skipped while replaying on open
+    size_t skippedBytes() const { return skippedOnOpen; }
+
+    // Throws the write or sync error once the journal has failed
+    void checkWritable() {
+        lock_guard<mutex> guard(lock);
+        if (!failure.empty())
+            throw runtime_error(failure);
+    }
+
+    // Gives the record its order id and queues it for the next group
+    // commit. With waitDurable, returns only once it has been synced, and
+    // throws if the batch it was in could not be written.
+    uint64_t append(OrderRecord& record, bool waitDurable = false) {
+        thread_local string encoded;
+        encoded.clear();
+        record.orderId = nextOrderId++;
+        encode(record, withProvince, encoded);
+        unique_lock<mutex> guard(lock);
+        if (!failure.empty())
+            throw runtime_error(failure);
+        pending += encoded;
+        uint64_t seq = ++appendedSeq;
+        if (syncIntervalMs == 0)
+            wake.notify_one();
+        if (waitDurable) {
+            synced.wait(guard, [&] { return durableSeq >= seq || !failure.empty(); });
+            if (durableSeq < seq)
+                throw runtime_error(failure);
+        }
+        return record.orderId;
+    }
+};
+#endif
+
+// ----------------------------- Operation Stats -----------------------------
+// Latency histograms and counters for the shop operations. Each thread
+// records into its own shard, so recording takes no lock and shares no
+// cache line; reading merges every shard. Latencies are kept in clock
+// ticks (the CPU's time-stamp counter where there is one) and converted
+// to time only when read.
+enum class ShopOp { SignUp, LogIn, AddToCart, UpdateQuantity, RemoveFromCart, ViewCart, Checkout, Receipt, ImportCart, ImportUsers, Count };
+
+const char* shopOpName(ShopOp op) {
+    static const char* const names[] = {"signup", "login", "add", "update", "remove", "cart", "checkout", "receipt", "import", "import-users"};
+    return names[(size_t)op];
+}
+
+inline uint64_t readTicks() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return (uint64_t)chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+const chrono::steady_clock::time_point ticksStartTime = chrono::steady_clock::now();
+const uint64_t ticksStart = readTicks();
+
+// Measured against steady_clock over the life of the program
+double ticksPerMicro() {
+    auto elapsed = chrono::steady_clock::now() - ticksStartTime;
+    if (elapsed < chrono::milliseconds(20)) {
+        this_thread::sleep_for(chrono::milliseconds(20) - elapsed);
+        elapsed = chrono::steady_clock::now() - ticksStartTime;
+    }
+    return double(readTicks() - ticksStart) / chrono::duration<double, micro>(elapsed).count();
+}
+
+// Log-linear buckets in the style of HdrHistogram: 64 steps per power of
+// two, so a value is reported at most 1/64 (about 1.6%) above what was
+// recorded. Only the owning thread writes; readers may merge at any time.
+//
+// Every call is counted, but reading the clock costs more than some of the
+// operations, so after the first exactCalls only one call in sampleEvery
+// is timed, and it is recorded with a weight of sampleEvery.
+class LatencyHistogram {
+public:
+    static constexpr int subBits = 6;
+    static constexpr int magnitudes = 40; // up to 2^40 ticks, several minutes
+    static constexpr size_t bucketCount = size_t(magnitudes - subBits + 1) << subBits;
+    static constexpr uint64_t exactCalls = 1024;
+    static constexpr uint32_t sampleEvery = 64;
+
+    // Merged counts of one operation. maxTicks is the slowest timed call:
+    // past exactCalls only sampled calls are timed, so it can miss the
+    // true worst case and is reported as sampled_max.
+    struct Totals {
+        uint64_t count = 0, failures = 0, sumTicks = 0, maxTicks = 0;
+        vector<uint64_t> buckets = vector<uint64_t>(bucketCount);
+
+        uint64_t weight() const { return accumulate(buckets.begin(), buckets.end(), uint64_t(0)); }
+
+        double meanTicks() const { return weight() ? double(sumTicks) / weight() : 0; }
+
+        // Smallest value at or above the given fraction of the recorded values
+        uint64_t percentile(double fraction) const {
+            uint64_t rank = max<uint64_t>(1, (uint64_t)ceil(fraction * weight())), seen = 0;
+            for (size_t bucket = 0; bucket < bucketCount; ++bucket) {
+                seen += buckets[bucket];
+                if (seen >= rank)
+                    return min(highestValueIn(bucket), maxTicks);
+            }
+            return maxTicks;
+        }
+    };
+
+private:
+    atomic<uint64_t> count{0}, failures{0}, sumTicks{0}, maxTicks{0};
+    array<atomic<uint64_t>, bucketCount> buckets{};
+    uint32_t untilSample = 1; // owner only
+
+    // A plain load and store: there is one writer, and no locked instruction
+    static void bump(atomic<uint64_t>& counter, uint64_t by = 1) {
+        counter.store(counter.load(memory_order_relaxed) + by, memory_order_relaxed);
+    }
+
+public:
+    static size_t bucketOf(uint64_t ticks) {
+        if (ticks < (1u << subBits))
+            return (size_t)ticks;
+        int magnitude = 63 - __builtin_clzll(ticks);
+        if (magnitude >= magnitudes)
+            return bucketCount - 1;
+        int shift = magnitude - subBits;
+        return (size_t(shift + 1) << subBits) + size_t((ticks >> shift) - (1u << subBits));
+    }
+
+    static uint64_t highestValueIn(size_t bucket) {
+        if (bucket < (1u << subBits))
+            return bucket;
+        int shift = int(bucket >> subBits) - 1;
+        uint64_t step = (bucket & ((1u << subBits) - 1)) + (1u << subBits);
+        return ((step + 1) << shift) - 1;
+    }
+
+    // Counts a call. Returns the weight to time it with, or 0 to skip it.
+    uint32_t begin() {
+        uint64_t calls = count.load(memory_order_relaxed) + 1;
+        count.store(calls, memory_order_relaxed);
+        if (calls <= exactCalls)
+            return 1;
+        if (--untilSample != 0)
+            return 0;
+        untilSample = sampleEvery;
+        return sampleEvery;
+    }
+
+    void fail() { bump(failures); }
+
+    void record(uint64_t ticks, uint32_t weight) {
+        bump(sumTicks, ticks * weight);
+        if (ticks > maxTicks.load(memory_order_relaxed))
+            maxTicks.store(ticks, memory_order_relaxed);
+        bump(buckets[bucketOf(ticks)], weight);
+    }
+
+    void addTo(Totals& totals) const {
+        totals.count += count.load(memory_order_relaxed);
+        totals.failures += failures.load(memory_order_relaxed);
+        totals.sumTicks += sumTicks.load(memory_order_relaxed);
+        totals.maxTicks = max(totals.maxTicks, maxTicks.load(memory_order_relaxed));
+        for (size_t bucket = 0; bucket < bucketCount; ++bucket)
+            totals.buckets[bucket] += buckets[bucket].load(memory_order_relaxed);
+    }
+};
+
+class OperationStats {
+private:
+    using Shard = array<LatencyHistogram, (size_t)ShopOp::Count>;
+
+    // A thread's shard, handed to `exited` when the thread ends so its
+    // counts are kept after the histograms are freed
+    struct ShardOwner {
+        OperationStats& stats;
+        unique_ptr<Shard> shard{new Shard()};
+        explicit ShardOwner(OperationStats& owner) : stats(owner) {
+            lock_guard<mutex> guard(stats.lock);
+            stats.live.push_back(shard.get());
+        }
+        ~ShardOwner() {
+            lock_guard<mutex> guard(stats.lock);
+            for (size_t op = 0; op < shard->size(); ++op)
+                (*shard)[op].addTo(stats.exited[op]);
+            stats.live.erase(find(stats.live.begin(), stats.live.end(), shard.get()));
+        }
+    };
+
+    mutex lock;
+    vector<Shard*> live;
+    array<LatencyHistogram::Totals, (size_t)ShopOp::Count> exited;
+    atomic<bool> enabled{true};
+
+    Shard* adoptThread() {
+        thread_local ShardOwner mine(*this);
+        return mine.shard.get();
+    }
+
+public:
+    LatencyHistogram& histogram(ShopOp op) {
+        thread_local Shard* mine = nullptr; // plain pointer: no init check on later calls
+        if (!mine)
+            mine = adoptThread();
+        return (*mine)[(size_t)op];
+    }
+
+    bool isEnabled() const { return enabled.load(memory_order_relaxed); }
+    void setEnabled(bool on) { enabled.store(on, memory_order_relaxed); }
+
+    array<LatencyHistogram::Totals, (size_t)ShopOp::Count> merged() {
+        lock_guard<mutex> guard(lock);
+        array<LatencyHistogram::Totals, (size_t)ShopOp::Count> totals = exited;
+        for (Shard* shard : live)
+            for (size_t op = 0; op < shard->size(); ++op)
+                (*shard)[op].addTo(totals[op]);
+        return totals;
+    }
+};
+
+OperationStats& operationStats() {
+    static OperationStats stats;
+    return stats;
+}
+
+// Counts one operation and, if it is sampled, times it from construction
+// to destruction
+class OperationTimer {
+private:
+    LatencyHistogram* histogram = nullptr;
+    uint64_t start = 0;
+    uint32_t weight = 0;
+
+public:
+    explicit OperationTimer(ShopOp op) {
+        if (!operationStats().isEnabled())
+            return;
+        histogram = &operationStats().histogram(op);
+        weight = histogram->begin();
+        if (weight)
+            start = readTicks();
+    }
+    ~OperationTimer() {
+        if (weight)
+            histogram->record(readTicks() - start, weight);
+    }
+    OperationTimer(const OperationTimer&) = delete;
+    OperationTimer& operator=(const OperationTimer&) = delete;
+
+    void failed() {
+        if (histogram)
+            histogram->fail();
+    }
+};
+
+// Runs fn as one operation; it counts as failed if it throws
+template <typename Fn>
+void timedOperation(ShopOp op, Fn&& fn) {
+    OperationTimer timer(op);
+    try {
+        fn();
+    } catch (...) {
+        timer.failed();
+        throw;
+    }
+}
+
+enum class StatsFormat { Text, Json };
+
+// Count, failures and mean/p50/p90/p99/max latency in microseconds for
+// every operation that has run
+void writeOperationStats(ostream& out, StatsFormat format) {
+    auto totals = operationStats().merged();
+    double perMicro = ticksPerMicro();
+    bool first = true;
+    if (format == StatsFormat::Text)
+        out << "operation\tcount\tfailed\tmean_us\tp50_us\tp90_us\tp99_us\tsampled_max_us\n";
+    else
+        out << "{\"operations\": [";
+    for (size_t op = 0; op < totals.size(); ++op) {
+        const LatencyHistogram::Totals& t = totals[op];
+        if (t.count == 0)
+            continue;
+        double values[] = {t.meanTicks() / perMicro, t.percentile(0.50) / perMicro,
+                           t.percentile(0.90) / perMicro, t.percentile(0.99) / perMicro, t.maxTicks / perMicro};
+        if (format == StatsFormat::Text) {
+            out << shopOpName(ShopOp(op)) << '\t' << t.count << '\t' << t.failures;
+            for (double value : values)
+                out << '\t' << value;
+            out << '\n';
+        } else {
+            static const char* const keys[] = {"mean_us", "p50_us", "p90_us", "p99_us", "sampled_max_us"};
+            out << (first ? "" : ", ") << "{\"operation\": \"" << shopOpName(ShopOp(op)) << "\", \"count\": "
+                << t.count << ", \"failed\": " << t.failures;
+            for (size_t i = 0; i < 5; ++i)
+                out << ", \"" << keys[i] << "\": " << values[i];
+            out << "}";
+        }
+        first = false;
+    }
+    if (format == StatsFormat::Json)
+        out << "]}\n";
+}
+
+#ifdef SHOP_POSIX
+// kill -USR1 <pid> writes the stats to stderr as text, -USR2 as JSON. The
+// signals are blocked in every thread and taken by one thread with
+// sigwait, so the dump runs as ordinary code. Call before starting any
+// other thread.
+void dumpStatsOnSignal() {
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGUSR1);
+    sigaddset(&signals, SIGUSR2);
+    pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+    thread([signals] {
+        int signal = 0;
+        while (sigwait(&signals, &signal) == 0) {
+            ostringstream text;
+            writeOperationStats(text, signal == SIGUSR2 ? StatsFormat::Json : StatsFormat::Text);
+            cerr << text.str() << flush;
+        }
+    }).detach();
+}
+#endif
+
+// ----------------------------- Shop Engine -----------------------------
+// Destroys an object placed in a session arena; the arena frees the memory
+struct ArenaDelete {
+    template <typename T>
+    void operator()(T* object) const { object->~T(); }
+};
+
+// Per-shopper state: the signed-in user (if any) and their cart. Both are
+// allocated from the session's arena, which starts in a buffer inside the
+// session and is emptied in one go at sign-out, so a short session does
+// not touch the global heap.
+struct ShopSession {
+    alignas(max_align_t) char arenaBuffer[4096];
+    pmr::monotonic_buffer_resource arenaBlocks{arenaBuffer, sizeof(arenaBuffer)};
+    pmr::unsynchronized_pool_resource arena{&arenaBlocks}; // reuses freed blocks until sign-out
+    unique_ptr<User, ArenaDelete> user;
+    Cart cart{&arena};
+    // A payment the gateway took for an order that could not be recorded.
+    // Checking out the same total again resends its key, so the shopper is
+    // not charged twice.
+    struct UnrecordedPayment {
+        bool pending = false;
+        uint64_t idempotencyKey = 0;
+        Money amount;
+    } unrecordedPayment;
+
+    ShopSession() = default;
+    ShopSession(const ShopSession&) = delete;
+    ShopSession& operator=(const ShopSession&) = delete;
+
+    // The user must stay valid until the session signs out
+    void signIn(string_view username) {
+        void* place = arena.allocate(sizeof(User), alignof(User));
+        user.reset(new (place) User(username, &arena));
+    }
+};
+
+// A checkout waiting on its payment. It holds a copy of the cart being paid
+// for and the shopper's details for the receipt, both on the default
+// resource rather than the session arena, so it stays valid if the session
+// signs out first; the session starts a new cart in the meantime.
+struct PendingCheckout {
+    PaymentMethod method;
+    User user;
+    Cart cart;
+    Money amount;
+    future<PaymentResult> payment;
+};
+
+// All shop operations, with no console I/O. Failures are reported by
+// throwing runtime_error with a message fit to show the shopper.
+class ShopEngine {
+private:
+    CredentialStore& credentials;
+    mutable shared_mutex credentialsLock; // sessions may run on several threads
+    // The newest catalog and the price changes leading up to it
+    struct PublishedCatalog {
+        CatalogRef snapshot;
+        shared_ptr<const CatalogChanges> changes;
+    };
+    RcuPointer<const PublishedCatalog> catalog; // read without a lock
+    mutex publishLock;
+    Inventory inventory;
+    ReceiptWriter* receiptLog = nullptr;
+    OrderHistory history;
+#ifdef SHOP_POSIX
+    OrderJournal* journal = nullptr;
+#endif
+    // The name index of one catalog, made by the index builder thread from
+    // the moment the catalog is published; a search that comes first waits
+    // for it without holding searchLock. A catalog replaced before its
+    // build started is never indexed: its index is set to null.
+    struct NameSearchState {
+        CatalogRef catalog;
+        promise<shared_ptr<const NameSearchIndex>> built;
+        shared_future<shared_ptr<const NameSearchIndex>> index;
+    };
+    mutable mutex searchLock; // guards only the nameSearch pointer
+    shared_ptr<NameSearchState> nameSearch; // for the newest catalog
+    // The builder takes the newest waiting catalog and updates the index it
+    // made last, so publishing never waits for a build
+    mutex builderLock;
+    condition_variable builderWake;
+    shared_ptr<NameSearchState> pendingSearch; // not started yet
+    bool builderStopping = false;
+    thread indexBuilder;
+    PaymentDispatcher* payments = nullptr;
+
+    shared_ptr<NameSearchState> requestNameSearch(CatalogRef snapshot) {
+        shared_ptr<NameSearchState> state(new NameSearchState);
+        state->catalog = move(snapshot);
+        state->index = state->built.get_future().share();
+        return state;
+    }
+
+    // Hands state to the builder, dropping a catalog still waiting for it
+    void queueNameSearch(shared_ptr<NameSearchState> state) {
+        lock_guard<mutex> guard(builderLock);
+        if (pendingSearch)
+            pendingSearch->built.set_value(nullptr);
+        pendingSearch = move(state);
+        builderWake.notify_one();
+    }
+
+    void buildNameSearches() {
+        CatalogRef lastCatalog;
+        shared_ptr<const NameSearchIndex> lastIndex;
+        unique_lock<mutex> guard(builderLock);
+        for (;;) {
+            builderWake.wait(guard, [this] { return builderStopping || pendingSearch; });
+            if (builderStopping)
+                break;
+            shared_ptr<NameSearchState> state = move(pendingSearch);
+            guard.unlock();
+            shared_ptr<const NameSearchIndex> index = lastIndex ? lastIndex->updatedFor(*lastCatalog, *state->catalog)
+                                                                : NameSearchIndex::build(*state->catalog);
+            state->built.set_value(index);
+            lastCatalog = state->catalog;
+            lastIndex = move(index);
+            guard.lock();
+        }
+        if (pendingSearch)
+            pendingSearch->built.set_value(nullptr);
+    }
+
+    User& requireUser(ShopSession& session) const {
+        if (!session.user)
+            throw runtime_error("Please log in first.");
+        return *session.user;
+    }
+
+    // Moves the cart onto the newest catalog if it was priced against an
+    // older one: lines are repriced and products no longer sold are taken
+    // out. Returns whether the cart's lines or total changed.
+    bool syncCart(ShopSession& session) {
+        EpochDomain::Guard pin(sharedEpochs());
+        const PublishedCatalog& current = *catalog.read();
+        if (session.cart.getPricedVersion() == current.snapshot->getVersion())
+            return false;
+        Money before = session.cart.calculateTotal();
+        session.cart.setCatalog(current.snapshot, current.changes.get());
+        return session.cart.dropMissing() > 0 || session.cart.calculateTotal() != before;
+    }
+
+    // Checks the cart and address and takes the stock for the cart. A cart
+    // priced against an older catalog is repriced first, and checkout stops
+    // if that changed it so the shopper can see the new prices.
+    void reserveCart(ShopSession& session) {
+        User& user = requireUser(session);
+        if (syncCart(session))
+            throw runtime_error("The catalog was updated and your cart was repriced. "
+                                "Please review your cart and check out again.");
+        if (session.cart.isEmpty())
+            throw runtime_error("Your cart is empty. Add items before checking out.");
+        if (user.getAddress().empty())
+            throw runtime_error("No shipping address found.");
+#ifdef SHOP_POSIX
+        if (journal)
+            journal->checkWritable(); // before any stock or payment is taken
+#endif
+        const CartLines& lines = session.cart.getItems();
+        int shortLine = inventory.reserve(lines);
+        if (shortLine >= 0) {
+            int productId = lines.productIdAt(shortLine);
+            const CatalogSnapshot& priced = session.cart.getCatalog();
+            throw runtime_error("Not enough stock for " + string(priced.nameAt(priced.findSlot(productId))) +
+                                " (" + to_string(inventory.available(productId)) + " left).");
+        }
+    }
+
+    // Records a paid cart in the journal and order history. The journal
+    // append waits for the group commit its record is in, so a receipt is
+    // only shown for an order that is on disk.
+    void recordOrder(const User& user, const Cart& cart, PaymentMethod method) {
+        OrderRecord record = makeOrderRecord(user, cart, method);
+#ifdef SHOP_POSIX
+        if (journal)
+            journal->append(record, true);
+#endif
+        history.add(record);
+    }
+
+    // Writes the receipt of a recorded order to out and the receipt log
+    void completeOrder(const User& user, const Cart& cart, PaymentMethod method, RenderBuffer& buffer, ostream& out) {
+        timedOperation(ShopOp::Receipt, [&] { renderReceipt(buffer, user, cart, paymentMethodName(method)); });
+        buffer.writeTo(out);
+        if (receiptLog)
+            receiptLog->write(user, cart, paymentMethodName(method));
+    }
+
+public:
+    ShopEngine(CredentialStore& store, CatalogRef snapshot, int initialStock = 100)
+        : credentials(store),
+          catalog(unique_ptr<const PublishedCatalog>(new PublishedCatalog{snapshot, CatalogChanges::first(*snapshot)})),
+          inventory(snapshot, initialStock), nameSearch(requestNameSearch(snapshot)) {
+        indexBuilder = thread([this] { buildNameSearches(); });
+        queueNameSearch(nameSearch);
+    }
+
+    ShopEngine(const ShopEngine&) = delete;
+    ShopEngine& operator=(const ShopEngine&) = delete;
+
+    ~ShopEngine() {
+        {
+            lock_guard<mutex> guard(builderLock);
+            builderStopping = true;
+        }
+        builderWake.notify_one();
+        indexBuilder.join();
+    }
+
+    // The newest catalog. Holding the reference keeps that version alive.
+    CatalogRef getCatalog() const {
+        EpochDomain::Guard pin(sharedEpochs());
+        return catalog.read()->snapshot;
+    }
+
+    // Makes snapshot the catalog for every session, without stopping them.
+    // Carts move to it (and are repriced) on their next cart operation;
+    // older snapshots are freed once no cart or reader holds them. The
+    // name index is queued here and built on the builder thread; searches
+    // use the newest catalog's index, waiting for it if need be.
+    void publishCatalog(CatalogRef snapshot) {
+        lock_guard<mutex> guard(publishLock);
+        shared_ptr<NameSearchState> search = requestNameSearch(snapshot);
+        inventory.setCatalog(snapshot);
+        shared_ptr<const CatalogChanges> changes;
+        {
+            EpochDomain::Guard pin(sharedEpochs());
+            const PublishedCatalog& previous = *catalog.read();
+            changes = CatalogChanges::between(*previous.snapshot, *previous.changes, *snapshot);
+        }
+        catalog.publish(unique_ptr<const PublishedCatalog>(new PublishedCatalog{move(snapshot), move(changes)}));
+        {
+            lock_guard<mutex> searchGuard(searchLock);
+            nameSearch.swap(search);
+        }
+        // queued once searches can find it, so one whose catalog is dropped finds this one
+        queueNameSearch(nameSearch);
+        // the old state is freed here, outside searchLock, unless a search still holds it
+    }
+    Inventory& getInventory() { return inventory; }
+    void setReceiptLog(ReceiptWriter* writer) { receiptLog = writer; }
+    OrderHistory& getHistory() { return history; }
+#ifdef SHOP_POSIX
+    void setJournal(OrderJournal* orderJournal) { journal = orderJournal; }
+#endif
+    // With a dispatcher, payments go to its gateway instead of being taken at once
+    void setPaymentDispatcher(PaymentDispatcher* dispatcher) { payments = dispatcher; }
+    bool paysThroughGateway() const { return payments != nullptr; }
+    // Searches the index of the newest catalog; the lock is held only to
+    // copy its pointer. Hits are slots in `searched`.
+    vector<SearchHit> searchProducts(string_view query, CatalogRef& searched, size_t limit = 10) const {
+        for (;;) {
+            shared_ptr<const NameSearchState> state;
+            {
+                lock_guard<mutex> guard(searchLock);
+                state = nameSearch;
+            }
+            shared_ptr<const NameSearchIndex> index = state->index.get();
+            if (index) {
+                searched = state->catalog;
+                return index->search(*state->catalog, query, limit);
+            }
+            // a newer catalog replaced this one before it was indexed
+        }
+    }
+
+    bool hasUsers() const {
+        shared_lock<shared_mutex> guard(credentialsLock);
+        return !credentials.empty();
+    }
+
+    bool usernameTaken(const string& username) const {
+        shared_lock<shared_mutex> guard(credentialsLock);
+        return credentials.find(username) != nullptr;
+    }
+
+    void signUp(const string& username, const string& password, const string& email) {
+        timedOperation(ShopOp::SignUp, [&] {
+            if (!isValidCredential(username))
+                throw runtime_error("Username must be at least 3 characters long.");
+            if (!isValidCredential(password))
+                throw runtime_error("Password must be at least 3 characters long.");
+            if (!isValidEmail(email))
+                throw runtime_error("Invalid email format. Please try again.");
+            unique_lock<shared_mutex> guard(credentialsLock);
+            if (!credentials.insert({username, password, email}))
+                throw runtime_error("Username already exists. Please try logging in.");
+        });
+    }
+
+    // Signs up every valid account in the "username,password,email" lines
+    // of text. Chunks of lines are parsed and checked on `threads` threads;
+    // the accounts are then added under one lock with a single hash probe
+    // each, which also catches usernames repeated within the text.
+    UserImportResult importUsers(string_view text, int threads) {
+        UserImportResult result;
+        auto start = chrono::steady_clock::now();
+        timedOperation(ShopOp::ImportUsers, [&] {
+            vector<UserImportChunk> chunks = splitUserImport(text, (size_t)max(1, threads) * 4);
+            atomic<size_t> nextChunk{0};
+            auto parse = [&] {
+                for (size_t chunk; (chunk = nextChunk.fetch_add(1)) < chunks.size();)
+                    parseUserImportChunk(chunks[chunk], chunk == 0);
+            };
+            vector<thread> workers;
+            for (int t = 1; t < min<int>(threads, (int)chunks.size()); ++t)
+                workers.emplace_back(parse);
+            parse();
+            for (auto& worker : workers)
+                worker.join();
+
+            size_t total = 0;
+            for (const UserImportChunk& chunk : chunks)
+                total += chunk.accounts.size();
+            vector<size_t> addedLines; // of each account added, in order
+            vector<pair<size_t, int32_t>> taken; // line and holder of each account left out
+            addedLines.reserve(total);
+            size_t existing;
+            {
+                unique_lock<shared_mutex> guard(credentialsLock);
+                existing = credentials.size();
+                credentials.reserve(existing + total);
+                vector<int32_t> holders;
+                size_t lineBase = 0;
+                for (UserImportChunk& chunk : chunks) {
+                    credentials.insertBatch(chunk.accounts, chunk.hashes, holders);
+                    for (size_t i = 0; i < holders.size(); ++i) {
+                        if (holders[i] < 0)
+                            addedLines.push_back(lineBase + chunk.accountLines[i]);
+                        else
+                            taken.push_back({lineBase + chunk.accountLines[i], holders[i]});
+                    }
+                    lineBase += chunk.lines;
+                }
+            }
+
+            size_t lineBase = 0;
+            for (UserImportChunk& chunk : chunks) {
+                for (UserImportError& error : chunk.errors)
+                    result.errors.push_back({lineBase + error.line, move(error.message)});
+                result.records += chunk.records;
+                lineBase += chunk.lines;
+            }
+            result.added = addedLines.size();
+            for (const auto& [line, holder] : taken) {
+                if ((size_t)holder < existing)
+                    result.errors.push_back({line, "Username already exists."});
+                else
+                    result.errors.push_back({line, "Username already used on line " +
+                                                       to_string(addedLines[holder - existing]) + "."});
+            }
+            if (!taken.empty())
+                sort(result.errors.begin(), result.errors.end(),
+                     [](const UserImportError& a, const UserImportError& b) { return a.line < b.line; });
+        });
+        result.seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        return result;
+    }
+
+    void logIn(ShopSession& session, const string& username, const string& password) {
+        timedOperation(ShopOp::LogIn, [&] {
+            shared_lock<shared_mutex> guard(credentialsLock);
+            const Credential* cred = credentials.find(username);
+            if (!cred || cred->password != password)
+                throw runtime_error("Invalid username or password.");
+            if (session.user)
+                signOut(session); // the arena is emptied, not grown, on every log in
+            session.signIn(username);
+            session.user->setEmail(cred->email);
+            guard.unlock();
+            clearCart(session);
+        });
+    }
+
+    // Frees everything the session allocated
+    // An unrecorded payment's key is dropped too: it must not pay for
+    // another shopper's cart
+    void signOut(ShopSession& session) {
+        session.user.reset();
+        session.unrecordedPayment = {};
+        session.cart = Cart(&session.arena);
+        session.arena.release();
+        session.arenaBlocks.release();
+    }
+
+    // Stock is checked here but only taken at checkout
+    void addToCart(ShopSession& session, int productId, int quantity) {
+        timedOperation(ShopOp::AddToCart, [&] {
+            requireUser(session);
+            syncCart(session);
+            int available = inventory.available(productId);
+            if (session.cart.findSlot(productId) >= 0 && (int64_t)session.cart.quantityOf(productId) + quantity > available)
+                throw runtime_error("Only " + to_string(available) + " left in stock.");
+            session.cart.addProduct(productId, quantity);
+        });
+    }
+
+    void removeFromCart(ShopSession& session, int productId) {
+        timedOperation(ShopOp::RemoveFromCart, [&] {
+            requireUser(session);
+            syncCart(session);
+            session.cart.removeProduct(productId);
+        });
+    }
+
+    void updateQuantity(ShopSession& session, int productId, int quantity) {
+        timedOperation(ShopOp::UpdateQuantity, [&] {
+            requireUser(session);
+            syncCart(session);
+            int available = inventory.available(productId);
+            if (session.cart.quantityOf(productId) > 0 && quantity > available)
+                throw runtime_error("Only " + to_string(available) + " left in stock.");
+            session.cart.updateQuantity(productId, quantity);
+        });
+    }
+
+    // Adds the "id,qty" lines of text to the cart in one step. All lines
+    // are checked against the catalog and the stock first (a product on
+    // several lines is checked for their sum); lines that fail are
+    // reported and left out, and the rest are added together.
+    CartImportResult importCart(ShopSession& session, string_view text) {
+        CartImportResult result;
+        timedOperation(ShopOp::ImportCart, [&] {
+            requireUser(session);
+            syncCart(session);
+            thread_local vector<CartImportRecord> records;
+            records.clear();
+            parseCartImport(text, records, result.errors);
+            result.records = records.size() + result.errors.size();
+
+            // One entry per product, found through an open-addressing
+            // table of indexes into adds, kept at most half full. The
+            // catalog, stock and cart are looked at once per product.
+            vector<pair<int, int>> adds;
+            vector<int> stock, inCart;
+            vector<int32_t> table(64, -1);
+            auto entryFor = [&](int productId) -> int32_t {
+                uint64_t mask = table.size() - 1;
+                int shift = 32 - __builtin_ctzll(table.size());
+                uint64_t pos = CatalogSnapshot::hashId(productId) >> shift;
+                for (; table[pos] >= 0; pos = (pos + 1) & mask)
+                    if (adds[table[pos]].first == productId)
+                        return table[pos];
+                if (session.cart.findSlot(productId) < 0)
+                    return -1;
+                table[pos] = (int32_t)adds.size();
+                adds.push_back({productId, 0});
+                stock.push_back(inventory.available(productId));
+                inCart.push_back(session.cart.quantityOf(productId));
+                if (adds.size() * 2 > table.size()) {
+                    table.assign(table.size() * 2, -1);
+                    mask = table.size() - 1;
+                    shift = 32 - __builtin_ctzll(table.size());
+                    for (size_t entry = 0; entry < adds.size(); ++entry) {
+                        uint64_t slot = CatalogSnapshot::hashId(adds[entry].first) >> shift;
+                        while (table[slot] >= 0)
+                            slot = (slot + 1) & mask;
+                        table[slot] = (int32_t)entry;
+                    }
+                }
+                return (int32_t)adds.size() - 1;
+            };
+
+            for (const CartImportRecord& record : records) {
+                if (record.quantity <= 0) {
+                    result.errors.push_back({record.line, "Quantity must be greater than 0."});
+                    continue;
+                }
+                int32_t entry = entryFor(record.productId);
+                if (entry < 0) {
+                    result.errors.push_back({record.line, "Product not found."});
+                    continue;
+                }
+                if ((int64_t)inCart[entry] + adds[entry].second + record.quantity > stock[entry]) {
+                    result.errors.push_back({record.line, "Only " + to_string(stock[entry]) + " left in stock."});
+                    continue;
+                }
+                adds[entry].second += record.quantity;
+                ++result.added;
+            }
+            adds.erase(remove_if(adds.begin(), adds.end(), [](const pair<int, int>& add) { return add.second == 0; }),
+                       adds.end());
+            sort(adds.begin(), adds.end());
+            session.cart.addProducts(adds);
+            // Parse errors come first; there is at most one error per line
+            sort(result.errors.begin(), result.errors.end(),
+                 [](const CartImportError& a, const CartImportError& b) { return a.line < b.line; });
+        });
+        return result;
+    }
+
+    void clearCart(ShopSession& session) {
+        session.cart = Cart(&session.arena);
+        session.cart.setCatalog(getCatalog());
+    }
+
+    // Renders the cart, repriced against the newest catalog first
+    void showCart(ShopSession& session, ostream& out) {
+        timedOperation(ShopOp::ViewCart, [&] {
+            syncCart(session);
+            session.cart.showCart(out);
+        });
+    }
+
+    void setShippingAddress(ShopSession& session, const string& city, const string& province) {
+        if (city.empty() || province.empty())
+            throw runtime_error("City and province cannot be empty.");
+        requireUser(session).setAddress(city, province);
+    }
+
+    void clearShippingAddress(ShopSession& session) {
+        requireUser(session).setAddress("");
+    }
+
+    // Pays for the cart and writes the payment confirmation and receipt to
+    // out. The cart is emptied afterwards. With a payment dispatcher this
+    // waits for the gateway; use beginCheckout/finishCheckout to overlap.
+    void checkout(ShopSession& session, PaymentMethod method, ostream& out) {
+        timedOperation(ShopOp::Checkout, [&] {
+            if (payments) {
+                PendingCheckout pending = beginCheckout(session, method);
+                finishCheckout(session, pending, out);
+                return;
+            }
+            reserveCart(session);
+            const CartLines& lines = session.cart.getItems();
+            thread_local RenderBuffer buffer;
+            buffer.clear();
+            try {
+                Order order(session.cart);
+                order.checkout(&paymentStrategyFor(method), buffer);
+            } catch (...) {
+                inventory.release(lines);
+                throw;
+            }
+            try {
+                recordOrder(*session.user, session.cart, method);
+            } catch (const exception& error) {
+                inventory.release(lines);
+                throw runtime_error(string("Payment taken, order not recorded (") + error.what() +
+                                    "). Your cart was kept.");
+            }
+            completeOrder(*session.user, session.cart, method, buffer, out);
+            clearCart(session);
+        });
+    }
+
+    // The unpaid lines of a checkout only go back to the shopper who began it
+    static bool sameShopper(const ShopSession& session, const PendingCheckout& pending) {
+        return session.user && session.user->getUsername() == pending.user.getUsername();
+    }
+
+    // Puts the lines of a cart that was not paid for back into the session's
+    // cart, on top of anything added since the checkout began. Products no
+    // longer sold are left out.
+    void restoreCart(ShopSession& session, Cart& unpaid) {
+        if (session.cart.isEmpty()) {
+            session.cart = move(unpaid);
+            return;
+        }
+        syncCart(session);
+        for (const auto& line : unpaid.getItems())
+            if (session.cart.findSlot(line.first) >= 0)
+                session.cart.addProduct(line.first, line.second);
+    }
+
+    // Reserves the stock and sends the payment without waiting for it.
+    // The session gets an empty cart; if the payment does not go through,
+    // finishCheckout adds the unpaid lines back to the session's cart.
+    // whenPaid, if given, is called on a gateway thread once finishCheckout
+    // would not wait.
+    PendingCheckout beginCheckout(ShopSession& session, PaymentMethod method, function<void()> whenPaid = nullptr) {
+        if (!payments)
+            throw runtime_error("No payment gateway configured.");
+        paymentMethodName(method); // rejects unknown methods before taking stock
+        reserveCart(session);
+        // Copies take their memory from the default resource, not the arena
+        PendingCheckout pending{method, *session.user, session.cart, {}, {}};
+        try {
+            pending.amount = pending.cart.calculateTotal();
+            const ShopSession::UnrecordedPayment& taken = session.unrecordedPayment;
+            uint64_t key = taken.pending && taken.amount == pending.amount ? taken.idempotencyKey : payments->newKey();
+            pending.payment = payments->submit(method, pending.amount, key, move(whenPaid));
+        } catch (...) {
+            inventory.release(pending.cart.getItems());
+            throw;
+        }
+        clearCart(session);
+        return pending;
+    }
+
+    // Waits for the payment of a pending checkout, then writes the payment
+    // confirmation and receipt to out like checkout(). If the order cannot
+    // be recorded after the payment went through, the cart is put back and
+    // the payment's key is kept for the next checkout of the same total.
+    void finishCheckout(ShopSession& session, PendingCheckout& pending, ostream& out) {
+        PaymentResult result = pending.payment.get();
+        if (result.status != PaymentStatus::Approved) {
+            inventory.release(pending.cart.getItems());
+            if (sameShopper(session, pending))
+                restoreCart(session, pending.cart);
+            if (result.status == PaymentStatus::TimedOut)
+                throw runtime_error("Payment timed out. Your cart was kept; please try again.");
+            throw runtime_error("Payment failed after " + to_string(result.attempts) +
+                                " attempts. Your cart was kept; please try again.");
+        }
+        thread_local RenderBuffer buffer;
+        buffer.clear();
+        try {
+            Order order(pending.cart);
+            order.checkout(&paymentStrategyFor(pending.method), buffer);
+            recordOrder(pending.user, pending.cart, pending.method);
+        } catch (const exception& error) {
+            inventory.release(pending.cart.getItems());
+            if (sameShopper(session, pending)) {
+                session.unrecordedPayment = {true, result.idempotencyKey, pending.amount};
+                restoreCart(session, pending.cart);
+            }
+            throw runtime_error(string("Payment taken, order not recorded (") + error.what() +
+                                "). Your cart was kept; checking out again will not charge you twice.");
+        }
+        if (session.unrecordedPayment.pending && session.unrecordedPayment.idempotencyKey == result.idempotencyKey)
+            session.unrecordedPayment = {};
+        completeOrder(pending.user, pending.cart, pending.method, buffer, out);
+    }
+};
+
+// ----------------------------- Interactive Prompts -----------------------------
+void signUp(ShopEngine& engine) {
+    cout << "\n--- Sign Up ---" << endl;
+
+    // Username input and validation
+    string username;
+    while (true) {
+        username = readNonEmptyLine("Enter a username (min. 3 characters): ");
+        if (!isValidCredential(username)) {
+            cout << "Username must be at least 3 characters long." << endl;
+            continue;
+        }
+        // Check if username exists
+        if (engine.usernameTaken(username)) {
+            cout << "Username already exists. Please try logging in." << endl;
+            continue;
+        }
+        break;
+    }
+
+    // Password input and validation
+    string password;
+    while (true) {
+        password = readNonEmptyLine("Enter a password (min. 3 characters): ");
+        if (!isValidCredential(password)) {
+            cout << "Password must be at least 3 characters long." << endl;
+            continue;
+        }
+        break;
+    }
+
+    // Email input and validation
+    string email;
+    while (true) {
+        email = readNonEmptyLine("Enter your email address: ");
+        if (isValidEmail(email))
+            break;
+        cout << "Invalid email format. Please try again." << endl;
+    }
+
+    engine.signUp(username, password, email);
+    cout << "Sign-up successful!" << endl;
+}
+
+void logIn(ShopEngine& engine, ShopSession& session) {
+    cout << "\n--- Log In ---" << endl;
+    string username = readNonEmptyLine("Enter your username: ");
+    string password = readNonEmptyLine("Enter your password: ");
+    engine.logIn(session, username, password);
+    cout << "Log in successful!" << endl;
+}
+
+void renderProductLine(RenderBuffer& out, const CatalogSnapshot& catalog, int slot) {
+    out << "ID: " << catalog.idAt(slot)
+        << " | Name: " << catalog.nameAt(slot)
+        << " | Price: Php " << catalog.priceAt(slot) << '\n';
+}
+
+void displayCatalog(const CatalogSnapshot& catalog) {
+    RenderBuffer out;
+    out << "\n--- Product Catalog ---\n";
+    for (int slot = 0; slot < (int)catalog.size(); ++slot)
+        renderProductLine(out, catalog, slot);
+    out.writeTo(cout);
+}
+
+// "Gaming, Peripherals" -> {"Gaming", "Peripherals"}
+vector<string> splitCategories(const string& text) {
+    vector<string> names;
+    stringstream parts(text);
+    string name;
+    while (getline(parts, name, ','))
+        if (!normalizeCategory(name).empty())
+            names.push_back(normalizeCategory(name));
+    return names;
+}
+
+void renderCategories(RenderBuffer& out, const CatalogSnapshot& catalog) {
+    out << "\n--- Categories ---\n";
+    for (int category = 0; category < (int)catalog.categoryCount(); ++category)
+        out << catalog.categoryName(category) << " (" << catalog.categorySlots(category).size() << ")\n";
+}
+
+// Products in every one of the named categories
+void renderCategoryListing(RenderBuffer& out, const CatalogSnapshot& catalog, const vector<string>& names) {
+    vector<uint32_t> slots = catalog.slotsInCategories(names);
+    out << "\n--- ";
+    for (size_t i = 0; i < names.size(); ++i)
+        out << (i ? " + " : "") << names[i];
+    out << " ---\n";
+    for (uint32_t slot : slots)
+        renderProductLine(out, catalog, (int)slot);
+    out << slots.size() << " product(s)\n";
+}
+
+// Product ids need not be 1..size (catalog files can use any ids), so any
+// positive id is read and looked up in the newest catalog
+int readProductId(const ShopEngine& engine, const string& prompt) {
+    while (true) {
+        int productId = readInt(prompt, 1, numeric_limits<int>::max());
+        if (engine.getCatalog()->findSlot(productId) >= 0)
+            return productId;
+        cout << "No product with ID " << productId << ". Please try again." << endl;
+    }
+}
+
+void promptAddToCart(ShopEngine& engine, ShopSession& session) {
+    string addChoice;
+    while (true) {
+        cout << "\nWould you like to add an item to your cart? (y/n): ";
+        getline(cin, addChoice);
+        if (addChoice == "y" || addChoice == "Y") {
+            int prodId = readProductId(engine, "Enter Product ID to add: ");
+            int qty = readInt("Enter quantity: ", 1, 100);
+
+            try {
+                engine.addToCart(session, prodId, qty);
+                const CatalogSnapshot& catalog = session.cart.getCatalog();
+                cout << "Added " << qty << " of " << catalog.nameAt(catalog.findSlot(prodId)) << " to cart." << endl;
+            } catch (const exception& e) {
+                cout << e.what() << endl;
+            }
+
+        } else if (addChoice == "n" || addChoice == "N") {
+            break;
+        } else {
+            cout << "Invalid input. Please enter 'y' or 'n'.\n";
+        }
+    }
+}
+
+// Best name matches for query
+void renderSearchResults(RenderBuffer& out, const ShopEngine& engine, const string& query) {
+    CatalogRef catalog;
+    vector<SearchHit> hits = engine.searchProducts(query, catalog);
+    out << "\n--- Search: " << query << " ---\n";
+    for (const SearchHit& hit : hits)
+        renderProductLine(out, *catalog, hit.slot);
+    out << hits.size() << " product(s)\n";
+}
+
+void searchProducts(ShopEngine& engine, ShopSession& session) {
+    RenderBuffer out;
+    try {
+        renderSearchResults(out, engine, readNonEmptyLine("Enter a product name to search for: "));
+    } catch (const exception& e) {
+        cout << e.what() << endl;
+        return;
+    }
+    out.writeTo(cout);
+    promptAddToCart(engine, session);
+}
+
+void browseByCategory(ShopEngine& engine, ShopSession& session) {
+    CatalogRef catalog = engine.getCatalog();
+    RenderBuffer out;
+    renderCategories(out, *catalog);
+    out.writeTo(cout);
+    vector<string> names = splitCategories(readNonEmptyLine("Enter categories separated by commas (e.g. Gaming, Peripherals): "));
+    try {
+        out.clear();
+        renderCategoryListing(out, *catalog, names);
+        out.writeTo(cout);
+    } catch (const exception& e) {
+        cout << e.what() << endl;
+        return;
+    }
+    promptAddToCart(engine, session);
+}
+
+// Adds many lines at once from a file or from pasted "id,qty" lines
+void importCart(ShopEngine& engine, ShopSession& session) {
+    cout << "\n--- Import Cart ---" << endl;
+    string source = readNonEmptyLine("Enter a file of id,qty lines, or - to paste them: ");
+    string text;
+    try {
+        if (source == "-") {
+            cout << "Paste the lines, then enter a blank line:" << endl;
+            string line;
+            while (getline(cin, line) && !line.empty())
+                text.append(line).push_back('\n');
+        } else {
+            text = readImportFile(source);
+        }
+        RenderBuffer out;
+        renderCartImport(out, engine.importCart(session, text));
+        out.writeTo(cout);
+    } catch (const exception& e) {
+        cout << e.what() << endl;
+    }
+}
+
+void promptAndSetShippingAddress(ShopEngine& engine, ShopSession& session) {
+    string city = readNonEmptyLine("Enter your shipping city: ");
+    string province = readNonEmptyLine("Enter your shipping province: ");
+    engine.setShippingAddress(session, city, province);
+    cout << "Shipping to: " << session.user->getAddress() << endl;
+}
+
+void mainMenu(){
+    cout<<"-------------------------------------------\n";
+    cout<<"1. Display Products.\n";
+    cout<<"2. Add/Update Shipping Information.\n";
+    cout<<"3. View Cart. \n";
+    cout<<"4. Browse by Category.\n";
+    cout<<"5. Search Products.\n";
+    cout<<"6. Import Cart (id,qty lines).\n";
+    cout<<"7. Sign Out/Exit \n";
+    cout<<"-------------------------------------------\n";
+}
+
+// readInt for the main menu. Also takes the unlisted commands "stats" and
+// "stats json", which print the operation stats and ask again.
+int readMenuChoice(const string& prompt, int minValue, int maxValue) {
+    while (true) {
+        cout << prompt;
+        if ((cin >> ws).peek() == 's') {
+            string command;
+            getline(cin, command);
+            if (command == "stats" || command == "stats json")
+                writeOperationStats(cout, command == "stats json" ? StatsFormat::Json : StatsFormat::Text);
+            else
+                cout << "Invalid input. Please enter a number between " << minValue << " and " << maxValue << "." << endl;
+            continue;
+        }
+        int choice;
+        if (cin >> choice && choice >= minValue && choice <= maxValue) {
+            cin.ignore(numeric_limits<streamsize>::max(), '\n');
+            return choice;
+        }
+        cout << "Invalid input. Please enter a number between " << minValue << " and " << maxValue << "." << endl;
+        cin.clear();
+        cin.ignore(numeric_limits<streamsize>::max(), '\n');
+    }
+}
+
+// ----------------------------- Scripted Session Replay -----------------------------
+// Replays one shop operation per line against a ShopEngine, e.g.
+//   signup alice secret alice@mail.com
+//   login alice secret
+//   add 1 2 | remove 1 | update 1 5 | cart
+//   ship Makati City, Metro Manila | unship
+//   checkout credit|gcash|cod
+//   logout
+// Blank lines and lines starting with '#' are skipped. Output is collected
+// in memory and written in large blocks.
+class ReplayOutput {
+private:
+    ostringstream buffer;
+    FILE* file;
+
+public:
+    explicit ReplayOutput(FILE* f) : file(f) {}
+    ~ReplayOutput() { flush(); }
+
+    ostream& stream() {
+        if (buffer.tellp() > (1 << 20))
+            flush();
+        return buffer;
+    }
+
+    void flush() {
+        string text = buffer.str();
+        fwrite(text.data(), 1, text.size(), file);
+        fflush(file);
+        buffer.str("");
+    }
+};
+
+PaymentMethod parsePaymentMethod(const string& name) {
+    if (name == "credit" || name == "1")
+        return PaymentMethod::CreditCard;
+    if (name == "gcash" || name == "2")
+        return PaymentMethod::Gcash;
+    if (name == "cod" || name == "3")
+        return PaymentMethod::CashOnDelivery;
+    throw runtime_error("Invalid payment option.");
+}
+
+// Who is running a script line. Operators (--replay) get every command;
+// shoppers (server clients) only get the ones that act on their own session
+// or read the catalog. reload, stock, the imports, analytics and stats read
+// server files, block on stdin or change shared state, so they stay out.
+enum class CommandScope { Shopper, Operator };
+
+bool isShopperCommand(const string& command) {
+    static const char* const shopperCommands[] = {"signup",     "login",    "logout", "add",    "update",
+                                                  "remove",     "cart",     "ship",   "unship", "orders",
+                                                  "categories", "category", "search", "checkout"};
+    for (const char* name : shopperCommands)
+        if (command == name)
+            return true;
+    return false;
+}
+
+// Runs one script line. Returns false for blank and comment lines.
+bool runScriptCommand(ShopEngine& engine, ShopSession& session, const string& line, ostream& out,
+                      CommandScope scope = CommandScope::Operator) {
+    istringstream words(line);
+    string command;
+    if (!(words >> command) || command[0] == '#')
+        return false;
+    if (scope == CommandScope::Shopper && !isShopperCommand(command))
+        throw runtime_error("Unknown command: " + command);
+
+    if (command == "signup") {
+        string username, password, email;
+        words >> username >> password >> email;
+        engine.signUp(username, password, email);
+        out << "Sign-up successful!\n";
+    } else if (command == "login") {
+        string username, password;
+        words >> username >> password;
+        engine.logIn(session, username, password);
+        out << "Log in successful!\n";
+    } else if (command == "logout") {
+        engine.signOut(session);
+        out << "Signing out...\n";
+    } else if (command == "add" || command == "update") {
+        int productId = 0, quantity = 0;
+        if (!(words >> productId >> quantity))
+            throw runtime_error("Expected: " + command + " <productId> <quantity>");
+        if (command == "add") {
+            engine.addToCart(session, productId, quantity);
+            const CatalogSnapshot& catalog = session.cart.getCatalog();
+            out << "Added " << quantity << " of " << catalog.nameAt(catalog.findSlot(productId)) << " to cart.\n";
+        } else {
+            engine.updateQuantity(session, productId, quantity);
+            out << "Quantity updated.\n";
+        }
+    } else if (command == "remove") {
+        int productId = 0;
+        if (!(words >> productId))
+            throw runtime_error("Expected: remove <productId>");
+        engine.removeFromCart(session, productId);
+        out << "Removed product ID " << productId << " from cart.\n";
+    } else if (command == "cart") {
+        engine.showCart(session, out);
+    } else if (command == "ship") {
+        string rest;
+        getline(words, rest);
+        size_t comma = rest.find(',');
+        if (comma == string::npos)
+            throw runtime_error("Expected: ship <city>, <province>");
+        auto trim = [](string text) {
+            text.erase(0, text.find_first_not_of(' '));
+            text.erase(text.find_last_not_of(' ') + 1);
+            return text;
+        };
+        engine.setShippingAddress(session, trim(rest.substr(0, comma)), trim(rest.substr(comma + 1)));
+        out << "Shipping to: " << session.user->getAddress() << "\n";
+    } else if (command == "unship") {
+        engine.clearShippingAddress(session);
+        out << "Shipping information removed.\n";
+    } else if (command == "orders") {
+        if (!session.user)
+            throw runtime_error("Please log in first.");
+        vector<OrderRecord> orders = engine.getHistory().ordersFor(session.user->getUsername());
+        out << "\n--- Orders ---\n";
+        for (const auto& order : orders)
+            out << "Order #" << order.orderId << " | " << order.lines.size() << " item(s) | "
+                << paymentMethodName(order.method) << " | Php " << Money::fromCentavos(order.totalCentavos) << "\n";
+        out << orders.size() << " order(s)\n";
+    } else if (command == "categories") {
+        RenderBuffer listing;
+        renderCategories(listing, *engine.getCatalog());
+        listing.writeTo(out);
+    } else if (command == "category") {
+        string rest;
+        getline(words, rest);
+        vector<string> names = splitCategories(rest);
+        if (names.empty())
+            throw runtime_error("Usage: category <name>[, <name>...]");
+        RenderBuffer listing;
+        renderCategoryListing(listing, *engine.getCatalog(), names);
+        listing.writeTo(out);
+    } else if (command == "search") {
+        string query;
+        getline(words, query);
+        if (query.find_first_not_of(' ') == string::npos)
+            throw runtime_error("Usage: search <name>");
+        RenderBuffer listing;
+        renderSearchResults(listing, engine, query.substr(query.find_first_not_of(' ')));
+        listing.writeTo(out);
+    } else if (command == "stock") {
+        int productId = 0, units = 0;
+        if (!(words >> productId >> units))
+            throw runtime_error("Expected: stock <productId> <units>");
+        engine.getInventory().setStock(productId, units);
+        out << "Stock of product ID " << productId << " set to " << units << ".\n";
+    } else if (command == "reload") {
+        string path;
+        if (!(words >> path))
+            throw runtime_error("Expected: reload <catalog file>");
+        CatalogRef next = loadCatalog(path);
+        engine.publishCatalog(next);
+        out << "Published " << next->size() << " products (catalog version " << next->getVersion() << ").\n";
+    } else if (command == "import") {
+        string path;
+        if (!(words >> path))
+            throw runtime_error("Expected: import <file of id,qty lines> (- for stdin)");
+        RenderBuffer report;
+        renderCartImport(report, engine.importCart(session, readImportFile(path)));
+        report.writeTo(out);
+    } else if (command == "import-users") {
+        string path;
+        words >> path;
+        RenderBuffer report;
+        renderUserImport(report, engine.importUsers(readImportFile(path), (int)max(1u, thread::hardware_concurrency())));
+        report.writeTo(out);
+    } else if (command == "analytics") {
+        string dimension;
+        size_t top = 10;
+        words >> dimension;
+        if (!(words >> top))
+            top = 10;
+        RenderBuffer report;
+        renderOrderAnalytics(report, engine.getHistory(), *engine.getCatalog(), parseOrderDimension(dimension), top,
+                             (int)max(1u, thread::hardware_concurrency()));
+        report.writeTo(out);
+    } else if (command == "stats") {
+        string format;
+        words >> format;
+        writeOperationStats(out, format == "json" ? StatsFormat::Json : StatsFormat::Text);
+    } else if (command == "checkout") {
+        string method;
+        words >> method;
+        engine.checkout(session, parsePaymentMethod(method), out);
+    } else {
+        throw runtime_error("Unknown command: " + command);
+    }
+    return true;
+}
+
+int replayScript(ShopEngine& engine, istream& script) {
+    ShopSession session;
+    ReplayOutput output(stdout);
+    string line;
+    size_t lineNumber = 0, operations = 0, failures = 0;
+
+    auto start = chrono::steady_clock::now();
+    while (getline(script, line)) {
+        ++lineNumber;
+        ostream& out = output.stream();
+        try {
+            if (runScriptCommand(engine, session, line, out))
+                ++operations;
+        } catch (const exception& e) {
+            ++operations;
+            ++failures;
+            out << "line " << lineNumber << ": " << e.what() << "\n";
+        }
+    }
+    output.flush();
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    cerr << operations << " operations (" << failures << " failed) in " << seconds << " s, "
+         << (seconds > 0 ? operations / seconds : 0) << " ops/s" << endl;
+    return failures == 0 ? 0 : 1;
+}
+
+// ----------------------------- Worker Pool -----------------------------
+// A fixed set of threads running queued tasks in FIFO order.
+class WorkerPool {
+private:
+    vector<thread> workers;
+    queue<function<void()>> tasks;
+    mutex lock;
+    condition_variable ready;
+    bool stopping = false;
+
+public:
+    explicit WorkerPool(int threadCount) {
+        for (int i = 0; i < threadCount; ++i) {
+            workers.emplace_back([this] {
+                while (true) {
+                    function<void()> task;
+                    {
+                        unique_lock<mutex> guard(lock);
+                        ready.wait(guard, [this] { return stopping || !tasks.empty(); });
+                        if (tasks.empty())
+                            return;
+                        task = move(tasks.front());
+                        tasks.pop();
+                    }
+                    task();
+                }
+            });
+        }
+    }
+
+    ~WorkerPool() {
+        {
+            lock_guard<mutex> guard(lock);
+            stopping = true;
+        }
+        ready.notify_all();
+        for (auto& worker : workers)
+            worker.join();
+    }
+
+    void submit(function<void()> task) {
+        {
+            lock_guard<mutex> guard(lock);
+            tasks.push(move(task));
+        }
+        ready.notify_one();
+    }
+};
+
+// ----------------------------- Session Table -----------------------------
+// Per-connection shop sessions, split into shards so opening and closing
+// sessions on different threads rarely contend on the same lock.
+class SessionTable {
+private:
+    struct Shard {
+        mutex lock;
+        unordered_map<uint64_t, unique_ptr<ShopSession>> sessions;
+    };
+    array<Shard, 16> shards;
+
+    Shard& shardFor(uint64_t id) { return shards[id % shards.size()]; }
+
+public:
+    ShopSession& open(uint64_t id) {
+        Shard& shard = shardFor(id);
+        lock_guard<mutex> guard(shard.lock);
+        auto& session = shard.sessions[id];
+        if (!session)
+            session.reset(new ShopSession());
+        return *session;
+    }
+
+    void close(uint64_t id) {
+        Shard& shard = shardFor(id);
+        lock_guard<mutex> guard(shard.lock);
+        shard.sessions.erase(id);
+    }
+
+    size_t size() {
+        size_t total = 0;
+        for (auto& shard : shards) {
+            lock_guard<mutex> guard(shard.lock);
+            total += shard.sessions.size();
+        }
+        return total;
+    }
+};
+
+#ifdef SHOP_POSIX
+// ----------------------------- Shop Server -----------------------------
+// Serves shop sessions over loopback TCP. Each connection is one session
+// and speaks the replay script commands, one per line. Every reply is
+//   OK <length>\n<output>   or   ERR <length>\n<message>\n
+// One thread polls the sockets; complete lines are handed to the worker
+// pool, and at most one worker runs a given connection at a time.
+// Clients only get the shopper commands. A line longer than maxLineBytes
+// drops the connection, and a client that stops reading its replies for
+// sendTimeoutSeconds is dropped instead of holding a worker. A client with
+// maxInboxBytes of commands waiting is not read from until they are run.
+// With a payment gateway, a checkout gives its worker back while the
+// payment is out; the connection's later lines wait for its reply.
+bool sendAll(int fd, const string& data) {
+    size_t sent = 0;
+    while (sent < data.size()) {
+        ssize_t n = send(fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false; // includes EAGAIN once SO_SNDTIMEO runs out
+        sent += n;
+    }
+    return true;
+}
+
+class ShopServer {
+private:
+    static constexpr size_t maxLineBytes = 4096;
+    static constexpr size_t maxInboxBytes = 64 * 1024;
+    static constexpr int sendTimeoutSeconds = 5;
+
+    struct Connection {
+        uint64_t id;
+        int fd;
+        mutex lock;
+        string inbox;
+        bool scheduled = false; // a worker or a pending checkout owns this connection
+        bool closed = false;
+        bool paused = false; // the poller stopped reading: the inbox is full
+        unique_ptr<PendingCheckout> checkout; // set while its payment is out
+        bool paid = false; // the payment came back before checkout was set
+
+        Connection(uint64_t cid, int cfd) : id(cid), fd(cfd) {}
+        ~Connection() { ::close(fd); }
+    };
+
+    ShopEngine& engine;
+    SessionTable sessions;
+    WorkerPool pool;
+    int listenFd = -1;
+    int wakeFds[2] = {-1, -1}; // a byte in the pipe makes the poller look again
+    atomic<bool> running{false};
+    thread poller;
+    mutex checkoutLock;
+    condition_variable checkoutsDone;
+    int checkoutsOut = 0; // payments whose callback has not finished yet
+
+    static void addReply(string& replies, bool ok, const string& body) {
+        replies += (ok ? "OK " : "ERR ") + to_string(body.size()) + "\n" + body;
+    }
+
+    void wakePoller() {
+        char byte = 0;
+        ssize_t ignored = write(wakeFds[1], &byte, 1); // a full pipe already wakes it
+        (void)ignored;
+    }
+
+    // Sends the replies so far; a client that cannot take them is dropped
+    void flushReplies(Connection& conn, string& replies) {
+        if (!replies.empty() && !sendAll(conn.fd, replies)) {
+            lock_guard<mutex> guard(conn.lock);
+            conn.closed = true;
+            shutdown(conn.fd, SHUT_RDWR); // the poller sees EOF and forgets the socket
+        }
+        replies.clear();
+    }
+
+    // Starts a gateway checkout. Returns false if it failed at once (its
+    // reply is in replies); otherwise the connection waits for the payment
+    // and the rest of lines goes back to the front of the inbox. Whichever
+    // comes second, the payment or storing the checkout, queues the finish.
+    bool beginCheckout(shared_ptr<Connection> conn, ShopSession& session, PaymentMethod method, string& replies,
+                       const string& rest) {
+        {
+            lock_guard<mutex> guard(checkoutLock);
+            ++checkoutsOut;
+        }
+        unique_ptr<PendingCheckout> pending;
+        try {
+            pending.reset(new PendingCheckout(engine.beginCheckout(session, method, [this, conn] {
+                bool stored;
+                {
+                    lock_guard<mutex> guard(conn->lock);
+                    stored = conn->checkout != nullptr;
+                    conn->paid = !stored;
+                }
+                if (stored)
+                    pool.submit([this, conn] { finishCheckout(conn); });
+            })));
+        } catch (const exception& e) {
+            addReply(replies, false, string(e.what()) + "\n");
+            endCheckout();
+            return false;
+        }
+        bool paid;
+        {
+            lock_guard<mutex> guard(conn->lock);
+            conn->inbox.insert(0, rest);
+            conn->checkout = move(pending);
+            paid = conn->paid;
+            conn->paid = false;
+        }
+        if (paid)
+            pool.submit([this, conn] { finishCheckout(conn); });
+        return true;
+    }
+
+    void endCheckout() {
+        lock_guard<mutex> guard(checkoutLock);
+        if (--checkoutsOut == 0)
+            checkoutsDone.notify_all();
+    }
+
+    void finishCheckout(shared_ptr<Connection> conn) {
+        unique_ptr<PendingCheckout> pending;
+        {
+            lock_guard<mutex> guard(conn->lock);
+            pending = move(conn->checkout);
+        }
+        string replies;
+        ostringstream out;
+        try {
+            engine.finishCheckout(sessions.open(conn->id), *pending, out);
+            addReply(replies, true, out.str());
+        } catch (const exception& e) {
+            addReply(replies, false, string(e.what()) + "\n");
+        }
+        pending.reset();
+        flushReplies(*conn, replies);
+        serve(conn);
+        endCheckout();
+    }
+
+    void serve(shared_ptr<Connection> conn) {
+        ShopSession& session = sessions.open(conn->id);
+        while (true) {
+            string lines;
+            bool wake = false;
+            {
+                lock_guard<mutex> guard(conn->lock);
+                size_t end = conn->inbox.rfind('\n');
+                if (end == string::npos || conn->closed) {
+                    conn->scheduled = false;
+                    if (conn->closed)
+                        sessions.close(conn->id);
+                    if (conn->paused && !conn->closed) {
+                        conn->paused = false;
+                        wake = true;
+                    }
+                } else {
+                    lines = conn->inbox.substr(0, end + 1);
+                    conn->inbox.erase(0, end + 1);
+                }
+            }
+            if (wake)
+                wakePoller();
+            if (lines.empty())
+                return;
+
+            string replies;
+            size_t start = 0;
+            while (start < lines.size()) {
+                size_t end = lines.find('\n', start);
+                string line = lines.substr(start, end - start);
+                start = end + 1;
+                if (!line.empty() && line.back() == '\r')
+                    line.pop_back();
+                istringstream words(line);
+                string command, method;
+                if (engine.paysThroughGateway() && words >> command && command == "checkout") {
+                    words >> method;
+                    PaymentMethod paymentMethod;
+                    try {
+                        paymentMethod = parsePaymentMethod(method);
+                    } catch (const exception& e) {
+                        addReply(replies, false, string(e.what()) + "\n");
+                        continue;
+                    }
+                    flushReplies(*conn, replies);
+                    if (beginCheckout(conn, session, paymentMethod, replies, lines.substr(start)))
+                        return; // finishCheckout serves the rest
+                    continue;
+                }
+                ostringstream out;
+                try {
+                    runScriptCommand(engine, session, line, out, CommandScope::Shopper);
+                    addReply(replies, true, out.str());
+                } catch (const exception& e) {
+                    addReply(replies, false, string(e.what()) + "\n");
+                }
+            }
+            flushReplies(*conn, replies);
+        }
+    }
+
+    void pollLoop() {
+        unordered_map<int, shared_ptr<Connection>> connections;
+        uint64_t nextId = 1;
+        vector<pollfd> fds;
+        char buffer[16384];
+
+        while (running) {
+            fds.assign(1, pollfd{listenFd, POLLIN, 0});
+            fds.push_back(pollfd{wakeFds[0], POLLIN, 0});
+            for (auto& entry : connections) {
+                lock_guard<mutex> guard(entry.second->lock);
+                if (entry.second->inbox.size() >= maxInboxBytes)
+                    entry.second->paused = true; // its worker wakes us once it has taken lines
+                else
+                    fds.push_back(pollfd{entry.first, POLLIN, 0});
+            }
+            if (poll(fds.data(), fds.size(), 100) <= 0)
+                continue;
+
+            if (fds[1].revents & POLLIN)
+                while (read(wakeFds[0], buffer, sizeof(buffer)) > 0) {
+                }
+
+            if (fds[0].revents & POLLIN) {
+                int fd = accept(listenFd, nullptr, nullptr);
+                if (fd >= 0) {
+                    int one = 1;
+                    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+                    timeval timeout{sendTimeoutSeconds, 0};
+                    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+                    connections[fd] = make_shared<Connection>(nextId++, fd);
+                }
+            }
+
+            for (size_t i = 2; i < fds.size(); ++i) {
+                if (!fds[i].revents)
+                    continue;
+                shared_ptr<Connection> conn = connections[fds[i].fd];
+                ssize_t n = recv(conn->fd, buffer, sizeof(buffer), 0);
+                if (n < 0 && errno == EINTR)
+                    continue;
+                bool schedule = false, drop = n <= 0;
+                {
+                    lock_guard<mutex> guard(conn->lock);
+                    if (n > 0) {
+                        conn->inbox.append(buffer, n);
+                        size_t lineStart = conn->inbox.rfind('\n');
+                        lineStart = lineStart == string::npos ? 0 : lineStart + 1;
+                        drop = conn->inbox.size() - lineStart > maxLineBytes;
+                    }
+                    if (drop)
+                        conn->closed = true;
+                    if (!conn->scheduled && (conn->closed || conn->inbox.find('\n') != string::npos)) {
+                        conn->scheduled = true;
+                        schedule = true;
+                    }
+                }
+                if (schedule)
+                    pool.submit([this, conn] { serve(conn); });
+                if (drop)
+                    connections.erase(fds[i].fd); // workers keep their own reference
+            }
+        }
+    }
+
+public:
+    ShopServer(ShopEngine& shopEngine, int workerCount) : engine(shopEngine), pool(workerCount) {}
+
+    // Waits for checkouts still paying, whose callbacks use the pool
+    ~ShopServer() {
+        stop();
+        unique_lock<mutex> guard(checkoutLock);
+        checkoutsDone.wait(guard, [this] { return checkoutsOut == 0; });
+        guard.unlock();
+        if (wakeFds[0] >= 0) {
+            ::close(wakeFds[0]);
+            ::close(wakeFds[1]);
+        }
+    }
+
+    // Binds 127.0.0.1:port (0 picks a free port) and returns the port.
+    int start(int port) {
+        listenFd = socket(AF_INET, SOCK_STREAM, 0);
+        if (listenFd < 0)
+            throw runtime_error("Cannot create socket.");
+        int one = 1;
+        setsockopt(listenFd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        sockaddr_in addr{};
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        addr.sin_port = htons((uint16_t)port);
+        if (bind(listenFd, (sockaddr*)&addr, sizeof(addr)) < 0 || listen(listenFd, 1024) < 0)
+            throw runtime_error("Cannot listen on port " + to_string(port) + ".");
+        socklen_t len = sizeof(addr);
+        getsockname(listenFd, (sockaddr*)&addr, &len);
+        if (pipe(wakeFds) < 0)
+            throw runtime_error("Cannot create the poller's wake pipe.");
+        fcntl(wakeFds[0], F_SETFL, O_NONBLOCK);
+        fcntl(wakeFds[1], F_SETFL, O_NONBLOCK);
+        running = true;
+        poller = thread([this] { pollLoop(); });
+        return ntohs(addr.sin_port);
+    }
+
+    void stop() {
+        if (!running.exchange(false))
+            return;
+        poller.join();
+        ::close(listenFd);
+    }
+};
+
+// ----------------------------- Load Driver -----------------------------
+// Client side of the server protocol: sends one command, waits for its reply.
+class ShopClient {
+private:
+    int fd;
+    string pending;
+
+public:
+    explicit ShopClient(int port) {
+        fd = socket(AF_INET, SOCK_STREAM, 0);
+        sockaddr_in addr{};
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        addr.sin_port = htons((uint16_t)port);
+        if (fd < 0 || connect(fd, (sockaddr*)&addr, sizeof(addr)) < 0)
+            throw runtime_error("Cannot connect to port " + to_string(port) + ".");
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+
+    ~ShopClient() { ::close(fd); }
+
+    // Returns true for OK replies
+    bool request(const string& command, string& body) {
+        if (!sendAll(fd, command + "\n"))
+            throw runtime_error("Connection lost.");
+        char buffer[16384];
+        size_t headerEnd;
+        while ((headerEnd = pending.find('\n')) == string::npos) {
+            ssize_t n = recv(fd, buffer, sizeof(buffer), 0);
+            if (n <= 0)
+                throw runtime_error("Connection lost.");
+            pending.append(buffer, n);
+        }
+        bool ok = pending.compare(0, 3, "OK ") == 0;
+        size_t length = stoul(pending.substr(ok ? 3 : 4, headerEnd));
+        while (pending.size() < headerEnd + 1 + length) {
+            ssize_t n = recv(fd, buffer, sizeof(buffer), 0);
+            if (n <= 0)
+                throw runtime_error("Connection lost.");
+            pending.append(buffer, n);
+        }
+        body = pending.substr(headerEnd + 1, length);
+        pending.erase(0, headerEnd + 1 + length);
+        return ok;
+    }
+};
+
+struct LoadResult {
+    size_t requests = 0, failures = 0;
+    double seconds = 0, p50Micros = 0, p99Micros = 0;
+};
+
+// Each client signs up, logs in, sets an address and then loops over
+// add/update/cart/checkout commands.
+LoadResult runLoad(int port, int clients, int requestsPerClient, const string& userPrefix) {
+    vector<vector<double>> latencies(clients);
+    atomic<size_t> failures{0};
+    vector<thread> threads;
+    auto start = chrono::steady_clock::now();
+    for (int c = 0; c < clients; ++c) {
+        threads.emplace_back([&, c] {
+            ShopClient client(port);
+            string body, name = userPrefix + to_string(c);
+            vector<string> setup = {"signup " + name + " secret " + name + "@load.test",
+                                    "login " + name + " secret", "ship Quezon City, Metro Manila"};
+            for (const auto& command : setup)
+                if (!client.request(command, body))
+                    ++failures;
+            latencies[c].reserve(requestsPerClient);
+            for (int i = 0; i < requestsPerClient; ++i) {
+                string command;
+                switch (i % 8) {
+                    case 0: case 1: case 2: command = "add " + to_string(1 + (c + i) % 11) + " 1"; break;
+                    case 3: command = "update " + to_string(1 + (c + i - 1) % 11) + " 2"; break;
+                    case 4: case 5: command = "cart"; break;
+                    case 6: command = "add 1 1"; break;
+                    default: command = "checkout gcash"; break;
+                }
+                auto sent = chrono::steady_clock::now();
+                if (!client.request(command, body))
+                    ++failures;
+                latencies[c].push_back(chrono::duration<double, micro>(chrono::steady_clock::now() - sent).count());
+            }
+        });
+    }
+    for (auto& t : threads)
+        t.join();
+
+    LoadResult result;
+    result.seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    vector<double> all;
+    for (const auto& l : latencies)
+        all.insert(all.end(), l.begin(), l.end());
+    sort(all.begin(), all.end());
+    result.requests = all.size();
+    result.failures = failures;
+    if (!all.empty()) {
+        result.p50Micros = all[all.size() / 2];
+        result.p99Micros = all[min(all.size() - 1, all.size() * 99 / 100)];
+    }
+    return result;
+}
+
+// Starts an in-process server for 1, 2, 4 ... cores workers and drives it.
+void runLoadSweep(int clients, int requestsPerClient) {
+    int cores = max(1u, thread::hardware_concurrency());
+    vector<int> workerCounts;
+    for (int w = 1; w < cores; w *= 2)
+        workerCounts.push_back(w);
+    workerCounts.push_back(cores);
+
+    cout << "workers\tclients\trequests\treq/s\tp50_us\tp99_us\tfailed" << endl;
+    for (int workers : workerCounts) {
+        CredentialStore store;
+        ShopEngine engine(store, makeDefaultCatalog());
+        ShopServer server(engine, workers);
+        int port = server.start(0);
+        LoadResult r = runLoad(port, clients, requestsPerClient, "load" + to_string(workers) + "_");
+        server.stop();
+        cout << workers << "\t" << clients << "\t" << r.requests << "\t" << r.requests / r.seconds
+             << "\t" << r.p50Micros << "\t" << r.p99Micros << "\t" << r.failures << endl;
+    }
+}
+#endif
+
+// ----------------------------- Benchmarks -----------------------------
+// Run with: ./Inteprog_Final --bench <name>
+class NullBuffer : public streambuf {
+protected:
+    int overflow(int c) override { return c; }
+    streamsize xsputn(const char*, streamsize n) override { return n; }
+};
+
+// Global heap traffic, for benchmarks that report allocations. Counting
+// replaces operator new for the whole program, so it is only compiled into
+// bench builds (-DSHOP_COUNT_ALLOCATIONS); elsewhere the counts stay 0.
+atomic<size_t> heapAllocations{0};
+atomic<size_t> heapBytes{0};
+
+#ifdef SHOP_COUNT_ALLOCATIONS
+constexpr bool countingAllocations = true;
+
+void* operator new(size_t size) {
+    heapAllocations.fetch_add(1, memory_order_relaxed);
+    heapBytes.fetch_add(size, memory_order_relaxed);
+    if (void* p = malloc(size ? size : 1))
+        return p;
+    throw bad_alloc();
+}
+
+// new above pairs with free() here; GCC cannot see that once both inline
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+void operator delete(void* p) noexcept { free(p); }
+void operator delete(void* p, size_t) noexcept { free(p); }
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic pop
+#endif
+#else
+constexpr bool countingAllocations = false;
+#endif
+
+vector<Product> makeSyntheticProducts(int size) {
+    vector<Product> products;
+    products.reserve(size);
+    for (int i = 1; i <= size; ++i)
+        products.push_back(Product(i, "Product #" + to_string(i), Money(100 + i % 997, i % 100)));
+    return products;
+}
+
+template <typename Fn>
+double nanosPerOp(int iterations, Fn fn) {
+    auto start = chrono::steady_clock::now();
+    for (int i = 0; i < iterations; ++i)
+        fn();
+    auto elapsed = chrono::steady_clock::now() - start;
+    return chrono::duration<double, nano>(elapsed).count() / iterations;
+}
+
+// Totals and receipts should scale with cart size, not with catalog size.
+void benchLookup() {
+    NullBuffer nullBuffer;
+    ostream nullSink(&nullBuffer);
+    User user("bench");
+    user.setEmail("bench@example.com");
+    user.setAddress("Makati, Metro Manila");
+    mt19937 rng(42);
+    volatile int64_t sink = 0;
+
+    cout << "catalog\tcart\ttotal_ns\treceipt_ns" << endl;
+    for (int catalogSize : {1000, 100000, 1000000}) {
+        CatalogRef catalog = makeCatalogSnapshot(makeSyntheticProducts(catalogSize));
+        for (int cartSize : {10, 50, 500}) {
+            Cart cart;
+            cart.setCatalog(catalog);
+            uniform_int_distribution<int> pick(1, catalogSize);
+            while ((int)cart.getItems().size() < cartSize)
+                cart.addProduct(pick(rng), 1);
+
+            double totalNs = nanosPerOp(2000, [&] { sink = sink + cart.calculateTotal().getCentavos(); });
+            double receiptNs = nanosPerOp(200, [&] { generateReceipt(user, cart, "Gcash", nullSink); });
+            cout << catalogSize << "\t" << cartSize << "\t" << totalNs << "\t" << receiptNs << endl;
+        }
+    }
+}
+
+// Heap bytes each new session pays for its catalog: the old per-cart copy
+// versus attaching the shared snapshot.
+void benchSessionMemory() {
+    const int sessions = 1000;
+    cout << "catalog\tcopy_bytes_per_session\tshared_bytes_per_session" << endl;
+    for (int catalogSize : {11, 1000, 100000}) {
+        CatalogRef catalog = makeCatalogSnapshot(makeSyntheticProducts(catalogSize));
+
+        vector<Product> products = makeSyntheticProducts(catalogSize);
+        vector<int> ids;
+        for (const auto& prod : products)
+            ids.push_back(prod.getId());
+
+        vector<vector<Product>> copies;
+        vector<ProductIndex> indexes(sessions / 10);
+        copies.reserve(sessions / 10);
+        size_t before = heapBytes.load();
+        for (int i = 0; i < sessions / 10; ++i) {
+            copies.push_back(products);
+            indexes[i].build(ids);
+        }
+        double copyBytes = double(heapBytes.load() - before) / (sessions / 10);
+        copies.clear();
+
+        vector<Cart> carts(sessions);
+        before = heapBytes.load();
+        for (auto& cart : carts)
+            cart.setCatalog(catalog);
+        double sharedBytes = double(heapBytes.load() - before) / sessions;
+
+        cout << catalogSize << "\t" << copyBytes << "\t" << sharedBytes
+             << " (+" << sizeof(Cart) << " inline)" << endl;
+    }
+}
+
+// Cart valuation over the columnar store versus an array of Product objects.
+void benchColumnarTotals() {
+    mt19937 rng(7);
+    volatile int64_t sink = 0;
+    cout << "catalog\tcart\taos_ns\tsoa_ns" << endl;
+    for (int catalogSize : {10000, 1000000}) {
+        vector<Product> products = makeSyntheticProducts(catalogSize);
+        vector<int> ids;
+        for (const auto& prod : products)
+            ids.push_back(prod.getId());
+        ProductIndex index;
+        index.build(ids);
+        CatalogRef catalog = makeCatalogSnapshot(products);
+
+        for (int cartSize : {16, 256, 4096}) {
+            uniform_int_distribution<int> pick(1, catalogSize);
+            vector<pair<int, int>> lines;
+            Cart cart;
+            cart.setCatalog(catalog);
+            while ((int)cart.getItems().size() < cartSize) {
+                int id = pick(rng);
+                if (find_if(lines.begin(), lines.end(),
+                        [id](const pair<int, int>& l) { return l.first == id; }) == lines.end()) {
+                    cart.addProduct(id, 1 + id % 5);
+                    lines.push_back({id, 1 + id % 5});
+                }
+            }
+
+            int iterations = 4000000 / cartSize;
+            double aosNs = nanosPerOp(iterations, [&] {
+                Money total;
+                for (const auto& line : lines)
+                    total += products[index.find(line.first)].getPrice() * line.second;
+                sink = sink + total.getCentavos();
+            });
+            double soaNs = nanosPerOp(iterations, [&] { sink = sink + cart.calculateTotal().getCentavos(); });
+            cout << catalogSize << "\t" << cartSize << "\t" << aosNs << "\t" << soaNs << endl;
+        }
+    }
+}
+
+// Registers and logs in synthetic users through the credential store.
+void benchCredentials(size_t users) {
+    CredentialStore store;
+    auto start = chrono::steady_clock::now();
+    for (size_t i = 0; i < users; ++i) {
+        string name = "user" + to_string(i);
+        if (!store.insert({name, "pw" + to_string(i % 1000), name + "@example.com"}))
+            throw runtime_error("Unexpected duplicate username.");
+    }
+    double signupSec = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    size_t loggedIn = 0;
+    start = chrono::steady_clock::now();
+    for (size_t i = 0; i < users; ++i) {
+        const Credential* cred = store.find("user" + to_string(i));
+        if (cred && cred->password == "pw" + to_string(i % 1000))
+            ++loggedIn;
+    }
+    double loginSec = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    if (loggedIn != users)
+        throw runtime_error("Login failed for a registered user.");
+
+    cout << "users: " << users << endl;
+    cout << "signup: " << signupSec << " s (" << signupSec * 1e9 / users << " ns/user)" << endl;
+    cout << "login:  " << loginSec << " s (" << loginSec * 1e9 / users << " ns/user)" << endl;
+}
+
+// Product ids drawn uniformly or Zipf-distributed (s = 1) over a catalog.
+// Popularity ranks are shuffled so hot products are spread across ids.
+class IdPicker {
+private:
+    vector<int> rankToId;
+    vector<double> cdf; // empty for uniform
+    mt19937 rng;
+
+public:
+    IdPicker(int catalogSize, bool zipf, unsigned seed) : rankToId(catalogSize), rng(seed) {
+        for (int i = 0; i < catalogSize; ++i)
+            rankToId[i] = i + 1;
+        shuffle(rankToId.begin(), rankToId.end(), rng);
+        if (zipf) {
+            cdf.resize(catalogSize);
+            double sum = 0;
+            for (int i = 0; i < catalogSize; ++i)
+                cdf[i] = (sum += 1.0 / (i + 1));
+            for (double& c : cdf)
+                c /= sum;
+        }
+    }
+
+    int next() {
+        if (cdf.empty())
+            return rankToId[uniform_int_distribution<int>(0, (int)rankToId.size() - 1)(rng)];
+        double u = uniform_real_distribution<double>(0, 1)(rng);
+        size_t rank = lower_bound(cdf.begin(), cdf.end(), u) - cdf.begin();
+        return rankToId[min(rank, rankToId.size() - 1)];
+    }
+
+    // count distinct ids, in the order they were first drawn
+    vector<int> distinct(int count) {
+        vector<int> ids;
+        unordered_map<int, bool> seen;
+        while ((int)ids.size() < count) {
+            int id = next();
+            if (!seen[id]) {
+                seen[id] = true;
+                ids.push_back(id);
+            }
+        }
+        return ids;
+    }
+};
+
+// Time and heap traffic accumulated over the measured part of a benchmark.
+struct Measurement {
+    double nanos = 0;
+    size_t ops = 0, allocations = 0, bytes = 0;
+
+    template <typename Fn>
+    void run(size_t opCount, Fn fn) {
+        size_t allocsBefore = heapAllocations.load(memory_order_relaxed);
+        size_t bytesBefore = heapBytes.load(memory_order_relaxed);
+        auto start = chrono::steady_clock::now();
+        fn();
+        nanos += chrono::duration<double, nano>(chrono::steady_clock::now() - start).count();
+        allocations += heapAllocations.load(memory_order_relaxed) - allocsBefore;
+        bytes += heapBytes.load(memory_order_relaxed) - bytesBefore;
+        ops += opCount;
+    }
+};
+
+// Cart, Order and receipt hot paths across catalog size, cart size and id
+// distribution. Prints a table and writes the same rows as JSON.
+void benchSuite(const string& jsonPath) {
+    NullBuffer nullBuffer;
+    ostream nullSink(&nullBuffer);
+    User user("bench");
+    user.setEmail("bench@example.com");
+    user.setAddress("Makati, Metro Manila");
+    GcashPayment payment;
+    const size_t targetOps = 200000;
+
+    ofstream json(jsonPath);
+    json << "[\n";
+    bool firstRow = true;
+    cout << "operation\tcatalog\tcart\tdist\tns/op\tallocs/op\tbytes/op" << endl;
+
+    for (int catalogSize : {1000, 100000, 1000000}) {
+        CatalogRef catalog = makeCatalogSnapshot(makeSyntheticProducts(catalogSize));
+        for (int cartSize : {1, 16, 256}) {
+            for (bool zipf : {false, true}) {
+                IdPicker picker(catalogSize, zipf, 1234);
+                vector<int> lineIds = picker.distinct(cartSize);
+                vector<int> picks(4096);
+                for (int& id : picks)
+                    id = picker.next();
+
+                Cart filled;
+                filled.setCatalog(catalog);
+                for (int id : lineIds)
+                    filled.addProduct(id, 1);
+                size_t rounds = max<size_t>(1, targetOps / cartSize);
+
+                vector<pair<string, Measurement>> results;
+                Measurement m;
+
+                // addProduct: build a cart of cartSize picks from empty
+                for (size_t r = 0; r < rounds; ++r) {
+                    Cart cart;
+                    cart.setCatalog(catalog);
+                    size_t offset = (r * cartSize) % picks.size();
+                    m.run(cartSize, [&] {
+                        for (int i = 0; i < cartSize; ++i)
+                            cart.addProduct(picks[(offset + i) % picks.size()], 1);
+                    });
+                }
+                results.push_back({"addProduct", m});
+
+                m = Measurement();
+                for (size_t r = 0; r < rounds; ++r) {
+                    Cart cart = filled;
+                    m.run(cartSize, [&] {
+                        for (int id : lineIds)
+                            cart.removeProduct(id);
+                    });
+                }
+                results.push_back({"removeProduct", m});
+
+                m = Measurement();
+                Cart cart = filled;
+                m.run(rounds * cartSize, [&] {
+                    for (size_t r = 0; r < rounds; ++r)
+                        for (int id : lineIds)
+                            cart.updateQuantity(id, 1 + (int)(r % 7));
+                });
+                results.push_back({"updateQuantity", m});
+
+                m = Measurement();
+                volatile int64_t sink = 0;
+                m.run(targetOps, [&] {
+                    for (size_t i = 0; i < targetOps; ++i)
+                        sink = sink + cart.calculateTotal().getCentavos();
+                });
+                results.push_back({"calculateTotal", m});
+
+                size_t renders = max<size_t>(1, targetOps / 10 / cartSize);
+                m = Measurement();
+                RenderBuffer paymentOutput;
+                m.run(renders, [&] {
+                    for (size_t i = 0; i < renders; ++i) {
+                        paymentOutput.clear();
+                        Order order(cart);
+                        order.checkout(&payment, paymentOutput);
+                        paymentOutput.writeTo(nullSink);
+                    }
+                });
+                results.push_back({"checkout", m});
+
+                m = Measurement();
+                m.run(renders, [&] {
+                    for (size_t i = 0; i < renders; ++i)
+                        generateReceipt(user, cart, "Gcash", nullSink);
+                });
+                results.push_back({"generateReceipt", m});
+
+                const char* dist = zipf ? "zipf" : "uniform";
+                for (const auto& result : results) {
+                    const Measurement& r = result.second;
+                    double ns = r.nanos / r.ops;
+                    double allocs = double(r.allocations) / r.ops;
+                    double bytes = double(r.bytes) / r.ops;
+                    cout << result.first << "\t" << catalogSize << "\t" << cartSize << "\t" << dist
+                         << "\t" << ns << "\t" << allocs << "\t" << bytes << endl;
+                    json << (firstRow ? "" : ",\n")
+                         << "  {\"operation\": \"" << result.first << "\", \"catalog\": " << catalogSize
+                         << ", \"cart\": " << cartSize << ", \"distribution\": \"" << dist
+                         << "\", \"ns_per_op\": " << ns << ", \"allocs_per_op\": " << allocs
+                         << ", \"bytes_per_op\": " << bytes << "}";
+                    firstRow = false;
+                }
+            }
+        }
+    }
+    json << "\n]\n";
+    cout << "Wrote " << jsonPath << endl;
+}
+
+// The cart lines before CartLines: unsorted, searched front to back.
+struct LegacyCartLines {
+    vector<pair<int, int>> items;
+    vector<int> lineSlots;
+    vector<int> lineQuantities;
+
+    void add(int productId, int quantity, int slot) {
+        for (size_t i = 0; i < items.size(); ++i) {
+            if (items[i].first == productId) {
+                items[i].second += quantity;
+                lineQuantities[i] = items[i].second;
+                return;
+            }
+        }
+        items.push_back({productId, quantity});
+        lineSlots.push_back(slot);
+        lineQuantities.push_back(quantity);
+    }
+
+    bool setQuantity(int productId, int quantity) {
+        for (size_t i = 0; i < items.size(); ++i) {
+            if (items[i].first == productId) {
+                items[i].second = quantity;
+                lineQuantities[i] = quantity;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    bool erase(int productId) {
+        auto it = find_if(items.begin(), items.end(),
+                          [productId](const pair<int, int>& item) { return item.first == productId; });
+        if (it == items.end())
+            return false;
+        size_t line = it - items.begin();
+        items.erase(it);
+        lineSlots.erase(lineSlots.begin() + line);
+        lineQuantities.erase(lineQuantities.begin() + line);
+        return true;
+    }
+
+    const int* slotData() const { return lineSlots.data(); }
+    const int* quantityData() const { return lineQuantities.data(); }
+    size_t size() const { return items.size(); }
+};
+
+// Add, update, remove and total per cart line, CartLines against the old
+// linear vector, for carts of 1 to 10k lines.
+void benchCartLines() {
+    const int catalogSize = 20000;
+    CatalogRef catalog = makeCatalogSnapshot(makeSyntheticProducts(catalogSize));
+    volatile int64_t sink = 0;
+    cout << "lines\tcontainer\tadd ns\tupdate ns\tremove ns\ttotal ns/line\tadd allocs/line" << endl;
+    for (int lineCount : {1, 4, 16, 17, 64, 256, 1024, 10000}) {
+        mt19937 rng(lineCount);
+        vector<int> ids(catalogSize);
+        iota(ids.begin(), ids.end(), 1);
+        shuffle(ids.begin(), ids.end(), rng);
+        ids.resize(lineCount);
+        vector<int> order = ids;
+        shuffle(order.begin(), order.end(), rng);
+        size_t rounds = max<size_t>(5, 400000 / lineCount / (lineCount > 1000 ? 10 : 1));
+
+        auto run = [&](auto emptyLines, const char* name) {
+            Measurement add, update, remove, total;
+            for (size_t r = 0; r < rounds; ++r) {
+                auto lines = emptyLines;
+                add.run(lineCount, [&] {
+                    for (int id : ids)
+                        lines.add(id, 1, id - 1);
+                });
+                update.run(lineCount, [&] {
+                    for (int id : order)
+                        lines.setQuantity(id, 1 + id % 7);
+                });
+                total.run(lineCount, [&] {
+                    for (int rep = 0; rep < 8; ++rep)
+                        sink = sink + catalog->valueLines(lines.slotData(), lines.quantityData(), lines.size()).getCentavos();
+                });
+                remove.run(lineCount, [&] {
+                    for (int id : order)
+                        lines.erase(id);
+                });
+            }
+            cout << lineCount << '\t' << name << '\t' << add.nanos / add.ops << '\t' << update.nanos / update.ops << '\t'
+                 << remove.nanos / remove.ops << '\t' << total.nanos / total.ops / 8 << '\t'
+                 << double(add.allocations) / add.ops << endl;
+        };
+        run(LegacyCartLines(), "vector");
+        run(CartLines(), "flat map");
+    }
+}
+
+// Publishes new catalogs back to back (price changes, removals, additions)
+// while reader threads shop flat out: add, view, browse the catalog, check
+// out. Every cart total is checked against its own snapshot, and at the
+// end every replaced snapshot must have been freed.
+void benchCatalogReload(int seconds, int readers) {
+    const int baseProducts = 2000;
+    CredentialStore store;
+    ShopEngine engine(store, makeCatalogSnapshot(makeSyntheticProducts(baseProducts)), 1000000000);
+    atomic<bool> stop{false};
+    atomic<long> operations{0}, checkouts{0}, repriced{0}, missing{0}, publishes{0};
+    vector<weak_ptr<const CatalogSnapshot>> published;
+
+    thread publisher([&] {
+        mt19937 rng(19);
+        while (!stop) {
+            vector<Product> products;
+            for (int id = 1; id <= baseProducts + 200; ++id) {
+                if (id > baseProducts && rng() % 2)
+                    continue; // products added and removed again
+                if (id <= baseProducts && rng() % 100 == 0)
+                    continue; // products taken off the shelf
+                int64_t cents = 10000 + id % 997 * 100 + (rng() % 20 == 0 ? rng() % 5000 : 0);
+                products.push_back(Product(id, "Product #" + to_string(id), Money::fromCentavos(cents)));
+            }
+            CatalogRef next = makeCatalogSnapshot(move(products));
+            published.push_back(next);
+            engine.publishCatalog(move(next));
+            ++publishes;
+        }
+    });
+
+    vector<thread> shoppers;
+    for (int t = 0; t < readers; ++t) {
+        shoppers.emplace_back([&, t] {
+            NullBuffer nullBuffer;
+            ostream nullSink(&nullBuffer);
+            RenderBuffer page;
+            ShopSession session;
+            string name = "reader" + to_string(t);
+            engine.signUp(name, "secret", name + "@reload.test");
+            engine.logIn(session, name, "secret");
+            engine.setShippingAddress(session, "Iloilo City", "Iloilo");
+            mt19937 rng(t);
+            for (long op = 0; !stop; ++op) {
+                try {
+                    switch (op % 8) {
+                        case 0: case 1: case 2:
+                            engine.addToCart(session, 1 + (int)(rng() % (baseProducts + 200)), 1 + (int)(rng() % 3));
+                            break;
+                        case 3: case 4:
+                            engine.showCart(session, nullSink);
+                            break;
+                        case 5: case 6: {
+                            CatalogRef catalog = engine.getCatalog();
+                            page.clear();
+                            for (int slot = 0; slot < (int)catalog->size(); slot += 40)
+                                renderProductLine(page, *catalog, slot);
+                            break;
+                        }
+                        case 7:
+                            engine.checkout(session, PaymentMethod::Gcash, nullSink);
+                            ++checkouts;
+                            break;
+                    }
+                } catch (const runtime_error& e) {
+                    string message = e.what();
+                    if (message.find("repriced") != string::npos)
+                        ++repriced;
+                    else if (message.find("not found") != string::npos || message.find("empty") != string::npos ||
+                             message.find("left") != string::npos) // removed while in this cart
+                        ++missing;
+                    else
+                        throw;
+                }
+                const CartLines& lines = session.cart.getItems();
+                if (!lines.empty() && session.cart.calculateTotal() !=
+                                          session.cart.getCatalog().valueLines(lines.slotData(), lines.quantityData(), lines.size()))
+                    throw runtime_error("Cart total does not match its catalog snapshot.");
+                ++operations;
+            }
+            engine.signOut(session);
+        });
+    }
+
+    this_thread::sleep_for(chrono::seconds(seconds));
+    stop = true;
+    publisher.join();
+    for (auto& shopper : shoppers)
+        shopper.join();
+    sharedEpochs().reclaim();
+
+    size_t alive = 0;
+    for (const auto& snapshot : published)
+        alive += !snapshot.expired();
+    cout << "readers: " << readers << ", " << seconds << " s" << endl;
+    cout << "catalogs published: " << publishes << " (" << publishes / double(seconds) << "/s)" << endl;
+    cout << "reader operations: " << operations << " (" << operations / double(seconds) << "/s), checkouts "
+         << checkouts << ", stopped to reprice " << repriced << ", product gone or cart empty " << missing << endl;
+    cout << "snapshots still alive: " << alive << " (the current one), retired objects pending: "
+         << sharedEpochs().pendingCount() << endl;
+    if (alive != 1)
+        throw runtime_error("Replaced catalog snapshots were not freed.");
+    cout << "OK: totals matched their snapshots and old snapshots were reclaimed" << endl;
+}
+
+// Reading the running cart total against recomputing it over every line,
+// by cart size, plus the cost of moving a cart to the next catalog version
+// where 1% of prices changed, by looking up every line or by following the
+// published changes. Every total is checked against a full recompute.
+void benchRunningTotals() {
+    const int catalogSize = 20000, versions = 16;
+    vector<Product> products = makeSyntheticProducts(catalogSize);
+    CatalogRef catalog = makeCatalogSnapshot(products);
+    vector<CatalogRef> chain = {catalog};
+    vector<shared_ptr<const CatalogChanges>> changes = {CatalogChanges::first(*catalog)};
+    for (int step = 1; step < versions; ++step) {
+        for (int id = step; id <= catalogSize; id += 100)
+            products[id - 1] = Product(id, products[id - 1].getName(), products[id - 1].getPrice() + Money(5, 0));
+        chain.push_back(makeCatalogSnapshot(products));
+        changes.push_back(CatalogChanges::between(*chain[step - 1], *changes[step - 1], *chain[step]));
+    }
+    CatalogRef repriced = chain.back();
+    NullBuffer nullBuffer;
+    ostream nullSink(&nullBuffer);
+    volatile int64_t sink = 0;
+    mt19937 rng(18);
+
+    cout << "lines\ttotal ns\trecompute ns\tedit+total ns\treprice 1% ns\twith changes ns\tview ns" << endl;
+    for (int lineCount : {1, 16, 256, 4096, 10000}) {
+        Cart cart;
+        cart.setCatalog(catalog);
+        uniform_int_distribution<int> pick(1, catalogSize);
+        while ((int)cart.getItems().size() < lineCount)
+            cart.addProduct(pick(rng), 1 + (int)(rng() % 4));
+        const CartLines& lines = cart.getItems();
+        auto recompute = [&] { return catalog->valueLines(lines.slotData(), lines.quantityData(), lines.size()); };
+
+        double totalNs = nanosPerOp(1000000, [&] { sink = sink + cart.calculateTotal().getCentavos(); });
+        double recomputeNs = nanosPerOp(max(10, 1000000 / lineCount), [&] { sink = sink + recompute().getCentavos(); });
+        double editNs = nanosPerOp(100000, [&] {
+            int productId = lines.productIdAt(rng() % lines.size());
+            cart.updateQuantity(productId, 1 + (int)(rng() % 9));
+            sink = sink + cart.calculateTotal().getCentavos();
+        });
+        if (cart.calculateTotal() != recompute())
+            throw runtime_error("Running total drifted from the cart lines.");
+
+        // Walks the cart up the chain, then back to the start untimed
+        int rounds = max(1, 10000 / lineCount);
+        auto walk = [&](bool withChanges) {
+            double nanos = 0;
+            for (int round = 0; round < rounds; ++round) {
+                auto start = chrono::steady_clock::now();
+                for (int step = 1; step < versions; ++step)
+                    cart.setCatalog(chain[step], withChanges ? changes[step].get() : nullptr);
+                nanos += chrono::duration<double, nano>(chrono::steady_clock::now() - start).count();
+                if (cart.calculateTotal() != repriced->valueLines(lines.slotData(), lines.quantityData(), lines.size()))
+                    throw runtime_error("Repricing left a wrong total.");
+                cart.setCatalog(catalog);
+            }
+            return nanos / (rounds * (versions - 1));
+        };
+        double repriceNs = walk(false);
+        double changesNs = walk(true);
+        Money expected = catalog->valueLines(lines.slotData(), lines.quantityData(), lines.size());
+        cart.setCatalog(repriced);
+        if (cart.calculateTotal() != repriced->valueLines(lines.slotData(), lines.quantityData(), lines.size()) ||
+            (cart.setCatalog(catalog), cart.calculateTotal() != expected))
+            throw runtime_error("Repricing left a wrong total.");
+
+        double viewNs = nanosPerOp(max(10, 100000 / lineCount), [&] { cart.showCart(nullSink); });
+        cout << lineCount << '\t' << totalNs << '\t' << recomputeNs << '\t' << editNs << '\t' << repriceNs << '\t'
+             << changesNs << '\t' << viewNs << endl;
+    }
+}
+
+// Global heap allocations per shopping session on one reused session
+// object: log in, ship, fill a 20-line cart, edit it, view it, check out
+// and sign out. Everything but the order kept in the shared history must
+// come from the session arena.
+void benchSessionArena(int sessions) {
+    CredentialStore store;
+    ShopEngine engine(store, makeCatalogSnapshot(makeSyntheticProducts(1000)), 100000000);
+    NullBuffer nullBuffer;
+    ostream nullSink(&nullBuffer);
+    const int users = 1000;
+    vector<string> names;
+    for (int i = 0; i < users; ++i) {
+        names.push_back("shopper_with_a_long_name_" + to_string(i));
+        engine.signUp(names.back(), "secret", names.back() + "@long-example-domain.test");
+    }
+    string password = "secret", city = "Cagayan de Oro City", province = "Misamis Oriental";
+
+    ShopSession session;
+    Measurement shopping, checkout;
+    auto shop = [&](int i) {
+        engine.logIn(session, names[i % users], password);
+        engine.setShippingAddress(session, city, province);
+        for (int line = 0; line < 20; ++line)
+            engine.addToCart(session, 1 + (i * 37 + line * 11) % 1000, 1 + line % 3);
+        for (int line = 0; line < 5; ++line)
+            engine.updateQuantity(session, 1 + (i * 37 + line * 11) % 1000, 4);
+        for (int line = 5; line < 8; ++line)
+            engine.removeFromCart(session, 1 + (i * 37 + line * 11) % 1000);
+        session.cart.showCart(nullSink);
+    };
+    for (int i = 0; i < 100; ++i) { // warm up thread-local buffers
+        shop(i);
+        engine.checkout(session, PaymentMethod::Gcash, nullSink);
+        engine.signOut(session);
+    }
+    auto start = chrono::steady_clock::now();
+    for (int i = 0; i < sessions; ++i) {
+        shopping.run(1, [&] { shop(i); });
+        checkout.run(1, [&] { engine.checkout(session, static_cast<PaymentMethod>(1 + i % 3), nullSink); });
+        shopping.run(0, [&] { engine.signOut(session); });
+    }
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    cout << sessions << " sessions in " << seconds << " s (" << sessions / seconds << " sessions/s), "
+         << sizeof(ShopSession) << "-byte session object" << endl;
+    cout << "phase\tallocs/session\tbytes/session" << endl;
+    cout << "shopping\t" << double(shopping.allocations) / sessions << '\t' << double(shopping.bytes) / sessions << endl;
+    cout << "checkout\t" << double(checkout.allocations) / sessions << '\t' << double(checkout.bytes) / sessions
+         << "\t(the order record kept in history)" << endl;
+    if (shopping.allocations != 0)
+        throw runtime_error("Session work allocated from the global heap.");
+    cout << "OK: no global heap allocations outside the order history" << endl;
+}
+
+// Imports a generated file of id,qty lines (about 1% of them bad) into a
+// cart that already has some lines, against reading the same lines with
+// iostreams and adding them one by one as the interactive prompts do.
+void benchCartImport(int lineCount) {
+    CredentialStore store;
+    const int products = 10000;
+    ShopEngine engine(store, makeCatalogSnapshot(makeSyntheticProducts(products)), 1000000000);
+    engine.signUp("bulk_buyer", "secret", "bulk_buyer@example.com");
+    ShopSession session;
+    engine.logIn(session, "bulk_buyer", "secret");
+
+    string path = (filesystem::temp_directory_path() / "bench_cart_import.csv").string();
+    {
+        mt19937 rng(7);
+        RenderBuffer file;
+        file << "product_id,quantity\n";
+        for (int i = 0; i < lineCount; ++i) {
+            int id = 1 + (int)(rng() % products), quantity = 1 + (int)(rng() % 5);
+            if (i % 200 == 99)
+                file << products + id << ',' << quantity << '\n'; // not in the catalog
+            else if (i % 200 == 199)
+                file << id << ",x\n";
+            else
+                file << id << ", " << quantity << '\n';
+        }
+        FILE* out = fopen(path.c_str(), "wb");
+        if (!out)
+            throw runtime_error("Cannot write " + path + ".");
+        file.writeTo(out);
+        fclose(out);
+    }
+    double megabytes = filesystem::file_size(path) / 1e6;
+    auto startCart = [&] {
+        engine.clearCart(session);
+        for (int id = 1; id <= products; id += products / 50)
+            engine.addToCart(session, id, 2);
+    };
+
+    auto start = chrono::steady_clock::now();
+    string text = readImportFile(path);
+    double readMs = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+    vector<CartImportRecord> records;
+    vector<CartImportError> errors;
+    start = chrono::steady_clock::now();
+    parseCartImport(text, records, errors);
+    double parseMs = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+    startCart();
+    start = chrono::steady_clock::now();
+    CartImportResult result = engine.importCart(session, readImportFile(path));
+    double importMs = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+    Money bulkTotal = session.cart.calculateTotal();
+    size_t bulkLines = session.cart.getItems().size();
+
+    startCart();
+    start = chrono::steady_clock::now();
+    ifstream file(path);
+    string line;
+    size_t oneByOneAdded = 0;
+    getline(file, line); // header
+    while (getline(file, line)) {
+        istringstream fields(line);
+        int id = 0, quantity = 0;
+        char comma = 0;
+        if (!(fields >> id >> comma >> quantity) || comma != ',')
+            continue;
+        try {
+            engine.addToCart(session, id, quantity);
+            ++oneByOneAdded;
+        } catch (const exception&) {
+        }
+    }
+    double oneByOneMs = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+    filesystem::remove(path);
+
+    cout << lineCount << " lines, " << megabytes << " MB, " << products << " products in the catalog" << endl;
+    cout << "step\tms\tlines/s\tMB/s" << endl;
+    auto row = [&](const char* step, double ms) {
+        cout << step << '\t' << ms << '\t' << lineCount / (ms / 1000) << '\t' << megabytes / (ms / 1000) << endl;
+    };
+    row("read file", readMs);
+    row("parse", parseMs);
+    row("import (read, parse, check, add)", importMs);
+    row("iostream + addToCart per line", oneByOneMs);
+    cout << "imported " << result.added << " of " << result.records << " lines (" << result.errors.size()
+         << " errors) into " << bulkLines << " cart lines, total Php " << bulkTotal << endl;
+    if (oneByOneAdded != result.added || session.cart.calculateTotal() != bulkTotal ||
+        session.cart.getItems().size() != bulkLines)
+        throw runtime_error("Bulk import and one-by-one adds built different carts.");
+    cout << "OK: same cart as adding the lines one by one" << endl;
+}
+
+// Cost of the operation stats on the checkout path: the same shopping
+// loop with recording on and off, in many short alternating rounds so
+// drift and noise hit both modes alike. Checkout is timed per call in
+// both modes, so the stopwatch costs the same either way.
+void benchOperationStats(int checkouts) {
+    CredentialStore store;
+    ShopEngine engine(store, makeCatalogSnapshot(makeSyntheticProducts(1000)), 100000000);
+    NullBuffer nullBuffer;
+    ostream nullSink(&nullBuffer);
+    engine.signUp("stats_shopper", "secret", "stats_shopper@example.com");
+    ShopSession session;
+    engine.logIn(session, "stats_shopper", "secret");
+    engine.setShippingAddress(session, "Cagayan de Oro City", "Misamis Oriental");
+
+    auto round = [&](bool enabled, double& checkoutNs, double& pathNs) {
+        operationStats().setEnabled(enabled);
+        chrono::steady_clock::duration inCheckout{};
+        auto start = chrono::steady_clock::now();
+        for (int i = 0; i < checkouts; ++i) {
+            for (int line = 0; line < 3; ++line)
+                engine.addToCart(session, 1 + (i * 37 + line * 11) % 1000, 1 + line);
+            auto before = chrono::steady_clock::now();
+            engine.checkout(session, static_cast<PaymentMethod>(1 + i % 3), nullSink);
+            inCheckout += chrono::steady_clock::now() - before;
+        }
+        pathNs = chrono::duration<double, nano>(chrono::steady_clock::now() - start).count() / checkouts;
+        checkoutNs = chrono::duration<double, nano>(inCheckout).count() / checkouts;
+    };
+
+    double ignored, ignoredToo;
+    round(true, ignored, ignoredToo); // warm up
+    const int rounds = 101;
+    vector<double> offCheckout, onCheckout, offPath, onPath;
+    for (int r = 0; r < rounds; ++r) {
+        for (bool enabled : {false, true}) {
+            double checkoutNs, pathNs;
+            round(enabled, checkoutNs, pathNs);
+            (enabled ? onCheckout : offCheckout).push_back(checkoutNs);
+            (enabled ? onPath : offPath).push_back(pathNs);
+        }
+    }
+    operationStats().setEnabled(true);
+    auto median = [](vector<double> values) {
+        sort(values.begin(), values.end());
+        return values[values.size() / 2];
+    };
+    double checkoutOverhead = (median(onCheckout) / median(offCheckout) - 1) * 100;
+    double pathOverhead = (median(onPath) / median(offPath) - 1) * 100;
+
+    cout << checkouts << " checkouts of 3 lines per round, median of " << rounds << " rounds" << endl;
+    cout << "timed	stats off ns	stats on ns	overhead %" << endl;
+    cout << "checkout	" << median(offCheckout) << '\t' << median(onCheckout) << '\t' << checkoutOverhead << endl;
+    cout << "add x3 + checkout	" << median(offPath) << '\t' << median(onPath) << '\t' << pathOverhead << endl;
+    cout << endl;
+    writeOperationStats(cout, StatsFormat::Text);
+    if (checkoutOverhead >= 2)
+        throw runtime_error("Operation stats cost 2% or more on checkout.");
+    cout << "OK: operation stats cost under 2% on checkout" << endl;
+}
+
+// Many threads check out carts that all contain one hot product. Every
+// successful checkout must be backed by stock: nothing may be oversold.
+void benchInventory(int threads) {
+    CredentialStore store;
+    ShopEngine engine(store, makeCatalogSnapshot(makeSyntheticProducts(1000)), 1000000);
+    const int hotStock = 20000;
+    const int attemptsPerThread = 5000;
+    engine.getInventory().setStock(1, hotStock);
+    atomic<long> hotSold{0}, checkouts{0}, rejected{0};
+    atomic<int> ready{0};
+
+    auto start = chrono::steady_clock::now();
+    vector<thread> workers;
+    for (int t = 0; t < threads; ++t) {
+        workers.emplace_back([&, t] {
+            NullBuffer nullBuffer;
+            ostream nullSink(&nullBuffer);
+            ShopSession session;
+            string name = "stress" + to_string(t);
+            engine.signUp(name, "secret", name + "@stress.test");
+            engine.logIn(session, name, "secret");
+            engine.setShippingAddress(session, "Cebu City", "Cebu");
+            mt19937 rng(t);
+            ++ready;
+            while (ready < threads) {}
+            for (int i = 0; i < attemptsPerThread; ++i) {
+                int hotQty = 1 + rng() % 3;
+                int otherId = 2 + (int)(rng() % 999);
+                try {
+                    engine.addToCart(session, 1, hotQty);
+                    engine.addToCart(session, otherId, 1);
+                    engine.checkout(session, PaymentMethod::Gcash, nullSink);
+                    hotSold += hotQty;
+                    ++checkouts;
+                } catch (const runtime_error&) {
+                    ++rejected;
+                    engine.clearCart(session);
+                }
+            }
+        });
+    }
+    for (auto& w : workers)
+        w.join();
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    int remaining = engine.getInventory().available(1);
+    cout << "threads: " << threads << endl;
+    cout << "checkouts: " << checkouts << " accepted, " << rejected << " rejected in " << seconds << " s ("
+         << (checkouts + rejected) / seconds << " attempts/s)" << endl;
+    cout << "hot product: stock " << hotStock << ", sold " << hotSold << ", remaining " << remaining << endl;
+    bool consistent = remaining >= 0 && hotSold + remaining == hotStock;
+    cout << (consistent ? "OK: no overselling" : "FAILED: stock does not add up") << endl;
+    if (!consistent)
+        throw runtime_error("Inventory oversold.");
+}
 
-public:
-    User(const string& uname) : username(uname) {}
+// The receipt code before the render buffer: one stream insert per field
+// and a flush at the end of every line.
+void legacyReceipt(ostream& out, const User& user, const Cart& cart, string_view paymentMethod) {
+    out<<"\n--- Receipt ---\n";
+    out<<"User: "<<user.getUsername()<<endl;
+    out<<"Email: "<<user.getEmail()<<endl;
+    out<<"Shipping Address: "<<user.getAddress()<<endl;
+    out<<"Payment Method: "<<paymentMethod<<endl;
+    out<<"Items Purchased:"<<endl;
+    Money grandTotal;
+    for (const auto& entry : cart.getItems()) {
+        int slot = cart.findSlot(entry.first);
+        Money itemTotal = cart.getCatalog().priceAt(slot) * entry.second;
+        out << "- " << cart.getCatalog().nameAt(slot) << " x" << entry.second << " - Php " << itemTotal << endl;
+        grandTotal += itemTotal;
+    }
+    out << "\nTotal: Php " << grandTotal << endl;
+    out << "---------------------" << endl;
+}
 
-    string getUsername() const { return username; }
-    
-    void setEmail(const string& userEmail) {
-        email = userEmail;
+// Writes generated receipts to files: per-line flushing versus the render
+// buffer, and batched text and compact output through ReceiptWriter.
+void benchReceipts(size_t count) {
+    CatalogRef catalog = makeDefaultCatalog();
+    vector<Cart> carts(64);
+    for (size_t i = 0; i < carts.size(); ++i) {
+        carts[i].setCatalog(catalog);
+        for (size_t line = 0; line < 2 + i % 4; ++line)
+            carts[i].addProduct(1 + (int)((i + line * 3) % 11), 1 + (int)(line % 3));
     }
-    
-    string getEmail() const {
-        return email;
+    User user("juan_dela_cruz");
+    user.setEmail("juan@example.com");
+    user.setAddress("Quezon City, Metro Manila");
+
+    string dir = filesystem::temp_directory_path().string();
+    auto report = [&](const string& label, const string& path, double seconds) {
+        double megabytes = filesystem::file_size(path) / 1e6;
+        cout << label << "\t" << count / seconds << " receipts/s\t" << megabytes / seconds << " MB/s\t"
+             << megabytes << " MB" << endl;
+        filesystem::remove(path);
+    };
+
+    string path = dir + "/receipts_legacy.txt";
+    {
+        auto start = chrono::steady_clock::now();
+        ofstream out(path);
+        for (size_t i = 0; i < count; ++i)
+            legacyReceipt(out, user, carts[i % carts.size()], "Gcash");
+        out.close();
+        report("endl per line", path, chrono::duration<double>(chrono::steady_clock::now() - start).count());
     }
 
-    void setAddress(const string& addr) {
-        address = addr;
+    path = dir + "/receipts_render.txt";
+    {
+        auto start = chrono::steady_clock::now();
+        ofstream out(path);
+        for (size_t i = 0; i < count; ++i)
+            generateReceipt(user, carts[i % carts.size()], "Gcash", out);
+        out.close();
+        report("render buffer", path, chrono::duration<double>(chrono::steady_clock::now() - start).count());
     }
 
-    string getAddress() const {
-        return address;
+    for (ReceiptFormat format : {ReceiptFormat::Text, ReceiptFormat::Compact}) {
+        path = dir + (format == ReceiptFormat::Text ? "/receipts_batch.txt" : "/receipts_batch.jsonl");
+        filesystem::remove(path);
+        auto start = chrono::steady_clock::now();
+        {
+            ReceiptWriter writer(path, format);
+            for (size_t i = 0; i < count; ++i)
+                writer.write(user, carts[i % carts.size()], "Gcash");
+        }
+        report(format == ReceiptFormat::Text ? "batched text" : "batched compact", path,
+               chrono::duration<double>(chrono::steady_clock::now() - start).count());
     }
-};
+}
 
-// ----------------------------- Cart Class -----------------------------
-class Cart {
-private:
-    vector<pair<int, int>> items; // pair<productId, quantity>
-    vector<Product> catalog;
+#ifdef SHOP_POSIX
+// Appends orders from several threads with group commit, then measures
+// how long replaying the journal takes.
+void benchJournal(size_t orders, int threads) {
+    string path = (filesystem::temp_directory_path() / "orders_bench.journal").string();
+    filesystem::remove(path);
 
-public:
-    void setCatalog(const vector<Product>& products) {
-        catalog = products;
+    auto start = chrono::steady_clock::now();
+    {
+        OrderJournal journal(path, 10, nullptr);
+        vector<thread> writers;
+        for (int t = 0; t < threads; ++t) {
+            writers.emplace_back([&, t] {
+                OrderRecord record;
+                record.username = "shopper" + to_string(t);
+                record.lines = {{1, 2, 6491350}, {5, 1, 24555}};
+                record.totalCentavos = 6515905;
+                for (size_t i = t; i < orders; i += threads) {
+                    record.timestampMillis = (int64_t)i;
+                    record.method = (PaymentMethod)(1 + i % 3);
+                    journal.append(record);
+                }
+            });
+        }
+        for (auto& w : writers)
+            w.join();
     }
+    double writeSec = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    double megabytes = filesystem::file_size(path) / 1e6;
 
-    void addProduct(const Product& product, int quantity) {
-        if (quantity <= 0)
-            throw runtime_error("Quantity must be greater than 0.");
-        bool found = false;
-        for (auto& item : items) {
-            if (item.first == product.getId()) {
-                item.second += quantity;
-                found = true;
-                break;
-            }
+    start = chrono::steady_clock::now();
+    size_t replayed = 0;
+    int64_t revenue = 0;
+    OrderJournal::replay(path, [&](const OrderJournal::RecordView& record) {
+        ++replayed;
+        revenue += record.totalCentavos();
+    });
+    double replaySec = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    filesystem::remove(path);
+
+    cout << "orders: " << orders << " from " << threads << " threads, journal " << megabytes << " MB" << endl;
+    cout << "write:  " << writeSec << " s (" << orders / writeSec << " orders/s, " << megabytes / writeSec << " MB/s)" << endl;
+    cout << "replay: " << replaySec << " s (" << replayed / replaySec << " orders/s), "
+         << replayed << " orders, revenue Php " << Money::fromCentavos(revenue) << endl;
+    if (replayed != orders)
+        throw runtime_error("Replay did not return every order.");
+}
+#endif
+
+// Time to first request: from opening the catalog to the total of a
+// one-item cart, with the catalog parsed from CSV or mapped from the binary
+// file. Both files are freshly written, so both are in the page cache.
+void benchCatalogStartup(int productCount) {
+    filesystem::path dir = filesystem::temp_directory_path();
+    string csvPath = (dir / "catalog_bench.csv").string(), binPath = (dir / "catalog_bench.bin").string();
+    {
+        ofstream csv(csvPath);
+        csv << "id,name,price\n";
+        RenderBuffer line;
+        for (const Product& prod : makeSyntheticProducts(productCount)) {
+            line.clear();
+            line << prod.getId() << ',' << prod.getName() << ',' << prod.getPrice() << '\n';
+            line.writeTo(csv);
         }
-        if (!found) {
-            items.push_back({product.getId(), quantity});
+    }
+    auto start = chrono::steady_clock::now();
+    {
+        ifstream csv(csvPath);
+        writeCatalogFile(*makeCatalogSnapshot(readCatalogCsv(csv)), binPath);
+    }
+    double convertMs = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+    cout << productCount << " products: CSV " << filesystem::file_size(csvPath) / 1e6 << " MB, binary "
+         << filesystem::file_size(binPath) / 1e6 << " MB, converted in " << convertMs << " ms" << endl;
+
+    for (const string& path : {csvPath, binPath}) {
+        vector<double> openMs, firstRequestMs;
+        for (int run = 0; run < 5; ++run) {
+            auto t0 = chrono::steady_clock::now();
+            CatalogRef catalog = loadCatalog(path);
+            auto t1 = chrono::steady_clock::now();
+            CredentialStore store;
+            ShopEngine engine(store, catalog);
+            engine.signUp("first", "shopper", "first@shop.ph");
+            ShopSession session;
+            engine.logIn(session, "first", "shopper");
+            engine.addToCart(session, productCount / 2, 1);
+            volatile int64_t total = session.cart.calculateTotal().getCentavos();
+            (void)total;
+            auto t2 = chrono::steady_clock::now();
+            openMs.push_back(chrono::duration<double, milli>(t1 - t0).count());
+            firstRequestMs.push_back(chrono::duration<double, milli>(t2 - t0).count());
         }
-        cout<< "Added "<<quantity<<" of "<<product.getName()<<" to cart."<<endl;
+        sort(openMs.begin(), openMs.end());
+        sort(firstRequestMs.begin(), firstRequestMs.end());
+        cout << (path == csvPath ? "csv:    " : "binary: ") << "open " << openMs[2] << " ms, first request "
+             << firstRequestMs[2] << " ms (median of 5)" << endl;
     }
+    filesystem::remove(csvPath);
+    filesystem::remove(binPath);
+}
 
-    void removeProduct(int productId) {
-        auto it = std::remove_if(items.begin(), items.end(),
-            [productId](const pair<int, int>& item) { return item.first == productId; });
-        if (it == items.end())
-            throw runtime_error("Product not in cart.");
-        items.erase(it, items.end());
-        cout<<"Removed product ID "<<productId<<" from cart."<<endl;
+// Category listings and intersections through the inverted index vs.
+// scanning every product's categories.
+void benchCategories(int productCount) {
+    vector<Product> products;
+    products.reserve(productCount);
+    for (int i = 1; i <= productCount; ++i) {
+        vector<string> categories = {"dept" + to_string(i % 100), "brand" + to_string(i % 7)};
+        if (i % 1000 == 0)
+            categories.push_back("sale");
+        products.push_back(Product(i, "Product #" + to_string(i), Money(100 + i % 997, i % 100), move(categories)));
     }
+    CatalogRef catalog = makeCatalogSnapshot(products);
 
-    void updateQuantity(int productId, int newQuantity) {
-        if (newQuantity <= 0)
-            throw runtime_error("Quantity must be greater than 0.");
-        bool found = false;
-        for (auto& item : items) {
-            if (item.first == productId) {
-                item.second = newQuantity;
-                found = true;
-                break;
+    vector<vector<string>> queries = {{"dept5"}, {"sale"}, {"dept5", "brand3"}, {"sale", "brand3"},
+                                      {"sale", "dept0", "brand3"}};
+    cout << productCount << " products, " << catalog->categoryCount() << " categories" << endl;
+    cout << "query\tresults\tindex us\tscan us" << endl;
+    for (const auto& query : queries) {
+        size_t results = 0;
+        double indexMicros = nanosPerOp(200, [&] { results = catalog->slotsInCategories(query).size(); }) / 1000;
+        size_t scanned = 0;
+        double scanMicros = nanosPerOp(3, [&] {
+            vector<uint32_t> slots;
+            for (size_t slot = 0; slot < products.size(); ++slot) {
+                const vector<string>& categories = products[slot].getCategories();
+                bool inAll = all_of(query.begin(), query.end(), [&](const string& name) {
+                    return find(categories.begin(), categories.end(), name) != categories.end();
+                });
+                if (inAll)
+                    slots.push_back((uint32_t)slot);
             }
+            scanned = slots.size();
+        }) / 1000;
+        if (scanned != results)
+            throw runtime_error("Index and scan disagree.");
+        string label;
+        for (const string& name : query)
+            label += (label.empty() ? "" : "+") + name;
+        cout << label << '\t' << results << '\t' << indexMicros << '\t' << scanMicros << endl;
+    }
+}
+
+// Product names like "Zorikan Wireless Mouse Black ZO-104233": one of a few
+// thousand made-up brands, then a style, an item type and a colour from
+// short lists, so common words are shared by many products.
+vector<string> makeProductNames(int count) {
+    static const char* syllables[] = {"ka", "zo", "ri", "tek", "lo", "vi", "na", "ex", "mo", "da", "sun", "ra",
+                                      "pix", "on", "el", "tri", "ba", "qu", "ny", "ar", "gen", "fi", "hu", "sa"};
+    static const char* styles[] = {"Wireless", "Gaming", "Ergonomic", "Compact", "Pro", "Mechanical",
+                                   "Bluetooth", "Portable", "Ultra", "Silent", "RGB", "Slim", "Budget",
+                                   "Premium", "Travel", "Office"};
+    static const char* items[] = {"Mouse", "Keyboard", "Headset", "Earphones", "Controller", "Mousepad",
+                                  "Laptop Cooler", "Flash Drive", "Monitor", "Webcam", "Speaker", "Charger",
+                                  "Power Bank", "Microphone", "Router", "Laptop", "Tablet", "Smartwatch",
+                                  "Cable", "Hub", "Chair", "Desk Lamp", "Stylus", "Gamepad", "SSD"};
+    static const char* colours[] = {"Black", "White", "Silver", "Red", "Blue", "Pink", "Green", "Grey"};
+    mt19937 rng(42);
+    vector<string> brands;
+    for (int i = 0; i < 3000; ++i) {
+        string brand;
+        for (int parts = 2 + rng() % 2; parts > 0; --parts)
+            brand += syllables[rng() % size(syllables)];
+        brand[0] = (char)toupper((unsigned char)brand[0]);
+        brands.push_back(brand);
+    }
+    vector<string> names;
+    names.reserve(count);
+    for (int i = 0; i < count; ++i) {
+        const string& brand = brands[rng() % brands.size()];
+        names.push_back(brand + " " + styles[rng() % size(styles)] + " " + items[rng() % size(items)] + " "
+                        + colours[rng() % size(colours)] + " " + (char)toupper((unsigned char)brand[0])
+                        + (char)toupper((unsigned char)brand[1]) + "-" + to_string(100000 + i));
+    }
+    return names;
+}
+
+// Build time, memory and query latency of the trigram name index
+void benchSearch(int productCount) {
+    vector<string> names = makeProductNames(productCount);
+    vector<Product> products;
+    products.reserve(productCount);
+    for (int i = 0; i < productCount; ++i)
+        products.push_back(Product(i + 1, names[i], Money(100 + i % 997, i % 100)));
+    CatalogRef catalog = makeCatalogSnapshot(products);
+
+    auto start = chrono::steady_clock::now();
+    shared_ptr<const NameSearchIndex> built = NameSearchIndex::build(*catalog);
+    const NameSearchIndex& index = *built;
+    double buildSec = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    cout << productCount << " names: built in " << buildSec << " s (" << productCount / buildSec << " names/s), "
+         << index.trigramCount() << " trigrams, " << index.memoryBytes() / 1e6 << " MB" << endl;
+
+    // The next catalog as a reload brings it: every price changed, 1% of
+    // the names changed and 1% of the products replaced by new ones
+    for (int i = 0; i < productCount; ++i) {
+        products[i] = Product(products[i].getId(), names[i], Money(101 + i % 997, i % 100));
+        if (i % 100 == 1)
+            products[i] = Product(products[i].getId(), names[i] + " (2nd gen)", products[i].getPrice());
+        else if (i % 100 == 2)
+            products[i] = Product(productCount + i + 1, names[(i * 7) % productCount], products[i].getPrice());
+    }
+    names = vector<string>();
+    CatalogRef next = makeCatalogSnapshot(move(products));
+    start = chrono::steady_clock::now();
+    shared_ptr<const NameSearchIndex> updated = index.updatedFor(*catalog, *next);
+    double updateSec = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    cout << "next catalog (2% of names changed): updated in " << updateSec << " s, "
+         << buildSec / updateSec << "x faster than a build" << endl;
+    updated.reset();
+    next.reset();
+
+    // A brand and item from an existing name, the same with typos, its
+    // model number, and words shared by many products
+    string sample(catalog->nameAt(productCount / 2));
+    istringstream words(sample);
+    string brand, style, item;
+    words >> brand >> style >> item;
+    string typo = brand.substr(0, 2) + brand.substr(3) + " " + item.substr(0, item.size() - 2) + item.back();
+    vector<string> queries = {brand + " " + item, typo, sample.substr(sample.rfind(' ') + 1), brand,
+                              "mechanical keyboard", "power bank", "chair"};
+    cout << "query\tresults\tp50 us\tp99 us\ttop match" << endl;
+    for (const string& query : queries) {
+        vector<double> micros;
+        vector<SearchHit> hits;
+        for (int run = 0; run < 200; ++run) {
+            auto t0 = chrono::steady_clock::now();
+            hits = index.search(*catalog, query);
+            micros.push_back(chrono::duration<double, micro>(chrono::steady_clock::now() - t0).count());
         }
-        if (!found)
-            throw runtime_error("Product not in cart.");
+        sort(micros.begin(), micros.end());
+        cout << query << '\t' << hits.size() << '\t' << micros[micros.size() / 2] << '\t' << micros[micros.size() * 99 / 100]
+             << '\t' << (hits.empty() ? "-" : catalog->nameAt(hits[0].slot)) << endl;
     }
+}
 
-    void showCart() const {
-        cout << "\n--- Cart ---" << endl;
-        double total = 0;
-        for (const auto& item : items) {
-            for (const auto& prod : catalog) {
-                if (prod.getId() == item.first) {
-                    double itemTotal = prod.getPrice() * item.second;
-                    cout <<"ID: "<<prod.getId()
-                         <<" | " <<prod.getName()
-                         << " x" <<item.second
-                         << " - Php " <<itemTotal<<endl;
-                    total += itemTotal;
+// Checkouts per second through a stub gateway with the given latency.
+// Blocking: each session thread sends one payment per gateway call and
+// waits for it, as a PaymentStrategy calling the gateway would. Async:
+// each session thread keeps 64 checkouts in flight and the dispatcher
+// batches them over 4 gateway connections.
+void benchPayments(int latencyMs, int threads, double failureRate) {
+    const int sessionsPerThread = 64;
+    const auto runFor = chrono::seconds(3);
+    cout << "gateway latency " << latencyMs << " ms, failure rate " << failureRate << ", " << threads
+         << " session threads" << endl;
+    cout << "path	checkouts	failed	gateway calls	checkouts/s" << endl;
+    for (bool async : {false, true}) {
+        CredentialStore store;
+        ShopEngine engine(store, makeCatalogSnapshot(makeSyntheticProducts(1000)), 100000000);
+        StubGateway gateway(chrono::milliseconds(latencyMs), failureRate);
+        PaymentDispatcher dispatcher(gateway, async ? 4 : threads, async ? 64 : 1);
+        engine.setPaymentDispatcher(&dispatcher);
+        atomic<long> checkouts{0}, failed{0};
+        auto start = chrono::steady_clock::now();
+        auto stopAt = start + runFor;
+        vector<thread> workers;
+        for (int t = 0; t < threads; ++t) {
+            workers.emplace_back([&, t] {
+                NullBuffer nullBuffer;
+                ostream nullSink(&nullBuffer);
+                vector<ShopSession> sessions(async ? sessionsPerThread : 1);
+                for (size_t i = 0; i < sessions.size(); ++i) {
+                    string name = "pay" + to_string(t) + "_" + to_string(i);
+                    engine.signUp(name, "secret", name + "@pay.test");
+                    engine.logIn(sessions[i], name, "secret");
+                    engine.setShippingAddress(sessions[i], "Davao City", "Davao del Sur");
                 }
-            }
+                auto method = [t](size_t i) { return static_cast<PaymentMethod>(1 + (t + i) % 3); };
+                if (!async) {
+                    while (chrono::steady_clock::now() < stopAt) {
+                        engine.addToCart(sessions[0], 1 + (int)(checkouts % 1000), 1);
+                        try {
+                            engine.checkout(sessions[0], method(0), nullSink);
+                            ++checkouts;
+                        } catch (const runtime_error&) {
+                            ++failed;
+                            engine.clearCart(sessions[0]);
+                        }
+                    }
+                    return;
+                }
+                deque<pair<size_t, PendingCheckout>> inFlight;
+                auto begin = [&](size_t i) {
+                    engine.addToCart(sessions[i], 1 + (int)((t * 64 + i) % 1000), 1);
+                    inFlight.emplace_back(i, engine.beginCheckout(sessions[i], method(i)));
+                };
+                for (size_t i = 0; i < sessions.size(); ++i)
+                    begin(i);
+                while (!inFlight.empty()) {
+                    size_t i = inFlight.front().first;
+                    try {
+                        engine.finishCheckout(sessions[i], inFlight.front().second, nullSink);
+                        ++checkouts;
+                    } catch (const runtime_error&) {
+                        ++failed;
+                        engine.clearCart(sessions[i]);
+                    }
+                    inFlight.pop_front();
+                    if (chrono::steady_clock::now() < stopAt)
+                        begin(i);
+                }
+            });
         }
-        cout<<"Total: Php "<<total<<endl;
+        for (auto& w : workers)
+            w.join();
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        cout << (async ? "async" : "blocking") << '\t' << checkouts << '\t' << failed << '\t' << gateway.callCount()
+             << '\t' << checkouts / seconds << endl;
+        if (engine.getHistory().size() != (size_t)checkouts)
+            throw runtime_error("Order history does not match the approved payments.");
     }
+}
 
-    double calculateTotal() const {
-        double total = 0;
-        for (const auto& item : items) {
-            for (const auto& prod : catalog) {
-                if (prod.getId() == item.first)
-                    total += prod.getPrice() * item.second;
-            }
+// Group-by over a columnar order history of `lineCount` lines (about 8 per
+// order, a year of timestamps, 16 provinces) at 1, 2, 4... up to
+// `maxThreads` threads; every thread count must give the same totals
+void benchOrderAnalytics(int64_t lineCount, int maxThreads) {
+    static const char* const provinces[] = {"Metro Manila", "Cebu", "Davao del Sur", "Laguna", "Cavite", "Bulacan",
+                                            "Pampanga", "Batangas", "Rizal", "Iloilo", "Negros Occidental",
+                                            "Pangasinan", "Leyte", "Albay", "Benguet", "Misamis Oriental"};
+    const int products = 10000, users = 100000;
+    const int64_t yearStartMillis = 1735660800000; // 2025-01-01 +08:00
+    OrderHistory history;
+    mt19937 rng(11);
+    OrderRecord record;
+    auto start = chrono::steady_clock::now();
+    for (int64_t added = 0; added < lineCount;) {
+        record.lines.resize(min<int64_t>(1 + rng() % 15, lineCount - added));
+        record.totalCentavos = 0;
+        for (OrderLine& line : record.lines) {
+            line.productId = 1 + (int)(rng() % products);
+            line.quantity = 1 + (int)(rng() % 5);
+            line.amountCentavos = line.quantity * (int64_t)(100 + line.productId * 37 % 500000);
+            record.totalCentavos += line.amountCentavos;
         }
-        return total;
+        record.timestampMillis = yearStartMillis + (int64_t)(rng() % (365 * 86400)) * 1000;
+        record.method = (PaymentMethod)(1 + rng() % 3);
+        record.username = "user" + to_string(rng() % users);
+        record.province = provinces[rng() % 16];
+        history.add(record);
+        added += (int64_t)record.lines.size();
     }
+    double buildSeconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    cout << history.lineCount() << " order lines in " << history.size() << " orders, built in " << buildSeconds
+         << " s, " << history.lineCount() * (4 + 4 + 8 + 4 + 2 + 1) / 1e6 << " MB of line columns" << endl;
+    cout << "hardware threads: " << thread::hardware_concurrency() << endl;
 
-    bool isEmpty() const {
-        return items.empty();
+    OrderHistory::LineSnapshot lines = history.lines();
+    cout << "group by\tthreads\tgroups\tms\tlines/s\tspeedup" << endl;
+    static const char* const names[] = {"product", "province", "method", "day"};
+    bool matched = true;
+    for (OrderDimension by : {OrderDimension::Product, OrderDimension::Province, OrderDimension::Method,
+                              OrderDimension::Day}) {
+        vector<GroupTotal> expected;
+        double singleMs = 0;
+        for (int threads = 1; threads <= maxThreads; threads *= 2) {
+            vector<GroupTotal> groups;
+            double bestMs = 1e300;
+            for (int round = 0; round < 3; ++round) {
+                auto roundStart = chrono::steady_clock::now();
+                groups = aggregateOrderLines(lines, by, threads);
+                bestMs = min(bestMs, chrono::duration<double, milli>(chrono::steady_clock::now() - roundStart).count());
+            }
+            auto byKey = [](const GroupTotal& a, const GroupTotal& b) { return a.key < b.key; };
+            sort(groups.begin(), groups.end(), byKey);
+            if (threads == 1) {
+                expected = groups;
+                singleMs = bestMs;
+            } else {
+                matched = matched && groups.size() == expected.size() &&
+                          equal(groups.begin(), groups.end(), expected.begin(), [](const GroupTotal& a, const GroupTotal& b) {
+                              return a.key == b.key && a.revenueCentavos == b.revenueCentavos && a.units == b.units &&
+                                     a.lines == b.lines;
+                          });
+            }
+            cout << names[(int)by] << '\t' << threads << '\t' << groups.size() << '\t' << bestMs << '\t'
+                 << lines.rows / (bestMs / 1000) << '\t' << singleMs / bestMs << endl;
+        }
     }
+    if (!matched)
+        throw runtime_error("Totals differ between thread counts.");
+    cout << "OK: every thread count gave the same totals" << endl;
+}
 
-    // For receipt generation
-    const vector<pair<int, int>>& getItems() const {
-        return items;
+// Bulk user import of a generated file (1% bad emails, 0.5% short
+// passwords, 1% usernames repeated in the file and 1% already signed up)
+// at 1, 2, 4... up to maxThreads threads, vs. one signUp per line; and the
+// SWAR email check vs. the find-based one it replaced
+void benchUserImport(int recordCount, int maxThreads) {
+    auto scalarEmail = [](const string& email) {
+        size_t atPos = email.find('@');
+        if (atPos == string::npos || atPos == 0 || atPos == email.size() - 1)
+            return false;
+        size_t dotPos = email.find('.', atPos);
+        return dotPos != string::npos && dotPos != email.size() - 1;
+    };
+    mt19937 rng(5);
+    for (int i = 0; i < 1000000; ++i) {
+        string email(rng() % 20, 'a');
+        for (char& c : email)
+            c = "a@.x"[rng() % 4];
+        if (isValidEmail(email) != scalarEmail(email))
+            throw runtime_error("SWAR email check disagrees on \"" + email + "\".");
     }
 
-    const vector<Product>& getCatalog() const {
-        return catalog;
+    const int existingUsers = 100000;
+    RenderBuffer file;
+    file << "username,password,email\n";
+    vector<string> emails;
+    for (int i = 0; i < recordCount; ++i) {
+        int roll = (int)(rng() % 1000);
+        string username = roll < 10   ? "member" + to_string(rng() % existingUsers)
+                          : roll < 20 ? "shopper" + to_string(rng() % max(1, i))
+                                      : "shopper" + to_string(i);
+        string email = username + (roll >= 990 ? "@example" : "@example.com.ph");
+        file << username << ',' << (roll >= 980 && roll < 985 ? "pw" : "secret" + to_string(i % 977)) << ',' << email
+             << '\n';
+        emails.push_back(move(email));
     }
-};
-
-// ----------------------------- Payment Strategy (Interface) -----------------------------
-class PaymentStrategy {
-public:
-    virtual void pay(double amount) = 0;
-    virtual ~PaymentStrategy() = default;
-};
+    string text = file.str();
+    auto freshStore = [&](CredentialStore& store) {
+        for (int i = 0; i < existingUsers; ++i)
+            store.insert({"member" + to_string(i), "secret", "member" + to_string(i) + "@example.com"});
+    };
+    CatalogRef catalog = makeCatalogSnapshot(makeSyntheticProducts(10));
 
-class CreditCardPayment : public PaymentStrategy {
-public:
-    void pay(double amount) override {
-        cout<<"Paid Php "<<amount<<" using Credit Card."<<endl;
-    }
-};
+    size_t valid = 0;
+    auto start = chrono::steady_clock::now();
+    for (const string& email : emails)
+        valid += scalarEmail(email);
+    double scalarNs = chrono::duration<double, nano>(chrono::steady_clock::now() - start).count() / emails.size();
+    start = chrono::steady_clock::now();
+    size_t validSwar = 0;
+    for (const string& email : emails)
+        validSwar += isValidEmail(email);
+    double swarNs = chrono::duration<double, nano>(chrono::steady_clock::now() - start).count() / emails.size();
+    if (valid != validSwar)
+        throw runtime_error("SWAR email check disagrees on the generated emails.");
 
-class GcashPayment : public PaymentStrategy {
-public:
-    void pay(double amount) override {
-        cout<<"Paid Php "<<amount<<" using Gcash."<<endl;
+    cout << recordCount << " records, " << text.size() / 1e6 << " MB, " << existingUsers << " users already signed up"
+         << endl;
+    cout << "email check ns: find " << scalarNs << ", SWAR " << swarNs << endl;
+    cout << "method\tthreads\tadded\trejected\tms\trecords/s" << endl;
+    size_t expectedAdded = 0;
+    for (int threads = 1; threads <= maxThreads; threads *= 2) {
+        CredentialStore store;
+        freshStore(store);
+        ShopEngine engine(store, catalog, 1000);
+        UserImportResult result = engine.importUsers(text, threads);
+        if (threads == 1)
+            expectedAdded = result.added;
+        else if (result.added != expectedAdded)
+            throw runtime_error("Imports with different thread counts added different accounts.");
+        cout << "bulk\t" << threads << '\t' << result.added << '\t' << result.errors.size() << '\t'
+             << result.seconds * 1000 << '\t' << result.records / result.seconds << endl;
     }
-};
 
-class CashOnDeliver : public PaymentStrategy {
-    public:
-        void pay(double amount) override {
-            cout<<"Please pay "<<amount<<" upon delivery."<<endl;
+    CredentialStore store;
+    freshStore(store);
+    ShopEngine engine(store, catalog, 1000);
+    start = chrono::steady_clock::now();
+    istringstream lines(text);
+    string line;
+    size_t added = 0, rejected = 0;
+    getline(lines, line); // header
+    while (getline(lines, line)) {
+        size_t comma1 = line.find(','), comma2 = line.find(',', comma1 + 1);
+        try {
+            engine.signUp(line.substr(0, comma1), line.substr(comma1 + 1, comma2 - comma1 - 1), line.substr(comma2 + 1));
+            ++added;
+        } catch (const exception&) {
+            ++rejected;
         }
-};
+    }
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    cout << "signUp\t1\t" << added << '\t' << rejected << '\t' << seconds * 1000 << '\t' << recordCount / seconds
+         << endl;
+    if (added != expectedAdded)
+        throw runtime_error("Bulk import and signUp added different accounts.");
+    cout << "OK: every run signed up the same accounts" << endl;
+}
 
-// ----------------------------- Order Class -----------------------------
-class Order {
-private:
-    Cart& cart;
+// Memory per user at `userCount` users spread over a few thousand cities,
+// with the address string in each user vs. User, which pools the city and
+// province; and rendering every user's address block, which must not copy
+// a string
+void benchInterning(int userCount) {
+    static const char* const provinces[] = {"Metro Manila", "Cebu", "Davao del Sur", "Laguna", "Cavite", "Bulacan",
+                                            "Pampanga", "Batangas", "Rizal", "Iloilo", "Negros Occidental",
+                                            "Pangasinan", "Leyte", "Albay", "Benguet", "Misamis Oriental"};
+    const int cities = 3000;
+    vector<string> cityNames, usernames, emails;
+    for (int i = 0; i < cities; ++i)
+        cityNames.push_back("Poblacion District " + to_string(i) + " City");
+    mt19937 rng(3);
+    vector<int> homes;
+    for (int i = 0; i < userCount; ++i) {
+        usernames.push_back("shopper" + to_string(i));
+        emails.push_back(usernames.back() + "@example.com.ph");
+        homes.push_back((int)(rng() % cities));
+    }
 
-public:
-    Order(Cart& c) : cart(c) {}
+    // The users' own strings, as a session arena would hand them out
+    struct CountingResource : pmr::memory_resource {
+        size_t bytes = 0;
+        void* do_allocate(size_t size, size_t alignment) override {
+            bytes += size;
+            return pmr::new_delete_resource()->allocate(size, alignment);
+        }
+        void do_deallocate(void* p, size_t size, size_t alignment) override {
+            pmr::new_delete_resource()->deallocate(p, size, alignment);
+        }
+        bool do_is_equal(const memory_resource& other) const noexcept override { return this == &other; }
+    };
 
-    void checkout(PaymentStrategy* strategy) {
-        if (cart.isEmpty())
-            throw runtime_error("Cart is empty. Add items before checkout.");
-        double total = cart.calculateTotal();
-        strategy->pay(total);
-        cout << "Checkout complete. Thank you for your purchase!" << endl;
+    struct StringAddressUser {
+        pmr::string username, email, address;
+        size_t provinceStart;
+        StringAddressUser(pmr::memory_resource* resource) : username(resource), email(resource), address(resource) {}
+    };
+    CountingResource oldStrings;
+    vector<StringAddressUser> oldUsers;
+    oldUsers.reserve(userCount);
+    for (int i = 0; i < userCount; ++i) {
+        const string& city = cityNames[homes[i]];
+        StringAddressUser& user = oldUsers.emplace_back(&oldStrings);
+        user.username = usernames[i];
+        user.email = emails[i];
+        user.address.assign(city);
+        user.address += ", ";
+        user.address += provinces[homes[i] % 16];
+        user.provinceStart = city.size() + 2;
     }
-};
+    double oldBytes = sizeof(StringAddressUser) + double(oldStrings.bytes) / userCount;
 
-// ----------------------------- Receipt Generation -----------------------------
-void generateReceipt(const User& user, const Cart& cart, const string& paymentMethod) {
-    cout<<"\n--- Receipt ---\n";
-    cout<<"User: "<<user.getUsername()<<endl;
-    cout<<"Email: "<<user.getEmail()<<endl;
-    cout<<"Shipping Address: "<<user.getAddress()<<endl;
-    cout<<"Payment Method: "<<paymentMethod<<endl;
-    cout<<"Items Purchased:"<<endl;
-
-    double grandTotal = 0;
-    for (const auto& entry : cart.getItems()) {
-        int productId = entry.first;
-        int quantity = entry.second;
-        for (const auto& prod : cart.getCatalog()) {
-            if (prod.getId() == productId) {
-                double itemTotal = prod.getPrice() * quantity;
-                cout << "- " << prod.getName() << " x" << quantity << " - Php " << itemTotal << endl;
-                grandTotal += itemTotal;
-                break;
-            }
-        }
+    CountingResource newStrings;
+    vector<User> users;
+    users.reserve(userCount);
+    size_t poolBefore = heapBytes.load();
+    for (int i = 0; i < userCount; ++i) {
+        User& user = users.emplace_back(usernames[i], &newStrings);
+        user.setEmail(emails[i]);
+        user.setAddress(cityNames[homes[i]], provinces[homes[i] % 16]);
     }
-    cout << "\nTotal: Php " << grandTotal << endl;
-    cout << "---------------------" << endl;
-}
+    size_t poolBytes = heapBytes.load() - poolBefore; // the pool's text, index and views
+    double newBytes = sizeof(User) + double(newStrings.bytes + poolBytes) / userCount;
 
-// ----------------------------- Input Utility Functions -----------------------------
-int readInt(const string& prompt, int minValue, int maxValue) {
-    int choice;
-    while (true) {
-        cout << prompt;
-        if (cin >> choice && choice >= minValue && choice <= maxValue) {
-            cin.ignore(numeric_limits<streamsize>::max(), '\n');
-            return choice;
-        } else {
-            cout << "Invalid input. Please enter a number between " << minValue << " and " << maxValue << "." << endl;
-            cin.clear();
-            cin.ignore(numeric_limits<streamsize>::max(), '\n');
-        }
+    RenderBuffer out;
+    out << string(256, ' ');
+    size_t allocsBefore = heapAllocations.load();
+    auto start = chrono::steady_clock::now();
+    for (const User& user : users) {
+        out.clear();
+        out << "User: " << user.getUsername() << "\nEmail: " << user.getEmail()
+            << "\nShipping Address: " << user.getAddress() << '\n';
     }
-}
+    double renderNs = chrono::duration<double, nano>(chrono::steady_clock::now() - start).count() / userCount;
+    size_t renderAllocs = heapAllocations.load() - allocsBefore;
+    for (int i = 0; i < userCount; ++i)
+        if (users[i].getAddress().str() != string_view(oldUsers[i].address) ||
+            users[i].getProvince() != string_view(oldUsers[i].address).substr(oldUsers[i].provinceStart))
+            throw runtime_error("Interned address differs for " + usernames[i] + ".");
 
-string readNonEmptyLine(const string& prompt) {
-    string input;
-    do {
-        cout << prompt;
-        getline(cin, input);
-        if (input.empty()) {
-            cout << "Input cannot be empty. Please try again." << endl;
-        }
-    } while (input.empty());
-    return input;
+    cout << userCount << " users, " << cities << " cities, " << sharedStrings().size() << " pooled strings ("
+         << sharedStrings().bytes() << " bytes of text)" << endl;
+    cout << "layout\tbytes/user\t(object + strings)" << endl;
+    cout << "address strings\t" << oldBytes << "\t(" << sizeof(StringAddressUser) << " + "
+         << oldBytes - sizeof(StringAddressUser) << ")" << endl;
+    cout << "pooled city, province\t" << newBytes << "\t(" << sizeof(User) << " + " << newBytes - sizeof(User)
+         << ", of which the pool " << double(poolBytes) / userCount << ")" << endl;
+    cout << "saved: " << oldBytes - newBytes << " bytes/user (" << 100 * (1 - newBytes / oldBytes) << "%), "
+         << (oldBytes - newBytes) * userCount / 1e6 << " MB in all" << endl;
+    cout << "address block render: " << renderNs << " ns/user, " << renderAllocs << " heap allocations" << endl;
+    if (renderAllocs != 0)
+        throw runtime_error("Rendering an address allocated.");
+    cout << "OK: same addresses, no allocations to render them" << endl;
 }
 
-// ----------------------------- Email Validation Function -----------------------------
-bool isValidEmail(const string& email) {
-    size_t atPos = email.find('@');
-    if (atPos == string::npos || atPos == 0 || atPos == email.size() - 1)
-        return false;
-    size_t dotPos = email.find('.', atPos);
-    if (dotPos == string::npos || dotPos == email.size() - 1)
-        return false;
-    return true;
-}
+#ifdef SHOP_KIOSK
+// The compile-time kiosk catalog against the one built at runtime from the
+// same table: both must answer alike. Then the cost of opening a catalog
+// with makeKioskCatalog or makeDefaultCatalog and making the first lookup,
+// and the latency of a lookup (1 in 8 ids not sold), including the linear
+// scan over Products the shop started with.
+void benchKioskCatalog(int lookups) {
+    CatalogRef runtime = makeDefaultCatalog(), kiosk = makeKioskCatalog();
+    bool same = runtime->size() == kiosk->size() && runtime->categoryCount() == kiosk->categoryCount();
+    for (int slot = 0; same && slot < (int)runtime->size(); ++slot)
+        same = runtime->idAt(slot) == kiosk->idAt(slot) && runtime->nameAt(slot) == kiosk->nameAt(slot) &&
+               runtime->priceAt(slot) == kiosk->priceAt(slot);
+    for (int id = -1000; same && id <= 1000; ++id)
+        same = runtime->findSlot(id) == kiosk->findSlot(id);
+    for (int c = 0; same && c < (int)runtime->categoryCount(); ++c) {
+        SlotList a = runtime->categorySlots(c), b = kiosk->categorySlots(c);
+        same = runtime->categoryName(c) == kiosk->categoryName(c) && equal(a.begin(), a.end(), b.begin(), b.end());
+    }
+    if (!same)
+        throw runtime_error("The kiosk catalog differs from the runtime one.");
 
-// ----------------------------- User Authentication -----------------------------
-struct Credential {
-    string username;
-    string password;
-    string email;
-};
+    const int opens = 20000;
+    volatile int sink = 0;
+    Measurement runtimeOpen, kioskOpen;
+    runtimeOpen.run(opens, [&] {
+        for (int i = 0; i < opens; ++i)
+            sink = makeDefaultCatalog()->findSlot(7);
+    });
+    kioskOpen.run(opens, [&] {
+        for (int i = 0; i < opens; ++i)
+            sink = makeKioskCatalog()->findSlot(7);
+    });
 
-vector<Credential> credentials;
+    vector<Product> products;
+    for (int slot = 0; slot < (int)runtime->size(); ++slot)
+        products.push_back(runtime->productAt(slot));
+    mt19937 rng(9);
+    vector<int> ids(1 << 16);
+    for (int& id : ids)
+        id = rng() % 8 == 0 ? 1000 + (int)(rng() % 1000) : runtime->idAt((int)(rng() % runtime->size()));
+    auto lookupNs = [&](auto find) {
+        int found = 0;
+        double ns = nanosPerOp(lookups, [&, i = size_t(0)]() mutable { found += find(ids[i++ & (ids.size() - 1)]) >= 0; });
+        sink = found;
+        return ns;
+    };
+    double linearNs = lookupNs([&](int id) {
+        for (size_t slot = 0; slot < products.size(); ++slot)
+            if (products[slot].getId() == id)
+                return (int)slot;
+        return -1;
+    });
+    double runtimeNs = lookupNs([&](int id) { return runtime->findSlot(id); });
+    double kioskNs = lookupNs([&](int id) { return kiosk->findSlot(id); });
 
-bool isValidCredential(const string& input) {
-    return input.length() >= 3;
+    cout << kiosk->size() << " products, " << kiosk->categoryCount() << " categories, perfect hash table of "
+         << kiosk->getColumns().idTableSize << " slots" << endl;
+    cout << "catalog\topen+first lookup ns\tallocs\tbytes\tlookup ns" << endl;
+    cout << "Product vector (linear)\t-\t-\t-\t" << linearNs << endl;
+    cout << "runtime snapshot\t" << runtimeOpen.nanos / opens << '\t' << double(runtimeOpen.allocations) / opens
+         << '\t' << double(runtimeOpen.bytes) / opens << '\t' << runtimeNs << endl;
+    cout << "kiosk (constexpr columns)\t" << kioskOpen.nanos / opens << '\t' << double(kioskOpen.allocations) / opens
+         << '\t' << double(kioskOpen.bytes) / opens << '\t' << kioskNs << endl;
+    if (kioskOpen.allocations != 0)
+        throw runtime_error("Opening the kiosk catalog allocated.");
+    cout << "OK: same catalog, no heap to open the kiosk one" << endl;
 }
+#endif
 
-User* signUp() {
-    cout << "\n--- Sign Up ---" << endl;
+int runBenchmarks(const string& name, const vector<string>& args) {
+    if (!countingAllocations)
+        cerr << "Note: allocation counts read 0 in this build; build with -DSHOP_COUNT_ALLOCATIONS to count them."
+             << endl;
+#ifdef SHOP_KIOSK
+    if (name == "kiosk") {
+        benchKioskCatalog(args.empty() ? 10000000 : stoi(args[0]));
+        return 0;
+    }
+#endif
+    if (name == "interning") {
+        benchInterning(args.empty() ? 1000000 : stoi(args[0]));
+        return 0;
+    }
+    if (name == "users") {
+        benchUserImport(args.empty() ? 2000000 : stoi(args[0]),
+                        args.size() > 1 ? stoi(args[1]) : (int)max(1u, thread::hardware_concurrency()));
+        return 0;
+    }
+    if (name == "analytics") {
+        benchOrderAnalytics(args.empty() ? 100000000 : stoll(args[0]), args.size() > 1 ? stoi(args[1]) : 8);
+        return 0;
+    }
+    if (name == "import") {
+        benchCartImport(args.empty() ? 1000000 : stoi(args[0]));
+        return 0;
+    }
+    if (name == "stats") {
+        benchOperationStats(args.empty() ? 2000 : stoi(args[0]));
+        return 0;
+    }
+    if (name == "reload") {
+        benchCatalogReload(args.empty() ? 10 : stoi(args[0]), args.size() > 1 ? stoi(args[1]) : 8);
+        return 0;
+    }
+    if (name == "totals") {
+        benchRunningTotals();
+        return 0;
+    }
+    if (name == "arena") {
+        benchSessionArena(args.empty() ? 100000 : stoi(args[0]));
+        return 0;
+    }
+    if (name == "cartlines") {
+        benchCartLines();
+        return 0;
+    }
+    if (name == "payments") {
+        benchPayments(args.empty() ? 50 : stoi(args[0]), args.size() > 1 ? stoi(args[1]) : 8,
+                      args.size() > 2 ? stod(args[2]) : 0.01);
+        return 0;
+    }
+    if (name == "search") {
+        benchSearch(args.empty() ? 5000000 : stoi(args[0]));
+        return 0;
+    }
+    if (name == "categories") {
+        benchCategories(args.empty() ? 1000000 : stoi(args[0]));
+        return 0;
+    }
+    if (name == "catalog") {
+        benchCatalogStartup(args.empty() ? 5000000 : stoi(args[0]));
+        return 0;
+    }
+#ifdef SHOP_POSIX
+    if (name == "journal") {
+        benchJournal(args.empty() ? 100000000 : stoul(args[0]), args.size() > 1 ? stoi(args[1]) : 4);
+        return 0;
+    }
+#endif
+    if (name == "receipts") {
+        benchReceipts(args.empty() ? 1000000 : stoul(args[0]));
+        return 0;
+    }
+    if (name == "inventory") {
+        benchInventory(args.empty() ? 64 : stoi(args[0]));
+        return 0;
+    }
+    if (name == "suite") {
+        benchSuite(args.empty() ? "bench_results.json" : args[0]);
+        return 0;
+    }
+    if (name == "credentials") {
+        benchCredentials(args.empty() ? 10000000 : stoul(args[0]));
+        return 0;
+    }
+    if (name == "columnar") {
+        benchColumnarTotals();
+        return 0;
+    }
+    if (name == "lookup") {
+        benchLookup();
+        return 0;
+    }
+    if (name == "sessions") {
+        benchSessionMemory();
+        return 0;
+    }
+    cerr << "Unknown benchmark: " << name << endl;
+    return 1;
+}
 
-    // Username input and validation
-    string username;
-    while (true) {
-        username = readNonEmptyLine("Enter a username (min. 3 characters): ");
-        if (!isValidCredential(username)) {
-            cout << "Username must be at least 3 characters long." << endl;
-            continue;
-        }
-        // Check if username exists
-        bool exists = false;
-        for (const auto& cred : credentials) {
-            if (cred.username == username) {
-                exists = true;
-                break;
-            }
+int main(int argc, char* argv[]) {
+#ifdef SHOP_POSIX
+    dumpStatsOnSignal();
+#endif
+    if (argc > 2 && string(argv[1]) == "--bench")
+        return runBenchmarks(argv[2], vector<string>(argv + 3, argv + argc));
+
+    // Converter: ./Inteprog_Final --catalog-convert <products.csv> <catalog.bin>
+    if (argc > 3 && string(argv[1]) == "--catalog-convert") {
+        ifstream csv(argv[2]);
+        if (!csv) {
+            cerr << "Cannot open " << argv[2] << endl;
+            return 1;
         }
-        if (exists) {
-            cout << "Username already exists. Please try logging in." << endl;
-            continue;
+        try {
+            CatalogRef catalog = makeCatalogSnapshot(readCatalogCsv(csv));
+            writeCatalogFile(*catalog, argv[3]);
+            cout << "Wrote " << catalog->size() << " products to " << argv[3] << endl;
+        } catch (const exception& e) {
+            cerr << e.what() << endl;
+            return 1;
         }
-        break;
+        return 0;
     }
 
-    // Password input and validation
-    string password;
-    while (true) {
-        password = readNonEmptyLine("Enter a password (min. 3 characters): ");
-        if (!isValidCredential(password)) {
-            cout << "Password must be at least 3 characters long." << endl;
-            continue;
+    // Any mode: --catalog <file> sells the products in a binary catalog
+    // file (mapped in place) or a CSV file instead of the built-in list
+    vector<string> args(argv, argv + argc);
+    CatalogRef catalog;
+    for (size_t i = 1; i + 1 < args.size(); ++i) {
+        if (args[i] == "--catalog") {
+            auto start = chrono::steady_clock::now();
+            try {
+                catalog = loadCatalog(args[i + 1]);
+            } catch (const exception& e) {
+                cerr << e.what() << endl;
+                return 1;
+            }
+            cerr << "Loaded " << catalog->size() << " products from " << args[i + 1] << " in "
+                 << chrono::duration<double, milli>(chrono::steady_clock::now() - start).count() << " ms" << endl;
+            args.erase(args.begin() + i, args.begin() + i + 2);
+            break;
         }
-        break;
     }
 
-    // Email input and validation
-    string email;
-    while (true) {
-        email = readNonEmptyLine("Enter your email address: ");
-        if (isValidEmail(email))
+    // Built once and shared read-only by every session's cart
+#ifdef SHOP_KIOSK
+    ShopEngine engine(credentials, catalog ? catalog : makeKioskCatalog());
+#else
+    ShopEngine engine(credentials, catalog ? catalog : makeDefaultCatalog());
+#endif
+
+    // Any mode: --users <file> [threads] signs up the accounts in a file of
+    // username,password,email lines before the shop opens
+    for (size_t i = 1; i + 1 < args.size(); ++i) {
+        if (args[i] == "--users") {
+            bool hasThreads = i + 2 < args.size() && isdigit((unsigned char)args[i + 2][0]);
+            int threads = hasThreads ? stoi(args[i + 2]) : (int)max(1u, thread::hardware_concurrency());
+            try {
+                RenderBuffer report;
+                renderUserImport(report, engine.importUsers(readImportFile(args[i + 1]), threads));
+                report.writeTo(stderr);
+            } catch (const exception& e) {
+                cerr << e.what() << endl;
+                return 1;
+            }
+            args.erase(args.begin() + i, args.begin() + i + (hasThreads ? 3 : 2));
             break;
-        cout << "Invalid email format. Please try again." << endl;
+        }
     }
 
-    credentials.push_back({username, password, email});
-    cout << "Sign-up successful!" << endl;
-
-    User* newUser = new User(username);
-    newUser->setEmail(email);
-    return newUser;
-}
+    // Any mode: --receipts <file> [text|compact] appends every receipt to file
+    unique_ptr<ReceiptWriter> receiptLog;
+    for (size_t i = 1; i + 1 < args.size(); ++i) {
+        if (args[i] == "--receipts") {
+            bool compact = i + 2 < args.size() && args[i + 2] == "compact";
+            bool text = i + 2 < args.size() && args[i + 2] == "text";
+            receiptLog.reset(new ReceiptWriter(args[i + 1], compact ? ReceiptFormat::Compact : ReceiptFormat::Text));
+            engine.setReceiptLog(receiptLog.get());
+            args.erase(args.begin() + i, args.begin() + i + (compact || text ? 3 : 2));
+            break;
+        }
+    }
 
-User* logIn() {
-    cout << "\n--- Log In ---" << endl;
-    string username = readNonEmptyLine("Enter your username: ");
-    string password = readNonEmptyLine("Enter your password: ");
-    for (const auto& cred : credentials) {
-        if (cred.username == username && cred.password == password) {
-            cout << "Log in successful!" << endl;
-            User* user = new User(username);
-            user->setEmail(cred.email);
-            return user;
+#ifdef SHOP_POSIX
+    // Any mode: --journal <file> [sync ms] records every order durably and
+    // restores the order history from it at startup
+    unique_ptr<OrderJournal> journal;
+    for (size_t i = 1; i + 1 < args.size(); ++i) {
+        if (args[i] == "--journal") {
+            bool hasInterval = i + 2 < args.size() && isdigit((unsigned char)args[i + 2][0]);
+            int syncMs = hasInterval ? stoi(args[i + 2]) : 10;
+            auto start = chrono::steady_clock::now();
+            OrderHistory& history = engine.getHistory();
+            try {
+                journal.reset(new OrderJournal(args[i + 1], syncMs, [&history](const OrderJournal::RecordView& record) {
+                    history.add(record.toRecord());
+                }));
+            } catch (const exception& e) {
+                cerr << "Cannot replay journal " << args[i + 1] << " (order " << history.size() + 1
+                     << "): " << e.what() << endl;
+                return 1;
+            }
+            cerr << "Replayed " << history.size() << " orders from " << args[i + 1] << " in "
+                 << chrono::duration<double, milli>(chrono::steady_clock::now() - start).count() << " ms" << endl;
+            if (journal->skippedBytes())
+                cerr << "Skipped " << journal->skippedBytes() << " damaged bytes in " << args[i + 1] << endl;
+            engine.setJournal(journal.get());
+            args.erase(args.begin() + i, args.begin() + i + (hasInterval ? 3 : 2));
+            break;
         }
     }
-    throw runtime_error("Invalid username or password.");
-}
+#endif
 
-void displayCatalog(const vector<Product>& catalog) {
-    cout << "\n--- Product Catalog ---" << endl;
-    for (const auto& product : catalog) {
-        cout << "ID: " << product.getId()
-             << " | Name: " << product.getName()
-             << " | Price: Php " << product.getPrice() << endl;
+    // Any mode: --gateway <latency ms> [failure rate] sends every payment
+    // through the dispatcher to an in-process stub gateway
+    unique_ptr<StubGateway> gateway;
+    unique_ptr<PaymentDispatcher> payments;
+    for (size_t i = 1; i + 1 < args.size(); ++i) {
+        if (args[i] == "--gateway") {
+            bool hasRate = i + 2 < args.size() && (isdigit((unsigned char)args[i + 2][0]) || args[i + 2][0] == '.');
+            gateway.reset(new StubGateway(chrono::milliseconds(stoi(args[i + 1])), hasRate ? stod(args[i + 2]) : 0.0));
+            payments.reset(new PaymentDispatcher(*gateway));
+            engine.setPaymentDispatcher(payments.get());
+            args.erase(args.begin() + i, args.begin() + i + (hasRate ? 3 : 2));
+            break;
+        }
     }
-}
+    argc = (int)args.size();
 
-void promptAndSetShippingAddress(User* user) {
-    string city = readNonEmptyLine("Enter your shipping city: ");
-    string province = readNonEmptyLine("Enter your shipping province: ");
-    user->setAddress(city + ", " + province);
-    cout << "Shipping to: " << user->getAddress() << endl;
-}
+#ifdef SHOP_POSIX
+    // Server mode: ./Inteprog_Final --server <port> [workers]
+    if (argc > 2 && args[1] == "--server") {
+        int workers = argc > 3 ? stoi(args[3]) : (int)max(1u, thread::hardware_concurrency());
+        ShopServer server(engine, workers);
+        int port = server.start(stoi(args[2]));
+        cerr << "Serving on 127.0.0.1:" << port << " with " << workers << " workers" << endl;
+        while (true)
+            this_thread::sleep_for(chrono::hours(1));
+    }
 
-void mainMenu(){
-    cout<<"-------------------------------------------\n";
-    cout<<"1. Display Products.\n";
-    cout<<"2. Add/Update Shipping Information.\n";
-    cout<<"3. View Cart. \n";
-    cout<<"4. Sign Out/Exit \n";
-    cout<<"-------------------------------------------\n";
-}
+    // Load driver: ./Inteprog_Final --load <port> [clients] [requests per client]
+    // or --load-sweep [clients] [requests per client] against in-process servers
+    if (argc > 1 && args[1] == "--load-sweep") {
+        runLoadSweep(argc > 2 ? stoi(args[2]) : 64, argc > 3 ? stoi(args[3]) : 2000);
+        return 0;
+    }
+    if (argc > 2 && args[1] == "--load") {
+        LoadResult r = runLoad(stoi(args[2]), argc > 3 ? stoi(args[3]) : 64, argc > 4 ? stoi(args[4]) : 2000,
+                               "load" + to_string(chrono::system_clock::now().time_since_epoch().count()) + "_");
+        cout << r.requests << " requests in " << r.seconds << " s, " << r.requests / r.seconds << " req/s, p50 "
+             << r.p50Micros << " us, p99 " << r.p99Micros << " us, " << r.failures << " failed" << endl;
+        return 0;
+    }
+#endif
 
+    // Non-interactive mode: ./Inteprog_Final --replay <script> ("-" for stdin)
+    if (argc > 2 && args[1] == "--replay") {
+        if (args[2] == "-")
+            return replayScript(engine, cin);
+        ifstream script(args[2]);
+        if (!script) {
+            cerr << "Cannot open script: " << args[2] << endl;
+            return 1;
+        }
+        return replayScript(engine, script);
+    }
 
-int main() {
     try {
-        User* user = nullptr; 
+        ShopSession session;
         while (true) { 
             // Authentication loop
-            while (user == nullptr) {
+            while (!session.user) {
                 cout << "Welcome! Please choose an option:" << endl;
                 cout << "1. Sign Up" << endl;
                 cout << "2. Log In" << endl;
@@ -381,7 +7883,7 @@ int main() {
                     bool signedUp = false;
                     while (!signedUp) {
                         try {
-                            signUp();
+                            signUp(engine);
                             cout << "You may now log in with your new credentials.\n";
                             signedUp = true;
                         } catch (const exception& e) {
@@ -389,11 +7891,11 @@ int main() {
                         }
                     }
                 } else {
-                    if (credentials.empty()) {
+                    if (!engine.hasUsers()) {
                         cout << "No users exist yet. Please sign up first.\n";
                     } else {
                         try {
-                            user = logIn();
+                            logIn(engine, session);
                         } catch (const exception& e) {
                             cout << e.what() << endl;
                         }
@@ -401,68 +7903,25 @@ int main() {
                 }
             }
 
-            vector<Product> catalog = {
-                Product(1, "Laptop", 32456.75),
-                Product(2, "Mouse", 876.54),
-                Product(3, "Keyboard", 1234.56),
-                Product(4, "Headset", 5432.11 ),
-                Product(5, "Earphones", 245.55),
-                Product(6, "Controller", 999.99),
-                Product(7, "Mousepad", 350.55),
-                Product(8, "Laptop Cooler", 999.99),
-                Product(9, "USB Flash Drive", 500.00),
-                Product(10, "Gaming Chair: Monobloc Edition", 4444.44),
-                Product(11, "Gaming Monitor 24hz", 2400.24)
-
-            };
-
-            Cart cart;
-            cart.setCatalog(catalog);
+            User* user = session.user.get();
 
             // Main Menu Loop
             bool shopping = true;
             while (shopping) {
                 mainMenu();
-                int menuChoice = readInt("Choose an option: ", 1, 4);
+                int menuChoice = readMenuChoice("Choose an option: ", 1, 7);
 
                 switch (menuChoice) {
                     case 1: {
-                        displayCatalog(catalog);
-
-                        string addChoice;
-                        while (true) {
-                            cout << "\nWould you like to add an item to your cart? (y/n): ";
-                            getline(cin, addChoice);
-                            if (addChoice == "y" || addChoice == "Y") {
-                                int prodId = readInt("Enter Product ID to add: ", 1, (int)catalog.size());
-                                int qty = readInt("Enter quantity: ", 1, 100);
-
-                                // Find product by ID
-                                bool found = false;
-                                for (const auto& prod : catalog) {
-                                    if (prod.getId() == prodId) {
-                                        cart.addProduct(prod, qty);
-                                        found = true;
-                                        break;
-                                    }
-                                }
-                                if (!found) {
-                                    cout << "Product not found.\n";
-                                }
-
-                            } else if (addChoice == "n" || addChoice == "N") {
-                                break;
-                            } else {
-                                cout << "Invalid input. Please enter 'y' or 'n'.\n";
-                            }
-                        }
+                        displayCatalog(*engine.getCatalog());
+                        promptAddToCart(engine, session);
                         break;
                     }
                     case 2: {
                         cout << "\n--- Shipping Information ---\n";
-                        string currentAddress = user->getAddress();
+                        AddressView currentAddress = user->getAddress();
                         if (currentAddress.empty()) {
-                            promptAndSetShippingAddress(user);
+                            promptAndSetShippingAddress(engine, session);
                         } else {
                             cout << "Current shipping address: " << currentAddress << endl;
                             cout << "1. Update shipping information\n";
@@ -470,9 +7929,9 @@ int main() {
                             cout << "3. Cancel\n";
                             int shipChoice = readInt("Choose an option: ", 1, 3);
                             if (shipChoice == 1) {
-                                promptAndSetShippingAddress(user);
+                                promptAndSetShippingAddress(engine, session);
                             } else if (shipChoice == 2) {
-                                user->setAddress("");
+                                engine.clearShippingAddress(session);
                                 cout << "Shipping information removed.\n";
                             } else {
                                 cout << "No changes made.\n";
@@ -483,7 +7942,7 @@ int main() {
                     case 3: {
                         bool inCartMenu = true;
                         while (inCartMenu) {
-                            cart.showCart();
+                            engine.showCart(session, cout);
                             cout << "\nCart Options:\n";
                             cout << "1. Remove an item/Update Quantity\n";
                             cout << "2. Proceed to Checkout\n";
@@ -494,17 +7953,18 @@ int main() {
                                 case 1: {
                                     cout << "\nWould you like to (1) Remove an item or (2) Update item quantity? " <<endl;
                                     int action = readInt("Enter 1 to remove, 2 to update quantity: ", 1, 2);
-                                    int prodId = readInt("Enter Product ID: ", 1, (int)catalog.size());
+                                    int prodId = readProductId(engine, "Enter Product ID: ");
                                     if (action == 1) {
                                         try {
-                                            cart.removeProduct(prodId);
+                                            engine.removeFromCart(session, prodId);
+                                            cout << "Removed product ID " << prodId << " from cart." << endl;
                                         } catch (const exception& e) {
                                             cout << e.what() << endl;
                                         }
                                     } else if (action == 2) {
                                         int newQty = readInt("Enter new quantity: ", 1, 100);
                                         try {
-                                            cart.updateQuantity(prodId, newQty);
+                                            engine.updateQuantity(session, prodId, newQty);
                                             cout << "Quantity updated.\n";
                                         } catch (const exception& e) {
                                             cout << e.what() << endl;
@@ -514,44 +7974,28 @@ int main() {
                                 }
                                 case 2: {
                                     // Proceed to checkout
-                                    if (cart.isEmpty()) {
+                                    if (session.cart.isEmpty()) {
                                         cout << "Your cart is empty. Add items before checking out.\n";
                                         break;
                                     }
                                     // Check for shipping address
                                     if (user->getAddress().empty()) {
                                         cout << "No shipping address found.\n";
-                                        promptAndSetShippingAddress(user);
+                                        promptAndSetShippingAddress(engine, session);
                                     }
 
-                                    Order order(cart);
                                     cout << "\nChoose payment method:" << endl;
                                     cout << "1. Credit Card" << endl;
                                     cout << "2. Gcash" << endl;
                                     cout << "3. Cash On Delivery" << endl;
                                     int paymentChoice = readInt("Enter your choice (1, 2, or 3): ", 1, 3);
 
-                                    PaymentStrategy* strategy = nullptr;
-                                    string paymentMethod;
-                                    if (paymentChoice == 1) {
-                                        strategy = new CreditCardPayment();
-                                        paymentMethod = "Credit Card";
-                                    } else if (paymentChoice == 2) {
-                                        strategy = new GcashPayment();
-                                        paymentMethod = "Gcash";
-                                    } else if (paymentChoice == 3) {
-                                        strategy = new CashOnDeliver();
-                                        paymentMethod = "Cash On Delivery";
-                                    } else {
-                                        throw runtime_error("Invalid payment option.");
+                                    try {
+                                        engine.checkout(session, static_cast<PaymentMethod>(paymentChoice), cout);
+                                        inCartMenu = false;
+                                    } catch (const exception& e) {
+                                        cout << e.what() << endl;
                                     }
-
-                                    order.checkout(strategy);
-                                    delete strategy;
-                                    generateReceipt(*user, cart, paymentMethod);
-                                    inCartMenu = false;
-                                    cart = Cart();
-                                    cart.setCatalog(catalog);
                                     break;
                                 }
                                 case 3:
@@ -561,7 +8005,16 @@ int main() {
                         }
                         break;
                     }
-                    case 4: {
+                    case 4:
+                        browseByCategory(engine, session);
+                        break;
+                    case 5:
+                        searchProducts(engine, session);
+                        break;
+                    case 6:
+                        importCart(engine, session);
+                        break;
+                    case 7: {
                         cout << "Would you like to:\n";
                         cout << "1. Sign Out (return to login/signup)\n";
                         cout << "2. Exit the program\n";
@@ -571,7 +8024,6 @@ int main() {
                             shopping = false; // Exit main menu loop
                         } else {
                             cout << "Exiting the program. Thank you for visiting!\n";
-                            delete user;
                             return 0;
                         }
                         break;
@@ -581,12 +8033,11 @@ int main() {
                 }
             }
 
-            delete user;
-            user = nullptr; // This will restart the authentication loop
+            engine.signOut(session); // This will restart the authentication loop
         }
     } catch (const exception& e) {
         cerr << "Error: " << e.what() << endl;
     }
 
     return 0;
-}
\ No newline at end of file
+}
@@ -38,8 +38,8 @@ class Item{
         this->price = price;
     }
 
-    void setCategory(string catergory){
-        this-> category = category;
+    void setCategory(string category){
+        this->category = category;
     }
 
     //Getters